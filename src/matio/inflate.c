@@ -30,6 +30,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <limits.h>
 #include "matio_private.h"
 
 #if HAVE_ZLIB
@@ -103,6 +104,9 @@ InflateSkip(mat_t *mat, z_streamp z, int nbytes)
         bytesread -= z->avail_in;
         z->avail_in = 0;
     }
+    /* Do not leave the stream pointing to the local buffer */
+    z->next_out  = NULL;
+    z->avail_out = 0;
 
     return bytesread;
 }
@@ -702,6 +706,92 @@ InflateData(mat_t *mat, z_streamp z, void *buf, int nBytes)
     return bytesread;
 }
 
+/** @brief Inflates the data with one read of the compressed variable
+ *
+ * Reads the compressed data of @c nBytes bytes from the file with one
+ * read and inflates it into @c buf with one call of inflate.  The read
+ * is bounded by the end of the compressed variable,
+ * @c matvar->internal->zend, and by the most that deflate can expand
+ * @c nBytes bytes to, so that a cell or field does not read the rest of
+ * the variable it is nested in.  Should the data need more, the rest is
+ * read and inflated in further chunks of the same size.  The file is
+ * then positioned after the compressed data that was used, as by
+ * InflateData.  buf must hold at least @c nBytes bytes
+ * @ingroup mat_internal
+ * @param mat Pointer to the MAT file
+ * @param matvar Pointer to the MAT variable
+ * @param buf Pointer to store the data
+ * @param nBytes Number of bytes to inflate
+ * @retval 0 if the data has been inflated
+ * @retval -1 if the end of the variable is unknown or the compressed data
+ *         could not be allocated, in which case nothing has been read and
+ *         the data is to be inflated with InflateData
+ * @retval 1 if the data could not be inflated, after Mat_Critical, in
+ *         which case the contents of buf are undefined
+ */
+int
+InflateDataWhole(mat_t *mat, matvar_t *matvar, void *buf, size_t nBytes)
+{
+    z_streamp z = matvar->internal->z;
+    mat_uint8_t *comp_buf;
+    long   pos;
+    size_t comp_size;
+    int    err;
+
+    if ( buf == NULL || nBytes < 1 || nBytes > UINT_MAX || z->avail_in ||
+         matvar->internal->zend <= 0 )
+        return -1;
+    pos = ftell((FILE*)mat->fp);
+    if ( pos == -1L || pos >= matvar->internal->zend )
+        return -1;
+    /* Room for the block headers of a stream that continues from the
+     * data before, in addition to the bound of a new stream */
+    comp_size = compressBound((uLong)nBytes) + 1024;
+    if ( comp_size > (size_t)(matvar->internal->zend - pos) )
+        comp_size = matvar->internal->zend - pos;
+    if ( comp_size > UINT_MAX )
+        return -1;
+    comp_buf = (mat_uint8_t*)malloc(comp_size);
+    if ( comp_buf == NULL )
+        return -1;
+
+    z->avail_out = nBytes;
+    z->next_out  = (Bytef*)buf;
+    do {
+        size_t n = comp_size;
+        if ( n > (size_t)(matvar->internal->zend - pos) )
+            n = matvar->internal->zend - pos;
+        n = fread(comp_buf,1,n,(FILE*)mat->fp);
+        if ( n == 0 ) {
+            err = Z_BUF_ERROR;
+            break;
+        }
+        pos += n;
+        z->avail_in = n;
+        z->next_in  = comp_buf;
+        err = inflate(z,Z_FULL_FLUSH);
+    } while ( z->avail_out && !z->avail_in && err == Z_OK &&
+              pos < matvar->internal->zend );
+
+    if ( z->avail_in ) {
+        long offset = -(long)z->avail_in;
+        (void)fseek((FILE*)mat->fp,offset,SEEK_CUR);
+        z->avail_in = 0;
+    }
+    z->next_in = NULL;
+    free(comp_buf);
+
+    if ( err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR ) {
+        Mat_Critical("InflateData: inflate returned %s",zError(err == Z_NEED_DICT ? Z_DATA_ERROR : err));
+        return 1;
+    } else if ( z->avail_out ) {
+        Mat_Critical("InflateData: variable ends before the data");
+        return 1;
+    }
+
+    return 0;
+}
+
 /** @brief Inflates the structure's fieldname length
  *
  * buf must hold at least 8 bytes
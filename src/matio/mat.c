@@ -41,6 +41,12 @@
 /* Stefan Widgren 2014-01-05: Include only header files neccessary to
  * build the rmatio package */
 
+/* fopencookie, for MAT files created in memory */
+#ifndef _GNU_SOURCE
+#   define _GNU_SOURCE
+#endif
+#include <stdarg.h>
+#include <string.h>
 #include <Rdefines.h>
 #include "config.h"
 #include "matio_private.h"
@@ -119,6 +125,88 @@ Mat_SizeOf(enum matio_types data_type)
     }
 }
 
+/** @cond 0 */
+#if defined(_MSC_VER)
+#   define MAT_THREAD_LOCAL __declspec(thread)
+#else
+#   define MAT_THREAD_LOCAL __thread
+#endif
+/** @endcond */
+
+/* Messages of the calling thread, see Mat_LogCapture */
+static MAT_THREAD_LOCAL mat_log_t *mat_log = NULL;
+
+/** @brief Collects the messages of the calling thread
+ *
+ * R must only be called from the main thread, so a thread reading a MAT
+ * file in the background collects the messages of Mat_Critical and
+ * Mat_Warning in @c log instead, for the main thread to report them.
+ * Mat_Critical then returns to its caller, which gives up and returns an
+ * error, as in the matio library.
+ * @ingroup MAT
+ * @param log Pointer to the messages, or NULL to call R again
+ */
+void
+Mat_LogCapture(mat_log_t *log)
+{
+    if ( NULL != log ) {
+        log->critical   = 0;
+        log->message[0] = '\0';
+        log->warning[0] = '\0';
+    }
+    mat_log = log;
+}
+
+/** @brief Logs a critical message
+ *
+ * Calls Rf_error, which does not return, unless the messages of the
+ * calling thread are collected with Mat_LogCapture.
+ * @ingroup MAT
+ * @param format format string
+ * @param ... arguments to the format string
+ */
+void
+Mat_Critical(const char *format, ...)
+{
+    char message[MAT_LOG_SIZE];
+    va_list ap;
+
+    va_start(ap,format);
+    vsnprintf(message,sizeof(message),format,ap);
+    va_end(ap);
+
+    if ( NULL == mat_log )
+        Rf_error("%s",message);
+    if ( !mat_log->critical ) {
+        mat_log->critical = 1;
+        memcpy(mat_log->message,message,sizeof(message));
+    }
+}
+
+/** @brief Logs a warning message
+ *
+ * Calls Rf_warning, unless the messages of the calling thread are
+ * collected with Mat_LogCapture.
+ * @ingroup MAT
+ * @param format format string
+ * @param ... arguments to the format string
+ */
+void
+Mat_Warning(const char *format, ...)
+{
+    char message[MAT_LOG_SIZE];
+    va_list ap;
+
+    va_start(ap,format);
+    vsnprintf(message,sizeof(message),format,ap);
+    va_end(ap);
+
+    if ( NULL == mat_log )
+        Rf_warning("%s",message);
+    else if ( '\0' == mat_log->warning[0] )
+        memcpy(mat_log->warning,message,sizeof(message));
+}
+
 mat_complex_split_t *
 ComplexMalloc(size_t nbytes)
 {
@@ -141,6 +229,254 @@ ComplexMalloc(size_t nbytes)
     return complex_data;
 }
 
+/** Size of an arena block, unless a larger allocation is requested */
+#define MAT_ARENA_BLOCK_SIZE 65536
+/** Alignment of the memory handed out by an arena */
+#define MAT_ARENA_ALIGN 16
+
+/** @brief Creates an empty arena
+ *
+ * @ingroup mat_internal
+ * @return Pointer to the arena or NULL on failure
+ */
+struct mat_arena *
+Mat_ArenaCreate(void)
+{
+    struct mat_arena *arena = (struct mat_arena*)malloc(sizeof(*arena));
+    if ( NULL != arena )
+        arena->blocks = NULL;
+    return arena;
+}
+
+/** @brief Allocates memory from an arena
+ *
+ * The memory is not initialized and is only released by Mat_ArenaFree.
+ * @ingroup mat_internal
+ * @param arena Pointer to the arena
+ * @param nbytes Number of bytes to allocate
+ * @return Pointer to the memory or NULL on failure
+ */
+void *
+Mat_ArenaAlloc(struct mat_arena *arena,size_t nbytes)
+{
+    const size_t header = (sizeof(struct mat_arena_block) + MAT_ARENA_ALIGN - 1) &
+                          ~(size_t)(MAT_ARENA_ALIGN - 1);
+    struct mat_arena_block *block;
+
+    if ( NULL == arena )
+        return NULL;
+
+    nbytes = (nbytes + MAT_ARENA_ALIGN - 1) & ~(size_t)(MAT_ARENA_ALIGN - 1);
+    block = arena->blocks;
+    if ( NULL == block || block->size - block->used < nbytes ) {
+        size_t size = nbytes > MAT_ARENA_BLOCK_SIZE ? nbytes : MAT_ARENA_BLOCK_SIZE;
+        block = (struct mat_arena_block*)malloc(header + size);
+        if ( NULL == block )
+            return NULL;
+        block->size = size;
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    block->used += nbytes;
+    return (char*)block + header + block->used - nbytes;
+}
+
+/** @brief Frees an arena and all memory allocated from it
+ *
+ * @ingroup mat_internal
+ * @param arena Pointer to the arena
+ */
+void
+Mat_ArenaFree(struct mat_arena *arena)
+{
+    if ( NULL == arena )
+        return;
+
+    while ( NULL != arena->blocks ) {
+        struct mat_arena_block *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    free(arena);
+}
+
+/** @brief Fills in the data of a deferred variable before it is written
+ *
+ * The data must be released with ReleaseDeferredData also if this fails.
+ * @ingroup mat_internal
+ * @param mat MAT file pointer
+ * @param matvar MAT variable
+ * @retval 0 on success
+ */
+int
+AcquireDeferredData(mat_t *mat,matvar_t *matvar)
+{
+    if ( NULL == matvar || NULL == matvar->internal->source ||
+         NULL != matvar->data )
+        return 0;
+
+    if ( NULL == mat->write_data ||
+         mat->write_data(matvar,matvar->internal->source,0) ) {
+        Mat_Critical("Couldn't get the data of a deferred variable");
+        return 1;
+    }
+
+    return 0;
+}
+
+/** @brief Releases the data of a deferred variable after it is written
+ *
+ * @ingroup mat_internal
+ * @param mat MAT file pointer
+ * @param matvar MAT variable
+ */
+void
+ReleaseDeferredData(mat_t *mat,matvar_t *matvar)
+{
+    if ( NULL == matvar || NULL == matvar->internal->source ||
+         NULL == mat->write_data )
+        return;
+
+    (void)mat->write_data(matvar,matvar->internal->source,1);
+}
+
+#if defined(HAVE_ZLIB)
+/** @brief Sets up the inflate stream of a compressed variable
+ *
+ * Takes an idle stream from the pool of inflate streams of the MAT file, or
+ * initializes a new one if there is none.  The stream is given back by
+ * Mat_InflateEnd.
+ * @ingroup mat_internal
+ * @param mat Pointer to the MAT file
+ * @param matvar Pointer to the MAT variable
+ * @return Z_OK on success or the zlib error code
+ */
+int
+Mat_InflateInit(mat_t *mat,matvar_t *matvar)
+{
+    struct mat_zpool *pool = mat->zpool;
+    z_streamp z;
+
+    if ( NULL == pool ) {
+        pool = (struct mat_zpool*)calloc(1,sizeof(*pool));
+        if ( NULL != pool ) {
+            pool->refs = 1;
+            mat->zpool = pool;
+        }
+    }
+
+    if ( NULL != pool && pool->nstreams > 0 ) {
+        z = pool->streams[--pool->nstreams];
+        /* inflateReset leaves the input of the previous variable */
+        z->next_in  = NULL;
+        z->avail_in = 0;
+    } else {
+        int err;
+        z = (z_streamp)calloc(1,sizeof(*z));
+        if ( NULL == z )
+            return Z_MEM_ERROR;
+        err = inflateInit(z);
+        if ( err != Z_OK ) {
+            free(z);
+            return err;
+        }
+    }
+
+    matvar->internal->z     = z;
+    matvar->internal->zpool = pool;
+    if ( NULL != pool )
+        pool->refs++;
+
+    return Z_OK;
+}
+
+/** @brief Releases the inflate stream of a compressed variable
+ *
+ * The stream is reset and returned to the pool it was taken from, unless
+ * the pool is full or its MAT file has been closed.
+ * @ingroup mat_internal
+ * @param matvar Pointer to the MAT variable
+ */
+void
+Mat_InflateEnd(matvar_t *matvar)
+{
+    struct mat_zpool *pool = matvar->internal->zpool;
+    z_streamp z = matvar->internal->z;
+
+    matvar->internal->z     = NULL;
+    matvar->internal->zpool = NULL;
+
+    if ( NULL != z ) {
+        if ( NULL != pool && !pool->closed && pool->nstreams < MAT_ZPOOL_SIZE &&
+             inflateReset(z) == Z_OK ) {
+            pool->streams[pool->nstreams++] = z;
+        } else {
+            inflateEnd(z);
+            free(z);
+        }
+    }
+    if ( NULL != pool && --pool->refs == 0 )
+        free(pool);
+}
+
+/** @brief Gets the deflate stream for writing a compressed variable
+ *
+ * The MAT file keeps a single deflate stream, which is reset for every
+ * variable and ended by Mat_Close.
+ * @ingroup mat_internal
+ * @param mat Pointer to the MAT file
+ * @return Pointer to the stream or NULL on failure
+ */
+z_streamp
+Mat_DeflateStream(mat_t *mat)
+{
+    if ( NULL == mat->zdeflate ) {
+        z_streamp z = (z_streamp)calloc(1,sizeof(*z));
+        if ( NULL == z )
+            return NULL;
+        if ( deflateInit(z,Z_DEFAULT_COMPRESSION) != Z_OK ) {
+            free(z);
+            return NULL;
+        }
+        mat->zdeflate = z;
+    } else if ( deflateReset(mat->zdeflate) != Z_OK ) {
+        return NULL;
+    }
+
+    return mat->zdeflate;
+}
+
+/** @brief Gets the deflate stream for sampling the data of a variable
+ *
+ * Like Mat_DeflateStream, but the stream compresses at the fastest
+ * level, as it is only used to estimate how well the data compresses
+ * when writing with MAT_COMPRESSION_AUTO.
+ * @ingroup mat_internal
+ * @param mat Pointer to the MAT file
+ * @return Pointer to the stream or NULL on failure
+ */
+z_streamp
+Mat_SampleStream(mat_t *mat)
+{
+    if ( NULL == mat->zsample ) {
+        z_streamp z = (z_streamp)calloc(1,sizeof(*z));
+        if ( NULL == z )
+            return NULL;
+        if ( deflateInit(z,Z_BEST_SPEED) != Z_OK ) {
+            free(z);
+            return NULL;
+        }
+        mat->zsample = z;
+    } else if ( deflateReset(mat->zsample) != Z_OK ) {
+        return NULL;
+    }
+
+    return mat->zsample;
+}
+#endif
+
 /*
  *===================================================================
  *                 Public Functions
@@ -207,38 +543,22 @@ Mat_CreateVer(const char *matname,const char *hdr_str,enum mat_ft mat_file_ver)
     return mat;
 }
 
-/** @brief Opens an existing Matlab MAT file
+/** @brief Reads the header of a MAT file from an open stream
  *
- * Tries to open a Matlab MAT file with the given name
- * @ingroup MAT
- * @param matname Name of MAT file to open
+ * @ingroup mat_internal
+ * @param fp Stream positioned at the beginning of the MAT file, which
+ *        is closed if the MAT file can not be opened
+ * @param matname Name of the MAT file
  * @param mode File access mode (MAT_ACC_RDONLY,MAT_ACC_RDWR,etc).
- * @return A pointer to the MAT file or NULL if it failed.  This is not a
- * simple FILE * and should not be used as one.
+ * @return A pointer to the MAT file or NULL if it failed
  */
-mat_t *
-Mat_Open(const char *matname,int mode)
+static mat_t *
+OpenStream(FILE *fp,const char *matname,int mode)
 {
-    FILE *fp = NULL;
     mat_int16_t tmp, tmp2;
     mat_t *mat = NULL;
     size_t bytesread = 0;
 
-    if ( (mode & 0x01) == MAT_ACC_RDONLY ) {
-        fp = fopen( matname, "rb" );
-        if ( !fp )
-            return NULL;
-    } else if ( (mode & 0x01) == MAT_ACC_RDWR ) {
-        fp = fopen( matname, "r+b" );
-        if ( !fp ) {
-            mat = Mat_CreateVer(matname,NULL,(enum mat_ft)(mode&0xfffffffe));
-            return mat;
-        }
-    } else {
-        Mat_Critical("Invalid file open mode");
-        return NULL;
-    }
-
     mat = (mat_t*)malloc(sizeof(*mat));
     if ( NULL == mat ) {
         fclose(fp);
@@ -268,6 +588,16 @@ Mat_Open(const char *matname,int mode)
     mat->num_datasets  = 0;
     mat->refs_id       = -1;
     mat->dir           = NULL;
+    mat->write_data    = NULL;
+    mat->data_region   = NULL;
+    mat->use_arena     = 0;
+    mat->read_fields   = 1;
+    mat->deflate_threads = 1;
+#if defined(HAVE_ZLIB)
+    mat->zpool         = NULL;
+    mat->zdeflate      = NULL;
+    mat->zsample       = NULL;
+#endif
 
     bytesread += fread(mat->header,1,116,fp);
     mat->header[116] = '\0';
@@ -345,27 +675,324 @@ Mat_Open(const char *matname,int mode)
 #if defined(MAT73) && MAT73
         mat->fp = malloc(sizeof(hid_t));
 
-        if ( (mode & 0x01) == MAT_ACC_RDONLY )
-            *(hid_t*)mat->fp=H5Fopen(mat->filename,H5F_ACC_RDONLY,H5P_DEFAULT);
-        else if ( (mode & 0x01) == MAT_ACC_RDWR )
-            *(hid_t*)mat->fp=H5Fopen(mat->filename,H5F_ACC_RDWR,H5P_DEFAULT);
+        if ( (mode & 0x01) == MAT_ACC_RDONLY )
+            *(hid_t*)mat->fp=H5Fopen(mat->filename,H5F_ACC_RDONLY,H5P_DEFAULT);
+        else if ( (mode & 0x01) == MAT_ACC_RDWR )
+            *(hid_t*)mat->fp=H5Fopen(mat->filename,H5F_ACC_RDWR,H5P_DEFAULT);
+
+        if ( -1 < *(hid_t*)mat->fp ) {
+            H5G_info_t group_info = {0};
+            H5Gget_info(*(hid_t*)mat->fp, &group_info);
+            mat->num_datasets = (size_t)group_info.nlinks;
+            mat->refs_id      = -1;
+        }
+#else
+        mat->fp = NULL;
+        Mat_Close(mat);
+        mat = NULL;
+        Mat_Critical("No HDF5 support which is required to read the v7.3 "
+                     "MAT file \"%s\"",matname);
+#endif
+    }
+
+    return mat;
+}
+
+/** @brief Opens an existing Matlab MAT file
+ *
+ * Tries to open a Matlab MAT file with the given name
+ * @ingroup MAT
+ * @param matname Name of MAT file to open
+ * @param mode File access mode (MAT_ACC_RDONLY,MAT_ACC_RDWR,etc).
+ * @return A pointer to the MAT file or NULL if it failed.  This is not a
+ * simple FILE * and should not be used as one.
+ */
+mat_t *
+Mat_Open(const char *matname,int mode)
+{
+    FILE *fp = NULL;
+
+    if ( (mode & 0x01) == MAT_ACC_RDONLY ) {
+        fp = fopen( matname, "rb" );
+        if ( !fp )
+            return NULL;
+    } else if ( (mode & 0x01) == MAT_ACC_RDWR ) {
+        fp = fopen( matname, "r+b" );
+        if ( !fp )
+            return Mat_CreateVer(matname,NULL,(enum mat_ft)(mode&0xfffffffe));
+    } else {
+        Mat_Critical("Invalid file open mode");
+        return NULL;
+    }
+
+    return OpenStream(fp,matname,mode);
+}
+
+/** @brief Opens a Matlab MAT file held in memory
+ *
+ * Opens the MAT file in the @c len bytes at @c buf for reading, for
+ * example a MAT file received over a network, without writing it to
+ * disk.  The buffer is not copied and must be kept until the MAT file
+ * is closed with Mat_Close.  On Windows, which has no fmemopen, the
+ * buffer is copied to an anonymous temporary file from tmpfile, which
+ * may be created in the root of the current drive; write the buffer
+ * to a file of your choice and use Mat_Open to control where it is
+ * stored.  Version 7.3 MAT files can not be opened from memory.
+ * @ingroup MAT
+ * @param buf The MAT file
+ * @param len Number of bytes in @c buf
+ * @return A pointer to the MAT file or NULL if it failed
+ */
+mat_t *
+Mat_OpenMem(const void *buf,size_t len)
+{
+    FILE *fp = NULL;
+
+    if ( NULL == buf || len < 1 )
+        return NULL;
+
+#if defined(_WIN32)
+    fp = tmpfile();
+    if ( NULL == fp )
+        return NULL;
+    if ( fwrite(buf,1,len,fp) != len || fseek(fp,0,SEEK_SET) ) {
+        fclose(fp);
+        return NULL;
+    }
+#else
+    fp = fmemopen((void*)buf,len,"rb");
+    if ( NULL == fp )
+        return NULL;
+#endif
+
+    return OpenStream(fp,"<memory>",MAT_ACC_RDONLY);
+}
+
+#if defined(__GLIBC__) || defined(__APPLE__) || defined(__FreeBSD__) || \
+    defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__)
+/** @brief Growable memory buffer behind a stream of Mat_CreateMem */
+struct mat_membuf {
+    char  *data;      /**< Contents of the stream */
+    size_t size;      /**< Number of bytes in the stream */
+    size_t capacity;  /**< Number of bytes allocated for data */
+    size_t pos;       /**< Current position in the stream */
+};
+
+static ssize_t
+MemRead(void *cookie,char *buf,size_t len)
+{
+    struct mat_membuf *m = (struct mat_membuf*)cookie;
+    size_t n = m->pos < m->size ? m->size - m->pos : 0;
+
+    if ( n > len )
+        n = len;
+    memcpy(buf,m->data + m->pos,n);
+    m->pos += n;
+    return n;
+}
+
+static ssize_t
+MemWrite(void *cookie,const char *buf,size_t len)
+{
+    struct mat_membuf *m = (struct mat_membuf*)cookie;
+
+    if ( m->pos + len > m->capacity ) {
+        size_t capacity = m->capacity ? m->capacity : 65536;
+        char *data;
+
+        while ( capacity < m->pos + len )
+            capacity *= 2;
+        data = (char*)realloc(m->data,capacity);
+        if ( NULL == data )
+            return -1;
+        m->data = data;
+        m->capacity = capacity;
+    }
+    /* Writing after a seek beyond the end leaves a gap of zeros */
+    if ( m->pos > m->size )
+        memset(m->data + m->size,0,m->pos - m->size);
+    memcpy(m->data + m->pos,buf,len);
+    m->pos += len;
+    if ( m->pos > m->size )
+        m->size = m->pos;
+    return len;
+}
+
+static long
+MemSeek(struct mat_membuf *m,long offset,int whence)
+{
+    long pos;
+
+    switch ( whence ) {
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = (long)m->pos + offset;
+            break;
+        case SEEK_END:
+            pos = (long)m->size + offset;
+            break;
+        default:
+            return -1;
+    }
+    if ( pos < 0 )
+        return -1;
+    m->pos = pos;
+    return pos;
+}
+
+static int
+MemClose(void *cookie)
+{
+    struct mat_membuf *m = (struct mat_membuf*)cookie;
+
+    free(m->data);
+    free(m);
+    return 0;
+}
+
+#if defined(__GLIBC__)
+static int
+MemSeekCookie(void *cookie,off64_t *offset,int whence)
+{
+    long pos = MemSeek((struct mat_membuf*)cookie,(long)*offset,whence);
+
+    if ( pos < 0 )
+        return -1;
+    *offset = pos;
+    return 0;
+}
+#else
+static int
+MemReadCookie(void *cookie,char *buf,int len)
+{
+    return (int)MemRead(cookie,buf,len);
+}
+
+static int
+MemWriteCookie(void *cookie,const char *buf,int len)
+{
+    return (int)MemWrite(cookie,buf,len);
+}
+
+static fpos_t
+MemSeekCookie(void *cookie,fpos_t offset,int whence)
+{
+    return MemSeek((struct mat_membuf*)cookie,(long)offset,whence);
+}
+#endif
+#endif
+
+/** @brief Opens an empty stream in memory for reading and writing
+ *
+ * The stream is a growable memory buffer where the C library supports
+ * custom streams, and otherwise an anonymous temporary file from
+ * tmpfile, which is written to disk and on Windows may be created in
+ * the root of the current drive.
+ * @ingroup mat_internal
+ * @return The stream or NULL on failure
+ */
+static FILE *
+MemStream(void)
+{
+#if defined(__GLIBC__) || defined(__APPLE__) || defined(__FreeBSD__) || \
+    defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__)
+    FILE *fp;
+    struct mat_membuf *m = (struct mat_membuf*)calloc(1,sizeof(*m));
+
+    if ( NULL == m )
+        return NULL;
+#if defined(__GLIBC__)
+    {
+        cookie_io_functions_t io = {MemRead,MemWrite,MemSeekCookie,MemClose};
+        fp = fopencookie(m,"w+",io);
+    }
+#else
+    fp = funopen(m,MemReadCookie,MemWriteCookie,MemSeekCookie,MemClose);
+#endif
+    if ( NULL == fp )
+        free(m);
+    return fp;
+#else
+    return tmpfile();
+#endif
+}
+
+/** @brief Creates a new Matlab MAT file in memory
+ *
+ * Creates an empty MAT file like Mat_CreateVer, that is kept in a
+ * growable memory buffer instead of a file on disk, for example to
+ * send it over a network.  The content is copied out with Mat_MemSize
+ * and Mat_MemCopy before the MAT file is closed with Mat_Close, which
+ * frees it.  Where the C library has no custom streams, such as on
+ * Windows, the MAT file is kept in an anonymous temporary file instead
+ * of memory.  Version 7.3 MAT files can not be created in memory.
+ * @ingroup MAT
+ * @param hdr_str Optional header string, NULL to use default
+ * @param mat_file_ver MAT file version to create
+ * @return A pointer to the MAT file or NULL if it failed
+ */
+mat_t *
+Mat_CreateMem(const char *hdr_str,enum mat_ft mat_file_ver)
+{
+    FILE *fp;
+
+    if ( MAT_FT_MAT5 != mat_file_ver && MAT_FT_MAT4 != mat_file_ver )
+        return NULL;
+
+    fp = MemStream();
+    if ( NULL == fp )
+        return NULL;
+
+    if ( MAT_FT_MAT4 == mat_file_ver )
+        return Mat_CreateStream4(fp,"<memory>");
+    return Mat_CreateStream5(fp,"<memory>",hdr_str);
+}
+
+/** @brief Gets the size of a MAT file
+ *
+ * @ingroup MAT
+ * @param mat Pointer to the MAT file, for example from Mat_CreateMem
+ * @return The number of bytes in the MAT file, or 0 on failure
+ */
+size_t
+Mat_MemSize(mat_t *mat)
+{
+    long size;
+
+    if ( NULL == mat || NULL == mat->fp || MAT_FT_MAT73 == mat->version )
+        return 0;
+
+    if ( fflush((FILE*)mat->fp) || fseek((FILE*)mat->fp,0,SEEK_END) )
+        return 0;
+    size = ftell((FILE*)mat->fp);
+
+    return size < 0 ? 0 : (size_t)size;
+}
+
+/** @brief Copies the bytes of a MAT file to a buffer
+ *
+ * @ingroup MAT
+ * @param mat Pointer to the MAT file, for example from Mat_CreateMem
+ * @param buf Buffer of at least @c len bytes
+ * @param len Number of bytes to copy, see Mat_MemSize
+ * @return The number of bytes copied
+ */
+size_t
+Mat_MemCopy(mat_t *mat,void *buf,size_t len)
+{
+    size_t n;
+
+    if ( NULL == mat || NULL == mat->fp || MAT_FT_MAT73 == mat->version )
+        return 0;
 
-        if ( -1 < *(hid_t*)mat->fp ) {
-            H5G_info_t group_info = {0};
-            H5Gget_info(*(hid_t*)mat->fp, &group_info);
-            mat->num_datasets = (size_t)group_info.nlinks;
-            mat->refs_id      = -1;
-        }
-#else
-        mat->fp = NULL;
-        Mat_Close(mat);
-        mat = NULL;
-        Mat_Critical("No HDF5 support which is required to read the v7.3 "
-                     "MAT file \"%s\"",matname);
-#endif
-    }
+    if ( fflush((FILE*)mat->fp) || fseek((FILE*)mat->fp,0,SEEK_SET) )
+        return 0;
+    n = fread(buf,1,len,(FILE*)mat->fp);
+    (void)fseek((FILE*)mat->fp,0,SEEK_END);
 
-    return mat;
+    return n;
 }
 
 /** @brief Closes an open Matlab MAT file
@@ -404,6 +1031,28 @@ Mat_Close( mat_t *mat )
             }
             free(mat->dir);
         }
+#if defined(HAVE_ZLIB)
+        if ( NULL != mat->zpool ) {
+            struct mat_zpool *pool = mat->zpool;
+            while ( pool->nstreams > 0 ) {
+                z_streamp z = pool->streams[--pool->nstreams];
+                inflateEnd(z);
+                free(z);
+            }
+            /* Variables still holding a stream free the pool */
+            pool->closed = 1;
+            if ( --pool->refs == 0 )
+                free(pool);
+        }
+        if ( NULL != mat->zdeflate ) {
+            (void)deflateEnd(mat->zdeflate);
+            free(mat->zdeflate);
+        }
+        if ( NULL != mat->zsample ) {
+            (void)deflateEnd(mat->zsample);
+            free(mat->zsample);
+        }
+#endif
         free(mat);
     }
     return 0;
@@ -566,6 +1215,122 @@ Mat_Rewind( mat_t *mat )
     return err;
 }
 
+/** @brief Sets the function supplying the data of deferred variables
+ *
+ * Variables with a data source (see Mat_VarSetDataSource) are written
+ * without their data being held in memory.  The function is called to
+ * fill in the data just before it is written and to release it again
+ * immediately afterwards, so at most one deferred variable has its data
+ * allocated at a time.
+ * @ingroup MAT
+ * @param mat Pointer to the MAT file
+ * @param fn Function supplying the data, or NULL to unset
+ * @retval 0 on success
+ */
+int
+Mat_SetWriteDataFunc(mat_t *mat,mat_write_data_fn fn)
+{
+    if ( NULL == mat )
+        return -1;
+
+    mat->write_data = fn;
+
+    return 0;
+}
+
+/** @brief Sets the function copying the data of streamed variables
+ *
+ * A deferred numeric variable whose data is left NULL by the write data
+ * function (see Mat_SetWriteDataFunc) is written in fixed-size chunks,
+ * each copied into a buffer by this function, so the data never has to
+ * be held in memory at once.
+ * @ingroup MAT
+ * @param mat Pointer to the MAT file
+ * @param fn Function copying a region of the data, or NULL to unset
+ * @retval 0 on success
+ */
+int
+Mat_SetDataRegionFunc(mat_t *mat,mat_data_region_fn fn)
+{
+    if ( NULL == mat )
+        return -1;
+
+    mat->data_region = fn;
+
+    return 0;
+}
+
+/** @brief Sets whether nested variables are read into an arena
+ *
+ * When enabled, the cells and struct fields of variables read by
+ * Mat_VarReadNextInfo are allocated from an arena owned by the top-level
+ * variable and released all at once by Mat_VarFree, instead of one
+ * allocation per element.  Such elements must not be freed on their own
+ * or outlive the top-level variable.
+ * @ingroup MAT
+ * @param mat Pointer to the MAT file
+ * @param enable 1 to allocate from an arena, 0 to use malloc
+ * @retval 0 on success
+ */
+int
+Mat_SetReadArena(mat_t *mat,int enable)
+{
+    if ( NULL == mat )
+        return -1;
+
+    mat->use_arena = enable ? 1 : 0;
+
+    return 0;
+}
+
+/** @brief Sets whether the fields and cells are read with the variable information
+ *
+ * By default Mat_VarReadNextInfo also reads the information of the fields
+ * of structs and the cells of cell arrays, which for compressed variables
+ * means inflating most of the variable.  When disabled, only the class,
+ * dimensions and name of the top-level variable are read, which is enough
+ * to index the variables of a file.  Mat_VarReadNext and Mat_VarReadAt
+ * always read the complete variable.
+ * @ingroup MAT
+ * @param mat Pointer to the MAT file
+ * @param enable 1 to read the fields and cells, 0 to skip them
+ * @retval 0 on success
+ */
+int
+Mat_SetReadFields(mat_t *mat,int enable)
+{
+    if ( NULL == mat )
+        return -1;
+
+    mat->read_fields = enable ? 1 : 0;
+
+    return 0;
+}
+
+/** @brief Sets the number of threads deflating a large variable
+ *
+ * The numeric data of a variable written with MAT_COMPRESSION_ZLIB that
+ * is larger than a block of 1 MB is split into blocks, which are deflated
+ * on up to @c threads threads at a time and written as one zlib stream.
+ * The compressed data differs slightly from the data deflated on one
+ * thread, but is read the same way.  Without thread support, the data is
+ * always deflated on one thread.
+ * @ingroup MAT
+ * @param mat Pointer to the MAT file
+ * @param threads Number of threads, 1 to deflate on the calling thread
+ * @retval 0 on success
+ */
+int
+Mat_SetDeflateThreads(mat_t *mat,int threads)
+{
+    if ( NULL == mat || threads < 1 )
+        return -1;
+
+    mat->deflate_threads = threads;
+
+    return 0;
+}
+
 /** @brief Returns the size of a Matlab Class
  *
  * Returns the size (in bytes) of the matlab class class_type
@@ -614,6 +1379,48 @@ Mat_SizeOfClass(int class_type)
  *===================================================================
  */
 
+/** @brief Initializes all the fields of a newly allocated matvar_t
+ *
+ * @ingroup mat_internal
+ * @param matvar MAT variable with allocated internal structure
+ */
+static void
+InitVar(matvar_t *matvar)
+{
+    matvar->nbytes       = 0;
+    matvar->rank         = 0;
+    matvar->data_type    = MAT_T_UNKNOWN;
+    matvar->data_size    = 0;
+    matvar->class_type   = MAT_C_EMPTY;
+    matvar->isComplex    = 0;
+    matvar->isGlobal     = 0;
+    matvar->isLogical    = 0;
+    matvar->dims         = NULL;
+    matvar->name         = NULL;
+    matvar->data         = NULL;
+    matvar->mem_conserve = 0;
+    matvar->compression  = MAT_COMPRESSION_NONE;
+    matvar->internal->hdf5_name  = NULL;
+    matvar->internal->hdf5_ref   =  0;
+    matvar->internal->id         = -1;
+    matvar->internal->fpos       = 0;
+    matvar->internal->datapos    = 0;
+    matvar->internal->fp         = NULL;
+    matvar->internal->num_fields = 0;
+    matvar->internal->fieldnames = NULL;
+    matvar->internal->fieldindex = NULL;
+    matvar->internal->source     = NULL;
+    matvar->internal->bufsize    = 0;
+    matvar->internal->arena      = NULL;
+    matvar->internal->in_arena   = 0;
+#if defined(HAVE_ZLIB)
+    matvar->internal->z          = NULL;
+    matvar->internal->zpool      = NULL;
+    matvar->internal->data       = NULL;
+    matvar->internal->zend       = 0;
+#endif
+}
+
 /** @brief Allocates memory for a new matvar_t and initializes all the fields
  *
  * @ingroup MAT
@@ -627,36 +1434,42 @@ Mat_VarCalloc(void)
     matvar = (matvar_t*)malloc(sizeof(*matvar));
 
     if ( NULL != matvar ) {
-        matvar->nbytes       = 0;
-        matvar->rank         = 0;
-        matvar->data_type    = MAT_T_UNKNOWN;
-        matvar->data_size    = 0;
-        matvar->class_type   = MAT_C_EMPTY;
-        matvar->isComplex    = 0;
-        matvar->isGlobal     = 0;
-        matvar->isLogical    = 0;
-        matvar->dims         = NULL;
-        matvar->name         = NULL;
-        matvar->data         = NULL;
-        matvar->mem_conserve = 0;
-        matvar->compression  = MAT_COMPRESSION_NONE;
-        matvar->internal     = (struct matvar_internal*)malloc(sizeof(*matvar->internal));
+        matvar->internal = (struct matvar_internal*)malloc(sizeof(*matvar->internal));
         if ( NULL == matvar->internal ) {
             free(matvar);
             matvar = NULL;
         } else {
-            matvar->internal->hdf5_name  = NULL;
-            matvar->internal->hdf5_ref   =  0;
-            matvar->internal->id         = -1;
-            matvar->internal->fpos       = 0;
-            matvar->internal->datapos    = 0;
-            matvar->internal->fp         = NULL;
-            matvar->internal->num_fields = 0;
-            matvar->internal->fieldnames = NULL;
-#if defined(HAVE_ZLIB)
-            matvar->internal->z          = NULL;
-            matvar->internal->data       = NULL;
-#endif
+            InitVar(matvar);
+        }
+    }
+
+    return matvar;
+}
+
+/** @brief Allocates a new matvar_t from an arena and initializes all the fields
+ *
+ * The variable, its dimensions and name are released with the arena.
+ * Mat_VarFree only frees the data of the variable.
+ * @ingroup mat_internal
+ * @param arena Pointer to the arena
+ * @return A newly allocated matvar_t
+ */
+matvar_t *
+Mat_VarCallocArena(struct mat_arena *arena)
+{
+    matvar_t *matvar;
+
+    matvar = (matvar_t*)Mat_ArenaAlloc(arena,sizeof(*matvar));
+
+    if ( NULL != matvar ) {
+        matvar->internal = (struct matvar_internal*)
+            Mat_ArenaAlloc(arena,sizeof(*matvar->internal));
+        if ( NULL == matvar->internal ) {
+            matvar = NULL;
+        } else {
+            InitVar(matvar);
+            matvar->internal->arena    = arena;
+            matvar->internal->in_arena = 1;
         }
     }
 
@@ -940,7 +1753,9 @@ Mat_VarDuplicate(const matvar_t *in, int opt)
     out->internal->id       = in->internal->id;
     out->internal->fpos     = in->internal->fpos;
     out->internal->datapos  = in->internal->datapos;
+    out->internal->source   = in->internal->source;
 #if defined(HAVE_ZLIB)
+    out->internal->zend     = in->internal->zend;
     out->internal->z        = NULL;
     out->internal->data     = NULL;
 #endif
@@ -1034,6 +1849,7 @@ Mat_VarDuplicate(const matvar_t *in, int opt)
                 outfields[i] = Mat_VarDuplicate(infields[i],opt);
             }
         }
+        out->mem_conserve = 0;
     } else if ( (in->data != NULL) && (in->class_type == MAT_C_CELL) ) {
         out->data = malloc(in->nbytes);
         if ( out->data != NULL && in->data_size > 0 ) {
@@ -1044,6 +1860,7 @@ Mat_VarDuplicate(const matvar_t *in, int opt)
                 outcells[i] = Mat_VarDuplicate(incells[i],opt);
             }
         }
+        out->mem_conserve = 0;
     } else if ( (in->data != NULL) && (in->class_type == MAT_C_SPARSE) ) {
         out->data = malloc(sizeof(mat_sparse_t));
         if ( out->data != NULL ) {
@@ -1112,13 +1929,20 @@ void
 Mat_VarFree(matvar_t *matvar)
 {
     size_t nmemb = 0, i;
+    int in_arena = 0;
+    struct mat_arena *arena = NULL;
     if ( NULL == matvar )
         return;
+    if ( NULL != matvar->internal ) {
+        in_arena = matvar->internal->in_arena;
+        arena    = matvar->internal->arena;
+    }
     if ( NULL != matvar->dims ) {
         nmemb = 1;
         for ( i = 0; i < matvar->rank; i++ )
             nmemb *= matvar->dims[i];
-        free(matvar->dims);
+        if ( !in_arena )
+            free(matvar->dims);
     }
     if ( NULL != matvar->data) {
         switch (matvar->class_type ) {
@@ -1193,8 +2017,7 @@ Mat_VarFree(matvar_t *matvar)
     if ( NULL != matvar->internal ) {
 #if defined(HAVE_ZLIB)
         if ( matvar->compression == MAT_COMPRESSION_ZLIB ) {
-            inflateEnd(matvar->internal->z);
-            free(matvar->internal->z);
+            Mat_InflateEnd(matvar);
             if ( (matvar->internal->data != NULL) && (matvar->class_type == MAT_C_SPARSE) ) {
                 mat_sparse_t *sparse;
                 sparse = (mat_sparse_t*)matvar->internal->data;
@@ -1266,9 +2089,13 @@ Mat_VarFree(matvar_t *matvar)
             }
             free(matvar->internal->fieldnames);
         }
-        free(matvar->internal);
+        Mat_FieldIndexFree(matvar);
+        if ( !in_arena )
+            free(matvar->internal);
         matvar->internal = NULL;
     }
+    if ( in_arena )
+        return;
     if ( NULL != matvar->name )
         free(matvar->name);
     /* FIXME: Why does this cause a SEGV? */
@@ -1276,6 +2103,30 @@ Mat_VarFree(matvar_t *matvar)
     memset(matvar,0,sizeof(matvar_t));
 #endif
     free(matvar);
+    /* The root of an arena allocated tree releases the arena last */
+    Mat_ArenaFree(arena);
+}
+
+/** @brief Sets the source of the data of a MAT variable
+ *
+ * Marks the variable as deferred: its data is not held by the variable
+ * but is requested from the write data function of the MAT file (see
+ * Mat_SetWriteDataFunc) when the variable is written, and released
+ * again afterwards.  The variable should be created with NULL data.
+ * @ingroup MAT
+ * @param matvar Pointer to the MAT variable
+ * @param source Opaque pointer passed to the write data function
+ * @retval 0 on success
+ */
+int
+Mat_VarSetDataSource(matvar_t *matvar,void *source)
+{
+    if ( NULL == matvar || NULL == matvar->internal )
+        return -1;
+
+    matvar->internal->source = source;
+
+    return 0;
 }
 
 /** @brief Calculate a single subscript from a set of subscript values
@@ -1440,6 +2291,41 @@ Mat_CalcSubscripts2(int rank,size_t *dims,size_t index)
     return subs;
 }
 
+/** @brief Gets the position of a variable in its MAT file
+ *
+ * The position can be given to Mat_VarReadAt to read the variable again
+ * without searching the file for it.
+ * @ingroup MAT
+ * @param matvar MAT variable read from a version 4 or 5 MAT file
+ * @return Offset of the variable from the beginning of the file, or -1
+ */
+long
+Mat_VarGetFilePos(const matvar_t *matvar)
+{
+    if ( NULL == matvar || NULL == matvar->internal )
+        return -1L;
+    return matvar->internal->fpos;
+}
+
+/** @brief Gives back the inflate stream of a variable that has been read
+ *
+ * Returns the inflate stream of a compressed variable read with
+ * Mat_VarReadNext to the pool of its MAT file.  The data of the variable
+ * can not be read again afterwards, but the variable can be freed on
+ * another thread than the one reading the MAT file.
+ * @ingroup MAT
+ * @param matvar MAT variable read from a MAT file
+ */
+void
+Mat_VarReleaseStream(matvar_t *matvar)
+{
+#if defined(HAVE_ZLIB)
+    if ( NULL != matvar && NULL != matvar->internal &&
+         matvar->compression == MAT_COMPRESSION_ZLIB )
+        Mat_InflateEnd(matvar);
+#endif
+}
+
 /** @brief Calculates the size of a matlab variable in bytes
  *
  * @ingroup MAT
@@ -1647,6 +2533,50 @@ Mat_VarReadDataLinear(mat_t *mat,matvar_t *matvar,void *data,int start,
     return err;
 }
 
+/** @brief Reads a contiguous range of a MAT variable
+ *
+ * Reads @c edge elements from index @c start of a MAT variable, like
+ * Mat_VarReadDataLinear with a stride of 1, but with size_t indices for
+ * variables of more than INT_MAX elements.  The variable must have been
+ * read by Mat_VarReadInfo, and be a real, uncompressed numeric variable in
+ * a version 5 MAT file.
+ * @ingroup MAT
+ * @param mat MAT file to read data from
+ * @param matvar MAT variable information
+ * @param data pointer to store data in (must be pre-allocated)
+ * @param start index of the first element
+ * @param edge number of elements to read
+ * @retval 0 on success
+ */
+int
+Mat_VarReadDataRange(mat_t *mat,matvar_t *matvar,void *data,size_t start,
+    size_t edge)
+{
+    if ( NULL == mat || NULL == matvar || NULL == data )
+        return -1;
+
+    switch ( matvar->class_type ) {
+        case MAT_C_DOUBLE:
+        case MAT_C_SINGLE:
+        case MAT_C_INT64:
+        case MAT_C_UINT64:
+        case MAT_C_INT32:
+        case MAT_C_UINT32:
+        case MAT_C_INT16:
+        case MAT_C_UINT16:
+        case MAT_C_INT8:
+        case MAT_C_UINT8:
+            break;
+        default:
+            return -1;
+    }
+
+    if ( MAT_FT_MAT5 != mat->version )
+        return 2;
+
+    return Mat_VarReadDataRange5(mat,matvar,data,start,edge);
+}
+
 /** @brief Reads the information of the next variable in a MAT file
  *
  * Reads the next variable's information (class,flags-complex/global/logical,
@@ -1764,11 +2694,14 @@ Mat_VarRead( mat_t *mat, const char *name )
 
     if ( MAT_FT_MAT73 != mat->version ) {
         long fpos = ftell((FILE*)mat->fp);
+        int read_fields = mat->read_fields;
         if ( fpos == -1L ) {
             Mat_Critical("Couldn't determine file position");
             return NULL;
         }
+        mat->read_fields = 1;
         matvar = Mat_VarReadInfo(mat,name);
+        mat->read_fields = read_fields;
         if ( matvar )
             ReadData(mat,matvar);
         (void)fseek((FILE*)mat->fp,fpos,SEEK_SET);
@@ -1783,6 +2716,153 @@ Mat_VarRead( mat_t *mat, const char *name )
     return matvar;
 }
 
+/** @brief Orders pointers to names by name, then by position
+ *
+ * @ingroup mat_internal
+ */
+static int
+CompareNames(const void *a,const void *b)
+{
+    const char * const *na = *(const char * const * const *)a;
+    const char * const *nb = *(const char * const * const *)b;
+    int cmp = strcmp(*na,*nb);
+    if ( cmp == 0 )
+        cmp = (na > nb) - (na < nb);
+    return cmp;
+}
+
+/** @brief Reads the variables with the given names in one pass
+ *
+ * @ingroup mat_internal
+ * @param mat Pointer to the MAT file
+ * @param names Names of the variables to read
+ * @param n Number of names
+ * @param read_data 1 to read the data of the variables, 0 to only read
+ * the variable information
+ * @return Array of @c n pointers to the variables, see Mat_VarReadMany
+ */
+static matvar_t **
+ReadMany( mat_t *mat, const char * const *names, size_t n, int read_data )
+{
+    matvar_t **matvars, *matvar;
+    const char * const **sorted;
+    size_t i, nfound = 0;
+    int read_fields;
+    long fpos = 0;
+    size_t next_index = 0;
+
+    if ( mat == NULL || (names == NULL && n > 0) )
+        return NULL;
+
+    matvars = (matvar_t**)calloc(n > 0 ? n : 1,sizeof(*matvars));
+    sorted  = (const char * const **)malloc((n > 0 ? n : 1)*sizeof(*sorted));
+    if ( matvars == NULL || sorted == NULL ) {
+        free(matvars);
+        free(sorted);
+        return NULL;
+    }
+    for ( i = 0; i < n; i++ ) {
+        if ( names[i] == NULL ) {
+            free(matvars);
+            free(sorted);
+            return NULL;
+        }
+        sorted[i] = names + i;
+    }
+    qsort(sorted,n,sizeof(*sorted),CompareNames);
+
+    if ( MAT_FT_MAT73 != mat->version ) {
+        fpos = ftell((FILE*)mat->fp);
+        if ( fpos == -1L ) {
+            free(matvars);
+            free(sorted);
+            Mat_Critical("Couldn't determine file position");
+            return NULL;
+        }
+        (void)fseek((FILE*)mat->fp,mat->bof,SEEK_SET);
+    } else {
+        next_index = mat->next_index;
+        mat->next_index = 0;
+    }
+
+    read_fields = mat->read_fields;
+    if ( read_data )
+        mat->read_fields = 1;
+    while ( nfound < n && (matvar = Mat_VarReadNextInfo(mat)) != NULL ) {
+        size_t lo = 0, hi = n;
+
+        /* First of the requested names not less than the variable name */
+        while ( matvar->name != NULL && lo < hi ) {
+            size_t mid = lo + (hi - lo) / 2;
+            if ( strcmp(*sorted[mid],matvar->name) < 0 )
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        /* Skip names already read, if a name is requested twice */
+        while ( matvar->name != NULL && lo < n &&
+                !strcmp(*sorted[lo],matvar->name) &&
+                matvars[sorted[lo]-names] != NULL )
+            lo++;
+
+        if ( matvar->name != NULL && lo < n && !strcmp(*sorted[lo],matvar->name) ) {
+            if ( read_data )
+                ReadData(mat,matvar);
+            matvars[sorted[lo]-names] = matvar;
+            nfound++;
+        } else {
+            Mat_VarFree(matvar);
+        }
+    }
+
+    mat->read_fields = read_fields;
+    if ( MAT_FT_MAT73 != mat->version )
+        (void)fseek((FILE*)mat->fp,fpos,SEEK_SET);
+    else
+        mat->next_index = next_index;
+
+    free(sorted);
+    return matvars;
+}
+
+/** @brief Reads the variables with the given names from a MAT file
+ *
+ * Reads all the named variables in a single forward pass through the file,
+ * in the order they are stored, instead of scanning the file from the
+ * beginning for each name as repeated calls to Mat_VarRead do.  The pass
+ * stops as soon as all the names have been found.
+ * @ingroup MAT
+ * @param mat Pointer to the MAT file
+ * @param names Names of the variables to read
+ * @param n Number of names
+ * @return Array of @c n pointers to the variables in the order of @c names,
+ * with NULL for names that are not in the file, or NULL on error.  A
+ * name given more than once is only read for its first occurrence.  The
+ * variables are freed with Mat_VarFree and the array with free.
+ */
+matvar_t **
+Mat_VarReadMany( mat_t *mat, const char * const *names, size_t n )
+{
+    return ReadMany(mat,names,n,1);
+}
+
+/** @brief Reads the information of the variables with the given names
+ *
+ * Like Mat_VarReadMany, but only reads the variable information as
+ * Mat_VarReadInfo does.  The data can be read with Mat_VarReadDataAll.
+ * @ingroup MAT
+ * @param mat Pointer to the MAT file
+ * @param names Names of the variables to read
+ * @param n Number of names
+ * @return Array of @c n pointers to the variables in the order of @c names,
+ * with NULL for names that are not in the file, or NULL on error
+ */
+matvar_t **
+Mat_VarReadManyInfo( mat_t *mat, const char * const *names, size_t n )
+{
+    return ReadMany(mat,names,n,0);
+}
+
 /** @brief Reads the next variable in a MAT file
  *
  * Reads the next variable in the Matlab MAT file
@@ -1795,6 +2875,7 @@ matvar_t *
 Mat_VarReadNext( mat_t *mat )
 {
     long fpos = 0;
+    int read_fields;
     matvar_t *matvar = NULL;
 
     if ( mat->version != MAT_FT_MAT73 ) {
@@ -1807,7 +2888,10 @@ Mat_VarReadNext( mat_t *mat )
             return NULL;
         }
     }
+    read_fields = mat->read_fields;
+    mat->read_fields = 1;
     matvar = Mat_VarReadNextInfo(mat);
+    mat->read_fields = read_fields;
     if ( matvar ) {
         ReadData(mat,matvar);
     } else if (mat->version != MAT_FT_MAT73 ) {
@@ -1817,6 +2901,38 @@ Mat_VarReadNext( mat_t *mat )
     return matvar;
 }
 
+/** @brief Reads the variable at the given position in a MAT file
+ *
+ * Reads the variable starting at @c fpos, as returned by
+ * Mat_VarGetFilePos for a variable read from the same file.  The file
+ * position is restored afterwards.
+ * @ingroup MAT
+ * @param mat Pointer to the MAT file
+ * @param fpos Offset of the variable from the beginning of the file
+ * @return Pointer to the @ref matvar_t structure containing the MAT
+ * variable information and data, or NULL on error
+ */
+matvar_t *
+Mat_VarReadAt( mat_t *mat, long fpos )
+{
+    matvar_t *matvar = NULL;
+    long pos;
+
+    if ( mat == NULL || fpos < 0 || mat->version == MAT_FT_MAT73 )
+        return NULL;
+
+    pos = ftell((FILE*)mat->fp);
+    if ( pos == -1L ) {
+        Mat_Critical("Couldn't determine file position");
+        return NULL;
+    }
+    if ( fseek((FILE*)mat->fp,fpos,SEEK_SET) == 0 )
+        matvar = Mat_VarReadNext(mat);
+    (void)fseek((FILE*)mat->fp,pos,SEEK_SET);
+
+    return matvar;
+}
+
 /** @brief Writes the given MAT variable to a MAT file
  *
  * Writes the MAT variable information stored in matvar to the given MAT file.
@@ -1924,7 +3040,9 @@ Mat_VarWriteData(mat_t *mat,matvar_t *matvar,void *data,
  * @param matvar MAT variable information to write
  * @param compress Whether or not to compress the data
  *        (Only valid for version 5 and 7.3 MAT files and variables with
-           numeric data)
+           numeric data).  With MAT_COMPRESSION_AUTO, a version 5
+           variable is compressed unless a sample of its numeric data
+           shows that it is nearly incompressible.
  * @retval 0 on success
  */
 int
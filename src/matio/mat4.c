@@ -54,13 +54,31 @@
 mat_t *
 Mat_Create4(const char* matname)
 {
-    FILE *fp = NULL;
-    mat_t *mat = NULL;
+    FILE *fp = fopen(matname,"w+b");
 
-    fp = fopen(matname,"w+b");
     if ( !fp )
         return NULL;
 
+    return Mat_CreateStream4(fp,matname);
+}
+
+/** @if mat_devman
+ * @brief Creates a new Matlab MAT version 4 file on an open stream
+ *
+ * Like Mat_Create4, but writes the MAT file to @c fp, which must be
+ * open for reading and writing, see Mat_CreateMem.
+ * @ingroup mat_internal
+ * @param fp Empty stream to write the MAT file to, which is closed if
+ *        the MAT file can not be created
+ * @param matname Name of MAT file
+ * @return A pointer to the MAT file or NULL if it failed
+ * @endif
+ */
+mat_t *
+Mat_CreateStream4(FILE *fp,const char* matname)
+{
+    mat_t *mat = NULL;
+
     mat = (mat_t*)malloc(sizeof(*mat));
     if ( NULL == mat ) {
         fclose(fp);
@@ -80,12 +98,51 @@ Mat_Create4(const char* matname)
     mat->num_datasets  = 0;
     mat->refs_id       = -1;
     mat->dir           = NULL;
+    mat->write_data    = NULL;
+    mat->data_region   = NULL;
+    mat->use_arena     = 0;
+    mat->read_fields   = 1;
+    mat->deflate_threads = 1;
+#if defined(HAVE_ZLIB)
+    mat->zpool         = NULL;
+    mat->zdeflate      = NULL;
+    mat->zsample       = NULL;
+#endif
 
     Mat_Rewind(mat);
 
     return mat;
 }
 
+/** @if mat_devman
+ * @brief Writes the data of a streamed variable to a version 4 matlab file
+ *
+ * Writes the data in chunks copied by the data region function of the
+ * MAT file, see Mat_SetDataRegionFunc.
+ * @ingroup mat_internal
+ * @param mat MAT file pointer
+ * @param matvar MAT variable with its data supplied by regions
+ * @param N number of elements to write
+ * @endif
+ */
+static void
+WriteDataRegion4(mat_t *mat,matvar_t *matvar,size_t N)
+{
+    double buf[4096];
+    size_t i, n, data_size = Mat_SizeOf(matvar->data_type);
+
+    for ( i = 0; i < N; i += n ) {
+        n = N - i;
+        if ( n > sizeof(buf)/sizeof(*buf) )
+            n = sizeof(buf)/sizeof(*buf);
+        if ( mat->data_region(matvar,matvar->internal->source,i,n,buf) != n ) {
+            Mat_Critical("Couldn't get the data of a streamed variable");
+            return;
+        }
+        fwrite(buf, data_size, n, (FILE*)mat->fp);
+    }
+}
+
 /** @if mat_devman
  * @brief Writes a matlab variable to a version 4 matlab file
  *
@@ -93,6 +150,8 @@ Mat_Create4(const char* matname)
  * @param mat MAT file pointer
  * @param matvar pointer to the mat variable
  * @retval 0 on success
+ * @retval 2 if the class or data type can not be stored in a version 4
+ *         file, e.g. a struct or cell array
  * @endif
  */
 int
@@ -107,6 +166,7 @@ Mat_VarWrite4(mat_t *mat,matvar_t *matvar)
     } Fmatrix;
 
     mat_int32_t nmemb = 1, i;
+    int err = 0;
     Fmatrix x;
 
     if ( NULL == mat || NULL == matvar || NULL == matvar->name || matvar->rank != 2 )
@@ -161,6 +221,8 @@ Mat_VarWrite4(mat_t *mat,matvar_t *matvar)
     /* FIXME: SEEK_END is not Guaranteed by the C standard */
     (void)fseek((FILE*)mat->fp,0,SEEK_END);         /* Always write at end of file */
 
+    AcquireDeferredData(mat,matvar);
+
     switch ( matvar->class_type ) {
         case MAT_C_CHAR:
             x.type++;
@@ -189,6 +251,10 @@ Mat_VarWrite4(mat_t *mat,matvar_t *matvar)
                 fwrite(complex_data->Re, matvar->data_size, nmemb, (FILE*)mat->fp);
                 fwrite(complex_data->Im, matvar->data_size, nmemb, (FILE*)mat->fp);
             }
+            else if ( NULL == matvar->data && NULL != matvar->internal->source &&
+                      NULL != mat->data_region ) {
+                WriteDataRegion4(mat, matvar, nmemb);
+            }
             else {
                 fwrite(matvar->data, matvar->data_size, nmemb, (FILE*)mat->fp);
             }
@@ -200,8 +266,10 @@ Mat_VarWrite4(mat_t *mat,matvar_t *matvar)
             int i, j;
             size_t stride = Mat_SizeOf(matvar->data_type);
 #if !defined(EXTENDED_SPARSE)
-            if ( MAT_T_DOUBLE != matvar->data_type )
+            if ( MAT_T_DOUBLE != matvar->data_type ) {
+                err = 2;
                 break;
+            }
 #endif
 
             sparse = (mat_sparse_t*)matvar->data;
@@ -265,10 +333,13 @@ Mat_VarWrite4(mat_t *mat,matvar_t *matvar)
             break;
         }
         default:
+            err = 2;
             break;
     }
 
-    return 0;
+    ReleaseDeferredData(mat,matvar);
+
+    return err;
 }
 
 /** @if mat_devman
@@ -300,6 +371,7 @@ Read4(mat_t *mat,matvar_t *matvar)
                 }
                 else {
                     Mat_Critical("Memory allocation failure");
+                    return;
                 }
             } else {
                 matvar->data = malloc(matvar->nbytes);
@@ -308,6 +380,7 @@ Read4(mat_t *mat,matvar_t *matvar)
                 }
                 else {
                     Mat_Critical("Memory allocation failure");
+                    return;
                 }
             }
             /* Update data type to match format of matvar->data */
@@ -322,6 +395,7 @@ Read4(mat_t *mat,matvar_t *matvar)
             }
             else {
                 Mat_Critical("Memory allocation failure");
+                return;
             }
             matvar->data_type = MAT_T_UINT8;
             break;
@@ -494,7 +568,7 @@ Read4(mat_t *mat,matvar_t *matvar)
                                 free(sparse->ir);
                                 free(matvar->data);
                                 matvar->data = NULL;
-                                Mat_Critical("Read4: %d is not a supported data type for ",
+                                Mat_Critical("Read4: %d is not a supported data type for "
                                     "extended sparse", data_type);
                                 return;
                         }
@@ -571,7 +645,7 @@ Read4(mat_t *mat,matvar_t *matvar)
                                 free(sparse->ir);
                                 free(matvar->data);
                                 matvar->data = NULL;
-                                Mat_Critical("Read4: %d is not a supported data type for ",
+                                Mat_Critical("Read4: %d is not a supported data type for "
                                     "extended sparse", data_type);
                                 return;
                         }
@@ -592,6 +666,7 @@ Read4(mat_t *mat,matvar_t *matvar)
             }
             else {
                 Mat_Critical("Memory allocation failure");
+                return;
             }
         default:
             Mat_Critical("MAT V4 data type error");
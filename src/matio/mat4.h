@@ -35,6 +35,7 @@
 #endif
 
 EXTERN mat_t *Mat_Create4(const char* matname);
+EXTERN mat_t *Mat_CreateStream4(FILE *fp,const char* matname);
 int  Mat_VarWrite4(mat_t *mat,matvar_t *matvar);
 void Read4(mat_t *mat, matvar_t *matvar);
 int  ReadData4(mat_t *mat,matvar_t *matvar,void *data,
@@ -38,6 +38,9 @@
 #include <time.h>
 #include "matio_private.h"
 #include "mat5.h"
+#if defined(MAT_DEFLATE_THREADS)
+#   include <pthread.h>
+#endif
 
 /** Get type from tag */
 #define TYPE_FROM_TAG(a)          (enum matio_types)((a) & 0x000000ff)
@@ -45,6 +48,20 @@
 #define CLASS_FROM_ARRAY_FLAGS(a) (enum matio_classes)((a) & 0x000000ff)
 /** Class type mask */
 #define CLASS_TYPE_MASK           0x000000ff
+/** Number of elements of a streamed variable written at a time */
+#define MAT_REGION_CHUNK          4096
+/** Number of bytes in each block sampled for MAT_COMPRESSION_AUTO */
+#define MAT_SAMPLE_BLOCK          65536
+/** Number of blocks sampled of each variable for MAT_COMPRESSION_AUTO */
+#define MAT_SAMPLE_BLOCKS         3
+/** Percent a sample must shrink for the variable to be compressed */
+#define MAT_SAMPLE_MIN_SAVING     10
+/** Number of bytes in each block deflated on its own thread */
+#define MAT_DEFLATE_BLOCK         1048576
+/** Number of bytes preceding a block that prime its compression */
+#define MAT_DEFLATE_DICT          32768
+/** Minimum number of bytes of numeric data inflated with one read */
+#define MAT_INFLATE_WHOLE_MIN     8192
 
 static mat_complex_split_t null_complex_data = {NULL,NULL};
 
@@ -54,6 +71,7 @@ static size_t GetStructFieldBufSize(matvar_t *matvar);
 static size_t GetCellArrayFieldBufSize(matvar_t *matvar);
 static size_t GetMatrixMaxBufSize(matvar_t *matvar);
 static size_t GetEmptyMatrixMaxBufSize(const char *name,int rank);
+static void ClearBufSizeCache(matvar_t *matvar);
 static size_t WriteEmptyCharData(mat_t *mat, int N, enum matio_types data_type);
 static size_t WriteEmptyData(mat_t *mat,int N,enum matio_types data_type);
 static size_t ReadNextCell( mat_t *mat, matvar_t *matvar );
@@ -64,6 +82,7 @@ static int WriteCellArrayField(mat_t *mat,matvar_t *matvar );
 static int WriteStructField(mat_t *mat,matvar_t *matvar);
 static size_t Mat_WriteEmptyVariable5(mat_t *mat,const char *name,int rank,
                   size_t *dims);
+static int WriteVarData(mat_t *mat,matvar_t *matvar,int N);
 #if defined(HAVE_ZLIB)
 static size_t WriteCompressedCharData(mat_t *mat,z_stream *z,void *data,int N,
                   enum matio_types data_type);
@@ -73,6 +92,19 @@ static size_t WriteCompressedCharData(mat_t *mat,z_stream *z,void *data,int N,
 /*                   enum matio_types data_type); */
 static size_t WriteCompressedData(mat_t *mat,z_stream *z,void *data,int N,
                   enum matio_types data_type);
+static size_t WriteCompressedVarData(mat_t *mat,z_stream *z,matvar_t *matvar,
+                  int N);
+#if defined(MAT_DEFLATE_THREADS)
+static void  *DeflateBlock(void *arg);
+static void  *DeflateWorker(void *arg);
+static int    WriteParallelCompressedData(mat_t *mat,z_stream *z,void *data,
+                  int N,enum matio_types data_type,size_t *byteswritten);
+#endif
+static size_t SampleBlock(mat_t *mat,z_stream *z,matvar_t *matvar,void *data,
+                  size_t start,size_t N);
+static void   SampleVarData(mat_t *mat,z_stream *z,matvar_t *matvar,
+                  size_t *budget,size_t *total,size_t *in,size_t *out);
+static enum matio_compression SampleCompression(mat_t *mat,matvar_t *matvar);
 static size_t WriteCompressedCellArrayField(mat_t *mat,matvar_t *matvar,
                   z_stream *z);
 static size_t WriteCompressedStructField(mat_t *mat,matvar_t *matvar,
@@ -89,6 +121,8 @@ static size_t Mat_WriteCompressedEmptyVariable5(mat_t *mat,const char *name,
 
 /** @brief determines the number of bytes needed to store the given struct field
  *
+ * The size is cached in the variable so that writing a nested variable
+ * computes the size of each subtree once, see ClearBufSizeCache.
  * @ingroup mat_internal
  * @param matvar field of a structure
  * @return the number of bytes needed to store the struct field
@@ -103,6 +137,9 @@ GetStructFieldBufSize(matvar_t *matvar)
     if ( matvar == NULL )
         return GetEmptyMatrixMaxBufSize(NULL, 2);
 
+    if ( matvar->internal->bufsize > 0 )
+        return matvar->internal->bufsize;
+
     /* Add the Array Flags tag and space to the number of bytes */
     nBytes += tag_size + array_flags_size;
 
@@ -205,11 +242,14 @@ GetStructFieldBufSize(matvar_t *matvar)
             nBytes += tag_size + data_bytes;
     } /* switch ( matvar->class_type ) */
 
+    matvar->internal->bufsize = nBytes;
     return nBytes;
 }
 
 /** @brief determines the number of bytes needed to store the cell array element
  *
+ * Shares the cached size with GetStructFieldBufSize, since a nested
+ * element has the same layout in a struct and in a cell array.
  * @ingroup mat_internal
  * @param matvar MAT variable
  * @return the number of bytes needed to store the variable
@@ -224,6 +264,9 @@ GetCellArrayFieldBufSize(matvar_t *matvar)
     if ( matvar == NULL )
         return nBytes;
 
+    if ( matvar->internal->bufsize > 0 )
+        return matvar->internal->bufsize;
+
     /* Add the Array Flags tag and space to the number of bytes */
     nBytes += tag_size + array_flags_size;
 
@@ -324,9 +367,44 @@ GetCellArrayFieldBufSize(matvar_t *matvar)
             nBytes += tag_size + data_bytes;
     } /* switch ( matvar->class_type ) */
 
+    matvar->internal->bufsize = nBytes;
     return nBytes;
 }
 
+/** @brief Clears the cached sizes of a variable and its fields or cells
+ *
+ * Called before a variable is written, so that any change to it since
+ * a previous write is accounted for.
+ * @ingroup mat_internal
+ * @param matvar MAT variable
+ */
+static void
+ClearBufSizeCache(matvar_t *matvar)
+{
+    size_t i, nmemb = 1;
+
+    if ( NULL == matvar )
+        return;
+
+    matvar->internal->bufsize = 0;
+    if ( NULL == matvar->data )
+        return;
+
+    if ( matvar->class_type == MAT_C_STRUCT ) {
+        matvar_t **fields = (matvar_t**)matvar->data;
+        for ( i = 0; i < (size_t)matvar->rank; i++ )
+            nmemb *= matvar->dims[i];
+        nmemb *= matvar->internal->num_fields;
+        for ( i = 0; i < nmemb; i++ )
+            ClearBufSizeCache(fields[i]);
+    } else if ( matvar->class_type == MAT_C_CELL && matvar->data_size > 0 ) {
+        matvar_t **cells = (matvar_t**)matvar->data;
+        nmemb = matvar->nbytes / matvar->data_size;
+        for ( i = 0; i < nmemb; i++ )
+            ClearBufSizeCache(cells[i]);
+    }
+}
+
 /** @brief determines the number of bytes needed to store the given variable
  *
  * @ingroup mat_internal
@@ -519,16 +597,35 @@ GetMatrixMaxBufSize(matvar_t *matvar)
 mat_t *
 Mat_Create5(const char *matname,const char *hdr_str)
 {
-    FILE *fp = NULL;
+    FILE *fp = fopen(matname,"w+b");
+
+    if ( !fp )
+        return NULL;
+
+    return Mat_CreateStream5(fp,matname,hdr_str);
+}
+
+/** @if mat_devman
+ * @brief Creates a new Matlab MAT version 5 file on an open stream
+ *
+ * Like Mat_Create5, but writes the MAT file to @c fp, which must be
+ * open for reading and writing, see Mat_CreateMem.
+ * @ingroup mat_internal
+ * @param fp Empty stream to write the MAT file to, which is closed if
+ *        the MAT file can not be created
+ * @param matname Name of MAT file
+ * @param hdr_str Optional header string, NULL to use default
+ * @return A pointer to the MAT file or NULL if it failed
+ * @endif
+ */
+mat_t *
+Mat_CreateStream5(FILE *fp,const char *matname,const char *hdr_str)
+{
     mat_int16_t endian = 0, version;
     mat_t *mat = NULL;
     size_t err;
     time_t t;
 
-    fp = fopen(matname,"w+b");
-    if ( !fp )
-        return NULL;
-
     mat = (mat_t*)malloc(sizeof(*mat));
     if ( mat == NULL ) {
         fclose(fp);
@@ -547,6 +644,16 @@ Mat_Create5(const char *matname,const char *hdr_str)
     mat->num_datasets  = 0;
     mat->refs_id       = -1;
     mat->dir           = NULL;
+    mat->write_data    = NULL;
+    mat->data_region   = NULL;
+    mat->use_arena     = 0;
+    mat->read_fields   = 1;
+    mat->deflate_threads = 1;
+#if defined(HAVE_ZLIB)
+    mat->zpool         = NULL;
+    mat->zdeflate      = NULL;
+    mat->zsample       = NULL;
+#endif
 
     t = time(NULL);
     mat->fp       = fp;
@@ -1560,6 +1667,68 @@ WriteData(mat_t *mat,void *data,int N,enum matio_types data_type)
     return nBytes;
 }
 
+/** @brief Copies the next chunk of a streamed variable into a buffer
+ *
+ * @ingroup mat_internal
+ * @param mat MAT file pointer
+ * @param matvar MAT variable with its data supplied by regions
+ * @param start index of the first element of the chunk
+ * @param N number of elements in the chunk
+ * @param buf buffer of at least N elements of the data type of @c matvar
+ * @retval 0 on success
+ */
+static int
+ReadDataRegion(mat_t *mat,matvar_t *matvar,size_t start,size_t N,void *buf)
+{
+    if ( mat->data_region(matvar,matvar->internal->source,start,N,buf) != N ) {
+        Mat_Critical("Couldn't get the data of a streamed variable");
+        return 1;
+    }
+    return 0;
+}
+
+/** @brief Writes the numeric data of a variable to the file
+ *
+ * Writes the data buffer of @c matvar with WriteData.  A deferred
+ * variable that was left without a data buffer when its data was
+ * acquired is written in chunks of at most MAT_REGION_CHUNK elements
+ * copied by the data region function of the MAT file, see
+ * Mat_SetDataRegionFunc.
+ * @ingroup mat_internal
+ * @param mat MAT file pointer
+ * @param matvar MAT variable
+ * @param N number of elements to write
+ * @return number of bytes written
+ */
+static int
+WriteVarData(mat_t *mat,matvar_t *matvar,int N)
+{
+    int nBytes, data_size;
+    enum matio_types data_type = matvar->data_type;
+    double buf[MAT_REGION_CHUNK];
+    size_t i, n;
+
+    if ( NULL != matvar->data || NULL == matvar->internal->source ||
+         NULL == mat->data_region || N < 1 )
+        return WriteData(mat,matvar->data,N,data_type);
+
+    data_size = Mat_SizeOf(data_type);
+    nBytes    = N*data_size;
+    fwrite(&data_type,4,1,(FILE*)mat->fp);
+    fwrite(&nBytes,4,1,(FILE*)mat->fp);
+
+    for ( i = 0; i < (size_t)N; i += n ) {
+        n = N - i;
+        if ( n > MAT_REGION_CHUNK )
+            n = MAT_REGION_CHUNK;
+        if ( ReadDataRegion(mat,matvar,i,n,buf) )
+            break;
+        fwrite(buf,data_size,n,(FILE*)mat->fp);
+    }
+
+    return nBytes;
+}
+
 #if defined(HAVE_ZLIB)
 /* Compresses the data buffer and writes it to the file */
 static size_t
@@ -1611,7 +1780,600 @@ WriteCompressedData(mat_t *mat,z_streamp z,void *data,int N,
     nBytes = byteswritten;
     return nBytes;
 }
-#endif
+
+#if defined(MAT_DEFLATE_THREADS)
+/** @if mat_devman
+ * @brief Block of numeric data deflated by a worker
+ *
+ * @ingroup mat_internal
+ * @endif
+ */
+struct mat_deflate_block {
+    const mat_uint8_t *data; /**< Uncompressed data of the block */
+    size_t len;              /**< Number of bytes in the block */
+    const mat_uint8_t *dict; /**< Data preceding the block, or NULL */
+    size_t dict_len;         /**< Number of bytes in the dictionary */
+    int    flush;            /**< Z_SYNC_FLUSH, or Z_FINISH for the last block */
+    mat_uint8_t *out;        /**< Compressed block, to be freed */
+    size_t nout;             /**< Number of bytes in the compressed block */
+    uLong  adler;            /**< Adler-32 checksum of the block */
+    int    err;              /**< Non-zero if the block could not be compressed */
+    int    done;             /**< Non-zero when a worker has deflated the block */
+};
+
+/** @brief Deflates a block of numeric data
+ *
+ * Compresses the block as raw deflate data with the data preceding it
+ * as dictionary, so that the compressed blocks of a variable can be
+ * concatenated into one zlib stream.  Called on a worker thread, so
+ * only allocates memory and calls zlib.
+ * @ingroup mat_internal
+ * @param arg Pointer to the mat_deflate_block
+ * @return NULL
+ */
+static void *
+DeflateBlock(void *arg)
+{
+    struct mat_deflate_block *block = (struct mat_deflate_block*)arg;
+    z_stream z;
+    size_t size;
+    int err;
+
+    block->err   = 1;
+    block->out   = NULL;
+    block->nout  = 0;
+    block->adler = adler32(adler32(0L,Z_NULL,0),block->data,block->len);
+
+    memset(&z,0,sizeof(z));
+    if ( deflateInit2(&z,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-MAX_WBITS,8,
+                      Z_DEFAULT_STRATEGY) != Z_OK )
+        return NULL;
+    if ( NULL != block->dict &&
+         deflateSetDictionary(&z,block->dict,block->dict_len) != Z_OK ) {
+        deflateEnd(&z);
+        return NULL;
+    }
+
+    /* The bound does not include the empty block of a sync flush */
+    size = deflateBound(&z,block->len) + 16;
+    block->out = (mat_uint8_t*)malloc(size);
+    if ( NULL != block->out ) {
+        z.next_in   = (Bytef*)block->data;
+        z.avail_in  = block->len;
+        z.next_out  = block->out;
+        z.avail_out = size;
+        err = deflate(&z,block->flush);
+        if ( z.avail_in == 0 && z.avail_out > 0 &&
+             err == (block->flush == Z_FINISH ? Z_STREAM_END : Z_OK) ) {
+            block->nout = size - z.avail_out;
+            block->err  = 0;
+        } else {
+            free(block->out);
+            block->out = NULL;
+        }
+    }
+    deflateEnd(&z);
+
+    return NULL;
+}
+
+/** @if mat_devman
+ * @brief Workers deflating the blocks of a variable
+ *
+ * The workers take the blocks in order and deflate them into a ring of
+ * @c nslots blocks, at most @c nslots blocks ahead of the block the
+ * calling thread writes to the file.
+ * @ingroup mat_internal
+ * @endif
+ */
+struct mat_deflate_pool {
+    pthread_mutex_t lock;        /**< Protects the fields below and done */
+    pthread_cond_t  cond;        /**< Signalled when a block is done or written */
+    const mat_uint8_t *data;     /**< Uncompressed data of the variable */
+    size_t nbytes;               /**< Number of bytes of data */
+    size_t nblocks;              /**< Number of blocks of data */
+    size_t next;                 /**< Index of the next block to deflate */
+    size_t written;              /**< Number of blocks written to the file */
+    size_t nslots;               /**< Number of blocks in the ring */
+    struct mat_deflate_block *slots; /**< Ring of blocks */
+    int stop;                    /**< The workers are asked to stop */
+};
+
+/** @brief Sets the data of block @c k of the variable
+ *
+ * @ingroup mat_internal
+ * @param pool Pool deflating the variable
+ * @param k Index of the block
+ * @param block Block to set
+ */
+static void
+SetDeflateBlock(struct mat_deflate_pool *pool,size_t k,
+    struct mat_deflate_block *block)
+{
+    size_t offset = k*MAT_DEFLATE_BLOCK;
+
+    block->data     = pool->data + offset;
+    block->len      = pool->nbytes - offset;
+    if ( block->len > MAT_DEFLATE_BLOCK )
+        block->len = MAT_DEFLATE_BLOCK;
+    block->dict_len = offset < MAT_DEFLATE_DICT ? offset : MAT_DEFLATE_DICT;
+    block->dict     = offset > 0 ? block->data - block->dict_len : NULL;
+    block->flush    = Z_SYNC_FLUSH;
+}
+
+/** @brief Deflates blocks of the pool until all blocks are taken
+ *
+ * Runs on a worker thread.  Errors are left in the blocks for the
+ * calling thread to report.
+ * @ingroup mat_internal
+ * @param arg Pointer to the mat_deflate_pool
+ * @return NULL
+ */
+static void *
+DeflateWorker(void *arg)
+{
+    struct mat_deflate_pool *pool = (struct mat_deflate_pool*)arg;
+    struct mat_deflate_block *block;
+    size_t k;
+
+    pthread_mutex_lock(&pool->lock);
+    for ( ;; ) {
+        while ( !pool->stop && pool->next < pool->nblocks &&
+                pool->next >= pool->written + pool->nslots )
+            pthread_cond_wait(&pool->cond,&pool->lock);
+        if ( pool->stop || pool->next >= pool->nblocks )
+            break;
+        k     = pool->next++;
+        block = pool->slots + k % pool->nslots;
+        pthread_mutex_unlock(&pool->lock);
+
+        SetDeflateBlock(pool,k,block);
+        DeflateBlock(block);
+
+        pthread_mutex_lock(&pool->lock);
+        block->done = 1;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/** @brief Compresses the numeric data of a variable on several threads
+ *
+ * Like WriteCompressedData, but deflates blocks of MAT_DEFLATE_BLOCK
+ * bytes of the data on a pool of mat->deflate_threads workers, which
+ * are started once for the variable.  Each block is primed with the
+ * data preceding it and ends on a byte boundary with a sync flush, so
+ * the blocks written in order continue the zlib stream @c z.  The
+ * stream is then finished with the Adler-32 checksum of the variable,
+ * combined from the checksums of the blocks.  The result is a single
+ * zlib stream that any inflater reads, but it differs from the output
+ * of WriteCompressedData.  The blocks are deflated on the calling
+ * thread if no worker can be started.
+ * @ingroup mat_internal
+ * @param mat MAT file pointer
+ * @param z zlib compression stream of the variable, which is finished
+ * @param data data buffer
+ * @param N number of elements to write
+ * @param data_type data type of the elements
+ * @param byteswritten incremented by the number of bytes written
+ * @retval 0 on success
+ * @retval 1 if the data could not be deflated, for the caller to report
+ */
+static int
+WriteParallelCompressedData(mat_t *mat,z_streamp z,void *data,int N,
+    enum matio_types data_type,size_t *byteswritten)
+{
+    struct mat_deflate_pool pool;
+    struct mat_deflate_block *block, last;
+    pthread_t *workers;
+    int data_tag[2], nworkers = 0, i, err = 0;
+    mat_uint8_t buf[1024], pad[8] = {0,}, trailer[4];
+    size_t data_size, k;
+    uLong adler;
+
+    data_size   = Mat_SizeOf(data_type);
+    data_tag[0] = data_type;
+    data_tag[1] = N*data_size;
+
+    /* Flush the stream to a byte boundary after the tag of the data */
+    z->next_in  = ZLIB_BYTE_PTR(data_tag);
+    z->avail_in = 8;
+    do {
+        z->next_out  = buf;
+        z->avail_out = sizeof(buf);
+        deflate(z,Z_SYNC_FLUSH);
+        *byteswritten += fwrite(buf,1,sizeof(buf)-z->avail_out,(FILE*)mat->fp);
+    } while ( z->avail_out == 0 );
+    adler = z->adler;
+
+    memset(&pool,0,sizeof(pool));
+    pool.data    = (const mat_uint8_t*)data;
+    pool.nbytes  = N*data_size;
+    pool.nblocks = (pool.nbytes + MAT_DEFLATE_BLOCK - 1) / MAT_DEFLATE_BLOCK;
+    pool.nslots  = 2*(size_t)mat->deflate_threads;
+    pool.slots   = (struct mat_deflate_block*)calloc(pool.nslots,
+                       sizeof(*pool.slots));
+    workers      = (pthread_t*)calloc(mat->deflate_threads,sizeof(*workers));
+    if ( NULL == pool.slots || NULL == workers ) {
+        free(pool.slots);
+        free(workers);
+        return 1;
+    }
+
+    if ( !pthread_mutex_init(&pool.lock,NULL) ) {
+        if ( !pthread_cond_init(&pool.cond,NULL) ) {
+            for ( i = 0; i < mat->deflate_threads; i++ ) {
+                if ( pthread_create(workers+i,NULL,DeflateWorker,&pool) )
+                    break;
+                nworkers++;
+            }
+            if ( 0 == nworkers )
+                pthread_cond_destroy(&pool.cond);
+        }
+        if ( 0 == nworkers )
+            pthread_mutex_destroy(&pool.lock);
+    }
+
+    /* Write the blocks in order as the workers finish them */
+    for ( k = 0; k < pool.nblocks && !err; k++ ) {
+        block = pool.slots + k % pool.nslots;
+        if ( nworkers > 0 ) {
+            pthread_mutex_lock(&pool.lock);
+            while ( !block->done )
+                pthread_cond_wait(&pool.cond,&pool.lock);
+            pthread_mutex_unlock(&pool.lock);
+        } else {
+            SetDeflateBlock(&pool,k,block);
+            DeflateBlock(block);
+        }
+        if ( block->err ) {
+            err = 1;
+        } else {
+            *byteswritten += fwrite(block->out,1,block->nout,(FILE*)mat->fp);
+            adler = adler32_combine(adler,block->adler,block->len);
+        }
+        free(block->out);
+        block->out = NULL;
+        if ( nworkers > 0 ) {
+            pthread_mutex_lock(&pool.lock);
+            block->done  = 0;
+            pool.written = k + 1;
+            pool.stop    = err;
+            pthread_cond_broadcast(&pool.cond);
+            pthread_mutex_unlock(&pool.lock);
+        }
+    }
+
+    if ( nworkers > 0 ) {
+        pthread_mutex_lock(&pool.lock);
+        pool.stop = 1;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+        for ( i = 0; i < nworkers; i++ )
+            pthread_join(workers[i],NULL);
+        pthread_cond_destroy(&pool.cond);
+        pthread_mutex_destroy(&pool.lock);
+    }
+    /* Blocks deflated ahead of an error */
+    for ( k = 0; k < pool.nslots; k++ )
+        free(pool.slots[k].out);
+    free(pool.slots);
+    free(workers);
+    if ( err )
+        return err;
+
+    /* Add/Compress padding to pad to 8-byte boundary and finish */
+    memset(&last,0,sizeof(last));
+    last.data  = pad;
+    last.len   = pool.nbytes % 8 ? 8 - (pool.nbytes % 8) : 0;
+    last.flush = Z_FINISH;
+    DeflateBlock(&last);
+    if ( last.err )
+        return 1;
+    *byteswritten += fwrite(last.out,1,last.nout,(FILE*)mat->fp);
+    adler = adler32_combine(adler,last.adler,last.len);
+    free(last.out);
+
+    trailer[0] = (mat_uint8_t)(adler >> 24);
+    trailer[1] = (mat_uint8_t)(adler >> 16);
+    trailer[2] = (mat_uint8_t)(adler >> 8);
+    trailer[3] = (mat_uint8_t)adler;
+    *byteswritten += fwrite(trailer,1,4,(FILE*)mat->fp);
+
+    return 0;
+}
+#endif
+
+/** @brief Compresses the numeric data of a variable and writes it to the file
+ *
+ * Like WriteVarData, but compresses the data with WriteCompressedData,
+ * or chunk by chunk for a variable with its data supplied by regions.
+ * @ingroup mat_internal
+ * @param mat MAT file pointer
+ * @param z zlib compression stream
+ * @param matvar MAT variable
+ * @param N number of elements to write
+ * @return number of bytes written
+ */
+static size_t
+WriteCompressedVarData(mat_t *mat,z_streamp z,matvar_t *matvar,int N)
+{
+    int data_size, data_tag[2], byteswritten = 0;
+    int buf_size = 1024;
+    mat_uint8_t buf[1024], pad[8] = {0,};
+    double chunk[MAT_REGION_CHUNK];
+    size_t i, n;
+
+    if ( NULL != matvar->data || NULL == matvar->internal->source ||
+         NULL == mat->data_region || N < 1 )
+        return WriteCompressedData(mat,z,matvar->data,N,matvar->data_type);
+
+    data_size   = Mat_SizeOf(matvar->data_type);
+    data_tag[0] = matvar->data_type;
+    data_tag[1] = data_size*N;
+    z->next_in  = ZLIB_BYTE_PTR(data_tag);
+    z->avail_in = 8;
+    do {
+        z->next_out  = buf;
+        z->avail_out = buf_size;
+        deflate(z,Z_NO_FLUSH);
+        byteswritten += fwrite(buf,1,buf_size-z->avail_out,(FILE*)mat->fp);
+    } while ( z->avail_out == 0 );
+
+    for ( i = 0; i < (size_t)N; i += n ) {
+        n = N - i;
+        if ( n > MAT_REGION_CHUNK )
+            n = MAT_REGION_CHUNK;
+        if ( ReadDataRegion(mat,matvar,i,n,chunk) )
+            return byteswritten;
+        z->next_in  = (Bytef*)chunk;
+        z->avail_in = n*data_size;
+        do {
+            z->next_out  = buf;
+            z->avail_out = buf_size;
+            deflate(z,Z_NO_FLUSH);
+            byteswritten += fwrite(buf,1,buf_size-z->avail_out,(FILE*)mat->fp);
+        } while ( z->avail_out == 0 );
+    }
+    /* Add/Compress padding to pad to 8-byte boundary */
+    if ( N*data_size % 8 ) {
+        z->next_in  = pad;
+        z->avail_in = 8 - (N*data_size % 8);
+        do {
+            z->next_out  = buf;
+            z->avail_out = buf_size;
+            deflate(z,Z_NO_FLUSH);
+            byteswritten += fwrite(buf,1,buf_size-z->avail_out,(FILE*)mat->fp);
+        } while ( z->avail_out == 0 );
+    }
+
+    return byteswritten;
+}
+
+/** @brief Compresses a block of the numeric data of a variable
+ *
+ * The compressed data is discarded, only its size is counted.
+ * @ingroup mat_internal
+ * @param mat MAT file pointer
+ * @param z zlib compression stream for sampling, see Mat_SampleStream
+ * @param matvar MAT variable
+ * @param data data buffer of @c matvar, or NULL to copy the block with
+ *        the data region function of the MAT file
+ * @param start index of the first element of the block
+ * @param N number of elements in the block
+ * @return size of the compressed block in bytes
+ */
+static size_t
+SampleBlock(mat_t *mat,z_streamp z,matvar_t *matvar,void *data,size_t start,
+    size_t N)
+{
+    size_t data_size = Mat_SizeOf(matvar->data_type), nout = 0, i, n;
+    mat_uint8_t buf[4096];
+    double chunk[MAT_REGION_CHUNK];
+    int flush;
+
+    if ( deflateReset(z) != Z_OK )
+        return N*data_size;
+
+    for ( i = 0; i < N; i += n ) {
+        n = N - i;
+        if ( n > MAT_REGION_CHUNK )
+            n = MAT_REGION_CHUNK;
+        if ( NULL != data ) {
+            z->next_in = (Bytef*)data + (start+i)*data_size;
+        } else {
+            if ( ReadDataRegion(mat,matvar,start+i,n,chunk) )
+                return nout;
+            z->next_in = (Bytef*)chunk;
+        }
+        z->avail_in = n*data_size;
+        flush = i + n < N ? Z_NO_FLUSH : Z_FINISH;
+        do {
+            z->next_out  = buf;
+            z->avail_out = sizeof(buf);
+            deflate(z,flush);
+            nout += sizeof(buf)-z->avail_out;
+        } while ( z->avail_out == 0 );
+    }
+
+    return nout;
+}
+
+/** @brief Samples how well the numeric data of a variable compresses
+ *
+ * Compresses up to MAT_SAMPLE_BLOCKS blocks, spread over the data, of
+ * every numeric array in @c matvar and in its cells and struct fields,
+ * until @c budget bytes have been sampled.  Deferred data is acquired
+ * for the sample and released again.
+ * @ingroup mat_internal
+ * @param mat MAT file pointer
+ * @param z zlib compression stream for sampling, see Mat_SampleStream
+ * @param matvar MAT variable
+ * @param budget number of bytes left to sample, updated
+ * @param total incremented by the size of the numeric data in bytes
+ * @param in incremented by the number of bytes sampled
+ * @param out incremented by the compressed size of the sample
+ */
+static void
+SampleVarData(mat_t *mat,z_streamp z,matvar_t *matvar,size_t *budget,
+    size_t *total,size_t *in,size_t *out)
+{
+    size_t nmemb = 1, data_size, block, nblocks, i;
+    int acquired = 0;
+    void *data;
+
+    if ( NULL == matvar )
+        return;
+
+    for ( i = 0; i < (size_t)matvar->rank; i++ )
+        nmemb *= matvar->dims[i];
+
+    switch ( matvar->class_type ) {
+        case MAT_C_DOUBLE:
+        case MAT_C_SINGLE:
+        case MAT_C_INT64:
+        case MAT_C_UINT64:
+        case MAT_C_INT32:
+        case MAT_C_UINT32:
+        case MAT_C_INT16:
+        case MAT_C_UINT16:
+        case MAT_C_INT8:
+        case MAT_C_UINT8:
+            break;
+        case MAT_C_CELL:
+        case MAT_C_STRUCT:
+        {
+            matvar_t **fields = (matvar_t **)matvar->data;
+
+            if ( NULL == fields )
+                return;
+            if ( MAT_C_STRUCT == matvar->class_type )
+                nmemb *= matvar->internal->num_fields;
+            for ( i = 0; i < nmemb; i++ )
+                SampleVarData(mat,z,fields[i],budget,total,in,out);
+            return;
+        }
+        default:
+            return;
+    }
+
+    data_size = Mat_SizeOf(matvar->data_type);
+    if ( nmemb < 1 || data_size < 1 )
+        return;
+    *total += nmemb*data_size*(matvar->isComplex ? 2 : 1);
+    if ( *budget < data_size )
+        return;
+
+    if ( NULL == matvar->data && NULL != matvar->internal->source ) {
+        AcquireDeferredData(mat,matvar);
+        acquired = 1;
+    }
+
+    data = matvar->data;
+    if ( NULL != data && matvar->isComplex )
+        data = ((mat_complex_split_t*)data)->Re;
+    if ( NULL != data ||
+         (NULL != matvar->internal->source && NULL != mat->data_region) ) {
+        block = MAT_SAMPLE_BLOCK / data_size;
+        nblocks = nmemb > block ? MAT_SAMPLE_BLOCKS : 1;
+        if ( block > nmemb )
+            block = nmemb;
+        for ( i = 0; i < nblocks && *budget >= data_size; i++ ) {
+            size_t start = nblocks > 1 ? i*(nmemb-block)/(nblocks-1) : 0;
+            size_t n = block;
+
+            if ( n*data_size > *budget )
+                n = *budget / data_size;
+            *out += SampleBlock(mat,z,matvar,data,start,n);
+            *in += n*data_size;
+            *budget -= n*data_size;
+        }
+    }
+
+    if ( acquired )
+        ReleaseDeferredData(mat,matvar);
+}
+
+/** @brief Chooses whether to compress a variable for MAT_COMPRESSION_AUTO
+ *
+ * The numeric data of the variable is sampled with SampleVarData.  A
+ * variable is written uncompressed if the sample shrinks by less than
+ * MAT_SAMPLE_MIN_SAVING percent, which is typical for noisy floating
+ * point data, where deflate costs much time for little gain.
+ * Variables with less numeric data than a sample block, and
+ * variables without numeric data, are always compressed.
+ * @ingroup mat_internal
+ * @param mat MAT file pointer
+ * @param matvar MAT variable
+ * @return MAT_COMPRESSION_ZLIB or MAT_COMPRESSION_NONE
+ */
+static enum matio_compression
+SampleCompression(mat_t *mat,matvar_t *matvar)
+{
+    size_t budget = MAT_SAMPLE_BLOCKS*MAT_SAMPLE_BLOCK;
+    size_t total = 0, in = 0, out = 0;
+    z_streamp z = Mat_SampleStream(mat);
+
+    if ( NULL == z )
+        return MAT_COMPRESSION_ZLIB;
+
+    SampleVarData(mat,z,matvar,&budget,&total,&in,&out);
+    if ( total < MAT_SAMPLE_BLOCK || in < 1 ||
+         out*100 < in*(100-MAT_SAMPLE_MIN_SAVING) )
+        return MAT_COMPRESSION_ZLIB;
+
+    return MAT_COMPRESSION_NONE;
+}
+#endif
+
+/** @brief Allocates a cell or struct field element of @c parent
+ *
+ * The element is allocated from the arena of @c parent if it has one.
+ * @ingroup mat_internal
+ * @param parent Cell array or struct the element belongs to
+ * @return A newly allocated matvar_t
+ */
+static matvar_t *
+CallocElement(matvar_t *parent)
+{
+    if ( NULL != parent->internal->arena )
+        return Mat_VarCallocArena(parent->internal->arena);
+    return Mat_VarCalloc();
+}
+
+/** @brief Allocates the dimensions or name of an element of @c parent
+ *
+ * @ingroup mat_internal
+ * @param parent Cell array or struct the element belongs to
+ * @param nbytes Number of bytes to allocate
+ * @return Pointer to the memory
+ */
+static void *
+MallocElement(matvar_t *parent,size_t nbytes)
+{
+    if ( NULL != parent->internal->arena )
+        return Mat_ArenaAlloc(parent->internal->arena,nbytes);
+    return malloc(nbytes);
+}
+
+/** @brief Copies the name of an element of @c parent
+ *
+ * @ingroup mat_internal
+ * @param parent Cell array or struct the element belongs to
+ * @param name Name to copy
+ * @return Pointer to the copy
+ */
+static char *
+StrdupElement(matvar_t *parent,const char *name)
+{
+    size_t len = strlen(name);
+    char *copy = (char*)MallocElement(parent,len+1);
+    if ( NULL != copy )
+        memcpy(copy,name,len+1);
+    return copy;
+}
 
 /** @brief Reads the next cell of the cell array in @c matvar
  *
@@ -1632,7 +2394,8 @@ ReadNextCell( mat_t *mat, matvar_t *matvar )
         ncells *= matvar->dims[i];
     matvar->data_size = sizeof(matvar_t *);
     matvar->nbytes    = ncells*matvar->data_size;
-    matvar->data      = malloc(matvar->nbytes);
+    /* Cells not read after an error are NULL */
+    matvar->data      = calloc(ncells,matvar->data_size);
     if ( NULL == matvar->data ) {
         Mat_Critical("Couldn't allocate memory for %s->data",matvar->name);
         return bytesread;
@@ -1647,16 +2410,16 @@ ReadNextCell( mat_t *mat, matvar_t *matvar )
         int err;
 
         for ( i = 0; i < ncells; i++ ) {
-            cells[i] = Mat_VarCalloc();
+            cells[i] = CallocElement(matvar);
             if ( NULL == cells[i] ) {
                 Mat_Critical("Couldn't allocate memory for cell %d", i);
-                continue;
+                break;
             }
 
             cells[i]->internal->fpos = ftell((FILE*)mat->fp);
             if ( cells[i]->internal->fpos == -1L ) {
                 Mat_Critical("Couldn't determine file position");
-                continue;
+                break;
             } else {
                 cells[i]->internal->fpos -= matvar->internal->z->avail_in;
             }
@@ -1703,6 +2466,7 @@ ReadNextCell( mat_t *mat, matvar_t *matvar )
                 Mat_Critical("Expected MAT_T_UINT32 for Array Tags, got %d",
                                uncomp_buf[0]);
                 bytesread+=InflateSkip(mat,matvar->internal->z,nbytes);
+                break;
             }
             if ( cells[i]->class_type != MAT_C_OPAQUE ) {
                 bytesread += InflateDimensions(mat,matvar,uncomp_buf);
@@ -1718,7 +2482,8 @@ ReadNextCell( mat_t *mat, matvar_t *matvar )
                     cells[i]->rank = uncomp_buf[1];
                     nbytes -= cells[i]->rank;
                     cells[i]->rank /= 4;
-                    cells[i]->dims = (size_t*)malloc(cells[i]->rank*sizeof(*cells[i]->dims));
+                    cells[i]->dims = (size_t*)MallocElement(matvar,
+                        cells[i]->rank*sizeof(*cells[i]->dims));
                     if ( mat->byteswap ) {
                         for ( j = 0; j < cells[i]->rank; j++ )
                             cells[i]->dims[j] = Mat_uint32Swap(uncomp_buf+2+j);
@@ -1744,7 +2509,7 @@ ReadNextCell( mat_t *mat, matvar_t *matvar )
 
                         if ( len % 8 > 0 )
                             len = len+(8-(len % 8));
-                        cells[i]->name = (char*)malloc(len+1);
+                        cells[i]->name = (char*)MallocElement(matvar,len+1);
                         /* Inflate variable name */
                         bytesread += InflateVarName(mat,matvar,cells[i]->name,len);
                         cells[i]->name[len] = '\0';
@@ -1753,7 +2518,7 @@ ReadNextCell( mat_t *mat, matvar_t *matvar )
                                ((uncomp_buf[0] & 0xffff0000) != 0x00) ) {
                         /* Name packed in tag */
                         len = (uncomp_buf[0] & 0xffff0000) >> 16;
-                        cells[i]->name = (char*)malloc(len+1);
+                        cells[i]->name = (char*)MallocElement(matvar,len+1);
                         memcpy(cells[i]->name,uncomp_buf+1,len);
                         cells[i]->name[len] = '\0';
                     }
@@ -1762,6 +2527,7 @@ ReadNextCell( mat_t *mat, matvar_t *matvar )
                 if ( cells[i]->internal->z != NULL ) {
                     err = inflateCopy(cells[i]->internal->z,matvar->internal->z);
                     if ( err == Z_OK ) {
+                        cells[i]->internal->zend = matvar->internal->zend;
                         cells[i]->internal->datapos = ftell((FILE*)mat->fp);
                         if ( cells[i]->internal->datapos != -1L ) {
                             cells[i]->internal->datapos -= matvar->internal->z->avail_in;
@@ -1780,6 +2546,7 @@ ReadNextCell( mat_t *mat, matvar_t *matvar )
                             (void)fseek((FILE*)mat->fp,cells[i]->internal->datapos,SEEK_SET);
                         } else {
                             Mat_Critical("Couldn't determine file position");
+                            break;
                         }
                         if ( cells[i]->internal->data != NULL ||
                              cells[i]->class_type == MAT_C_STRUCT ||
@@ -1791,9 +2558,11 @@ ReadNextCell( mat_t *mat, matvar_t *matvar )
                         }
                     } else {
                         Mat_Critical("inflateCopy returned error %s",zError(err));
+                        break;
                     }
                 } else {
                     Mat_Critical("Couldn't allocate memory");
+                    break;
                 }
             }
             bytesread+=InflateSkip(mat,matvar->internal->z,nbytes);
@@ -1809,16 +2578,16 @@ ReadNextCell( mat_t *mat, matvar_t *matvar )
 
         for ( i = 0; i < ncells; i++ ) {
             int cell_bytes_read,name_len;
-            cells[i] = Mat_VarCalloc();
+            cells[i] = CallocElement(matvar);
             if ( !cells[i] ) {
                 Mat_Critical("Couldn't allocate memory for cell %d", i);
-                continue;
+                break;
             }
 
             cells[i]->internal->fpos = ftell((FILE*)mat->fp);
             if ( cells[i]->internal->fpos == -1L ) {
                 Mat_Critical("Couldn't determine file position");
-                continue;
+                break;
             }
 
             /* Read variable tag for cell */
@@ -1878,7 +2647,8 @@ ReadNextCell( mat_t *mat, matvar_t *matvar )
                 nBytes-=nbytes;
 
                 cells[i]->rank = nbytes / 4;
-                cells[i]->dims = (size_t*)malloc(cells[i]->rank*sizeof(*cells[i]->dims));
+                cells[i]->dims = (size_t*)MallocElement(matvar,
+                        cells[i]->rank*sizeof(*cells[i]->dims));
 
                 /* Assumes rank <= 16 */
                 if ( cells[i]->rank % 2 != 0 ) {
@@ -1922,6 +2692,7 @@ ReadNextCell( mat_t *mat, matvar_t *matvar )
                 (void)fseek((FILE*)mat->fp,cells[i]->internal->datapos+nBytes,SEEK_SET);
             } else {
                 Mat_Critical("Couldn't determine file position");
+                break;
             }
         }
     }
@@ -2010,8 +2781,9 @@ ReadNextStructField( mat_t *mat, matvar_t *matvar )
         fields = (matvar_t**)matvar->data;
         for ( i = 0; i < nmemb; i++ ) {
             for ( j = 0; j < nfields; j++ ) {
-                fields[i*nfields+j] = Mat_VarCalloc();
-                fields[i*nfields+j]->name = strdup(matvar->internal->fieldnames[j]);
+                fields[i*nfields+j] = CallocElement(matvar);
+                fields[i*nfields+j]->name = StrdupElement(matvar,
+                    matvar->internal->fieldnames[j]);
             }
         }
 
@@ -2019,7 +2791,7 @@ ReadNextStructField( mat_t *mat, matvar_t *matvar )
             fields[i]->internal->fpos = ftell((FILE*)mat->fp);
             if ( fields[i]->internal->fpos == -1L ) {
                 Mat_Critical("Couldn't determine file position");
-                continue;
+                break;
             } else {
                 fields[i]->internal->fpos -= matvar->internal->z->avail_in;
             }
@@ -2034,7 +2806,7 @@ ReadNextStructField( mat_t *mat, matvar_t *matvar )
                 Mat_VarFree(fields[i]);
                 fields[i] = NULL;
                 Mat_Critical("fields[%d], Uncompressed type not MAT_T_MATRIX",i);
-                continue;
+                break;
             } else if ( nbytes == 0 ) {
                 fields[i]->rank = 0;
                 continue;
@@ -2063,6 +2835,7 @@ ReadNextStructField( mat_t *mat, matvar_t *matvar )
                 Mat_Critical("Expected MAT_T_UINT32 for Array Tags, got %d",
                     uncomp_buf[0]);
                 bytesread+=InflateSkip(mat,matvar->internal->z,nbytes);
+                break;
             }
             if ( fields[i]->class_type != MAT_C_OPAQUE ) {
                 bytesread += InflateDimensions(mat,matvar,uncomp_buf);
@@ -2078,7 +2851,7 @@ ReadNextStructField( mat_t *mat, matvar_t *matvar )
                     fields[i]->rank = uncomp_buf[1];
                     nbytes -= fields[i]->rank;
                     fields[i]->rank /= 4;
-                    fields[i]->dims = (size_t*)malloc(fields[i]->rank*
+                    fields[i]->dims = (size_t*)MallocElement(matvar,fields[i]->rank*
                                              sizeof(*fields[i]->dims));
                     if ( mat->byteswap ) {
                         for ( j = 0; j < fields[i]->rank; j++ )
@@ -2096,6 +2869,7 @@ ReadNextStructField( mat_t *mat, matvar_t *matvar )
                 if ( fields[i]->internal->z != NULL ) {
                     err = inflateCopy(fields[i]->internal->z,matvar->internal->z);
                     if ( err == Z_OK ) {
+                        fields[i]->internal->zend = matvar->internal->zend;
                         fields[i]->internal->datapos = ftell((FILE*)mat->fp);
                         if ( fields[i]->internal->datapos != -1L ) {
                             fields[i]->internal->datapos -= matvar->internal->z->avail_in;
@@ -2114,6 +2888,7 @@ ReadNextStructField( mat_t *mat, matvar_t *matvar )
                             (void)fseek((FILE*)mat->fp,fields[i]->internal->datapos,SEEK_SET);
                         } else {
                             Mat_Critical("Couldn't determine file position");
+                            break;
                         }
                         if ( fields[i]->internal->data != NULL ||
                              fields[i]->class_type == MAT_C_STRUCT ||
@@ -2125,9 +2900,11 @@ ReadNextStructField( mat_t *mat, matvar_t *matvar )
                         }
                     } else {
                         Mat_Critical("inflateCopy returned error %s",zError(err));
+                        break;
                     }
                 } else {
                     Mat_Critical("Couldn't allocate memory");
+                    break;
                 }
             }
             bytesread+=InflateSkip(mat,matvar->internal->z,nbytes);
@@ -2190,8 +2967,9 @@ ReadNextStructField( mat_t *mat, matvar_t *matvar )
         fields = (matvar_t**)matvar->data;
         for ( i = 0; i < nmemb; i++ ) {
             for ( j = 0; j < nfields; j++ ) {
-                fields[i*nfields+j] = Mat_VarCalloc();
-                fields[i*nfields+j]->name = strdup(matvar->internal->fieldnames[j]);
+                fields[i*nfields+j] = CallocElement(matvar);
+                fields[i*nfields+j]->name = StrdupElement(matvar,
+                    matvar->internal->fieldnames[j]);
             }
         }
 
@@ -2200,7 +2978,7 @@ ReadNextStructField( mat_t *mat, matvar_t *matvar )
             fields[i]->internal->fpos = ftell((FILE*)mat->fp);
             if ( fields[i]->internal->fpos == -1L ) {
                 Mat_Critical("Couldn't determine file position");
-                continue;
+                break;
             }
 
             /* Read variable tag for struct field */
@@ -2256,7 +3034,7 @@ ReadNextStructField( mat_t *mat, matvar_t *matvar )
                 nBytes-=nbytes;
 
                 fields[i]->rank = nbytes / 4;
-                fields[i]->dims = (size_t*)malloc(fields[i]->rank*
+                fields[i]->dims = (size_t*)MallocElement(matvar,fields[i]->rank*
                                          sizeof(*fields[i]->dims));
 
                 /* Assumes rank <= 16 */
@@ -2286,6 +3064,7 @@ ReadNextStructField( mat_t *mat, matvar_t *matvar )
                 (void)fseek((FILE*)mat->fp,fields[i]->internal->datapos+nBytes,SEEK_SET);
             } else {
                 Mat_Critical("Couldn't determine file position");
+                break;
             }
         }
     }
@@ -2412,6 +3191,7 @@ WriteCellArrayFieldInfo(mat_t *mat,matvar_t *matvar)
     matvar->internal->datapos = ftell((FILE*)mat->fp);
     if ( matvar->internal->datapos == -1L ) {
         Mat_Critical("Couldn't determine file position");
+        return 1;
     }
     switch ( matvar->class_type ) {
         case MAT_C_DOUBLE:
@@ -2472,6 +3252,7 @@ WriteCellArrayFieldInfo(mat_t *mat,matvar_t *matvar)
         (void)fseek((FILE*)mat->fp,end,SEEK_SET);
     } else {
         Mat_Critical("Couldn't determine file position");
+        return 1;
     }
     return 0;
 }
@@ -2497,6 +3278,11 @@ WriteCellArrayField(mat_t *mat,matvar_t *matvar )
     if ((matvar == NULL) || (mat == NULL))
         return 1;
 
+    if ( AcquireDeferredData(mat,matvar) ) {
+        ReleaseDeferredData(mat,matvar);
+        return 1;
+    }
+
 #if 0
     nBytes = GetMatrixMaxBufSize(matvar);
 #endif
@@ -2589,7 +3375,7 @@ WriteCellArrayField(mat_t *mat,matvar_t *matvar )
                     for ( i = nBytes % 8; i < 8; i++ )
                         fwrite(&pad1,1,1,(FILE*)mat->fp);
             } else {
-                nBytes = WriteData(mat,matvar->data,nmemb,matvar->data_type);
+                nBytes = WriteVarData(mat,matvar,nmemb);
                 if ( nBytes % 8 )
                     for ( i = nBytes % 8; i < 8; i++ )
                         fwrite(&pad1,1,1,(FILE*)mat->fp);
@@ -2705,7 +3491,10 @@ WriteCellArrayField(mat_t *mat,matvar_t *matvar )
         (void)fseek((FILE*)mat->fp,end,SEEK_SET);
     } else {
         Mat_Critical("Couldn't determine file position");
+        ReleaseDeferredData(mat,matvar);
+        return 1;
     }
+    ReleaseDeferredData(mat,matvar);
     return 0;
 }
 
@@ -2734,6 +3523,10 @@ WriteCompressedCellArrayField(mat_t *mat,matvar_t *matvar,z_streamp z)
     if ( NULL == matvar || NULL == mat || NULL == z)
         return 0;
 
+    if ( AcquireDeferredData(mat,matvar) ) {
+        ReleaseDeferredData(mat,matvar);
+        return byteswritten;
+    }
 
     /* Array Flags */
     array_flags = matvar->class_type & CLASS_TYPE_MASK;
@@ -2802,6 +3595,8 @@ WriteCompressedCellArrayField(mat_t *mat,matvar_t *matvar,z_streamp z)
     matvar->internal->datapos = ftell((FILE*)mat->fp);
     if ( matvar->internal->datapos == -1L ) {
         Mat_Critical("Couldn't determine file position");
+        ReleaseDeferredData(mat,matvar);
+        return byteswritten;
     }
     switch ( matvar->class_type ) {
         case MAT_C_DOUBLE:
@@ -2828,8 +3623,8 @@ WriteCompressedCellArrayField(mat_t *mat,matvar_t *matvar,z_streamp z)
                 byteswritten += WriteCompressedData(mat,z,
                     complex_data->Im,nmemb,matvar->data_type);
             } else {
-                byteswritten += WriteCompressedData(mat,z,
-                    matvar->data,nmemb,matvar->data_type);
+                byteswritten += WriteCompressedVarData(mat,z,
+                    matvar,nmemb);
             }
             break;
         }
@@ -2953,6 +3748,7 @@ WriteCompressedCellArrayField(mat_t *mat,matvar_t *matvar,z_streamp z)
         case MAT_C_OPAQUE:
             break;
     }
+    ReleaseDeferredData(mat,matvar);
     return byteswritten;
 }
 #endif
@@ -2984,6 +3780,11 @@ WriteStructField(mat_t *mat,matvar_t *matvar)
         return 0;
     }
 
+    if ( AcquireDeferredData(mat,matvar) ) {
+        ReleaseDeferredData(mat,matvar);
+        return 1;
+    }
+
     fwrite(&matrix_type,4,1,(FILE*)mat->fp);
     fwrite(&pad4,4,1,(FILE*)mat->fp);
     start = ftell((FILE*)mat->fp);
@@ -3049,7 +3850,7 @@ WriteStructField(mat_t *mat,matvar_t *matvar)
                     for ( i = nBytes % 8; i < 8; i++ )
                         fwrite(&pad1,1,1,(FILE*)mat->fp);
             } else {
-                nBytes=WriteData(mat,matvar->data,nmemb,matvar->data_type);
+                nBytes=WriteVarData(mat,matvar,nmemb);
                 if ( nBytes % 8 )
                     for ( i = nBytes % 8; i < 8; i++ )
                         fwrite(&pad1,1,1,(FILE*)mat->fp);
@@ -3168,7 +3969,10 @@ WriteStructField(mat_t *mat,matvar_t *matvar)
         (void)fseek((FILE*)mat->fp,end,SEEK_SET);
     } else {
         Mat_Critical("Couldn't determine file position");
+        ReleaseDeferredData(mat,matvar);
+        return 1;
     }
+    ReleaseDeferredData(mat,matvar);
     return 0;
 }
 
@@ -3204,6 +4008,11 @@ WriteCompressedStructField(mat_t *mat,matvar_t *matvar,z_streamp z)
         return byteswritten;
     }
 
+    if ( AcquireDeferredData(mat,matvar) ) {
+        ReleaseDeferredData(mat,matvar);
+        return byteswritten;
+    }
+
     /* Array Flags */
     array_flags = matvar->class_type & CLASS_TYPE_MASK;
     if ( matvar->isComplex )
@@ -3271,6 +4080,8 @@ WriteCompressedStructField(mat_t *mat,matvar_t *matvar,z_streamp z)
     matvar->internal->datapos = ftell((FILE*)mat->fp);
     if ( matvar->internal->datapos == -1L ) {
         Mat_Critical("Couldn't determine file position");
+        ReleaseDeferredData(mat,matvar);
+        return byteswritten;
     }
     switch ( matvar->class_type ) {
         case MAT_C_DOUBLE:
@@ -3297,8 +4108,8 @@ WriteCompressedStructField(mat_t *mat,matvar_t *matvar,z_streamp z)
                 byteswritten += WriteCompressedData(mat,z,
                     complex_data->Im,nmemb,matvar->data_type);
             } else {
-                byteswritten += WriteCompressedData(mat,z,
-                    matvar->data,nmemb,matvar->data_type);
+                byteswritten += WriteCompressedVarData(mat,z,
+                    matvar,nmemb);
             }
             break;
         }
@@ -3423,6 +4234,7 @@ WriteCompressedStructField(mat_t *mat,matvar_t *matvar,z_streamp z)
             break;
     }
 
+    ReleaseDeferredData(mat,matvar);
     return byteswritten;
 }
 #endif
@@ -3627,6 +4439,182 @@ Mat_WriteCompressedEmptyVariable5(mat_t *mat,const char *name,int rank,
 }
 #endif
 
+#if defined(HAVE_ZLIB)
+/** Convert @c n elements of type @c S at @c src to type @c T at @c dst */
+#define CAST_DATA_LOOP(T,S) \
+    do { \
+        for ( i = 0; i < n; i++ ) \
+            ((T*)dst)[i] = (T)((const S*)src)[i]; \
+    } while (0)
+
+/** Convert @c n elements at @c src of the data type to type @c T at @c dst */
+#define CAST_DATA(T) \
+    do { \
+        switch ( data_type ) { \
+            case MAT_T_DOUBLE: CAST_DATA_LOOP(T,double);       break; \
+            case MAT_T_SINGLE: CAST_DATA_LOOP(T,float);        break; \
+            CAST_DATA_INT64(T) \
+            case MAT_T_INT32:  CAST_DATA_LOOP(T,mat_int32_t);  break; \
+            case MAT_T_UINT32: CAST_DATA_LOOP(T,mat_uint32_t); break; \
+            case MAT_T_INT16:  CAST_DATA_LOOP(T,mat_int16_t);  break; \
+            case MAT_T_UINT16: CAST_DATA_LOOP(T,mat_uint16_t); break; \
+            case MAT_T_INT8:   CAST_DATA_LOOP(T,mat_int8_t);   break; \
+            case MAT_T_UINT8:  CAST_DATA_LOOP(T,mat_uint8_t);  break; \
+            default: break; \
+        } \
+    } while (0)
+
+#if defined(HAVE_MAT_INT64_T) && defined(HAVE_MAT_UINT64_T)
+#define CAST_DATA_INT64(T) \
+            case MAT_T_INT64:  CAST_DATA_LOOP(T,mat_int64_t);  break; \
+            case MAT_T_UINT64: CAST_DATA_LOOP(T,mat_uint64_t); break;
+#else
+#define CAST_DATA_INT64(T)
+#endif
+
+/** @if mat_devman
+ * @brief Converts inflated data to the type of the class
+ *
+ * @ingroup mat_internal
+ * @param dst Pointer to store the data
+ * @param class_type Class type of the variable
+ * @param src Pointer to the inflated data
+ * @param data_type Data type of the inflated data
+ * @param n Number of elements
+ * @endif
+ */
+static void
+CastData(void *dst,enum matio_classes class_type,const void *src,
+    enum matio_types data_type,size_t n)
+{
+    size_t i;
+
+    switch ( class_type ) {
+        case MAT_C_DOUBLE: CAST_DATA(double);       break;
+        case MAT_C_SINGLE: CAST_DATA(float);        break;
+#if defined(HAVE_MAT_INT64_T) && defined(HAVE_MAT_UINT64_T)
+        case MAT_C_INT64:  CAST_DATA(mat_int64_t);  break;
+        case MAT_C_UINT64: CAST_DATA(mat_uint64_t); break;
+#endif
+        case MAT_C_INT32:  CAST_DATA(mat_int32_t);  break;
+        case MAT_C_UINT32: CAST_DATA(mat_uint32_t); break;
+        case MAT_C_INT16:  CAST_DATA(mat_int16_t);  break;
+        case MAT_C_UINT16: CAST_DATA(mat_uint16_t); break;
+        case MAT_C_INT8:   CAST_DATA(mat_int8_t);   break;
+        case MAT_C_UINT8:  CAST_DATA(mat_uint8_t);  break;
+        default: break;
+    }
+}
+
+/** @if mat_devman
+ * @brief Returns the data type of a numeric class
+ *
+ * @ingroup mat_internal
+ * @param class_type Class type
+ * @return Data type of the class, or MAT_T_UNKNOWN if it is not numeric
+ * @endif
+ */
+static enum matio_types
+DataTypeOfClass(enum matio_classes class_type)
+{
+    switch ( class_type ) {
+        case MAT_C_DOUBLE: return MAT_T_DOUBLE;
+        case MAT_C_SINGLE: return MAT_T_SINGLE;
+#if defined(HAVE_MAT_INT64_T) && defined(HAVE_MAT_UINT64_T)
+        case MAT_C_INT64:  return MAT_T_INT64;
+        case MAT_C_UINT64: return MAT_T_UINT64;
+#endif
+        case MAT_C_INT32:  return MAT_T_INT32;
+        case MAT_C_UINT32: return MAT_T_UINT32;
+        case MAT_C_INT16:  return MAT_T_INT16;
+        case MAT_C_UINT16: return MAT_T_UINT16;
+        case MAT_C_INT8:   return MAT_T_INT8;
+        case MAT_C_UINT8:  return MAT_T_UINT8;
+        default:           return MAT_T_UNKNOWN;
+    }
+}
+
+/** @if mat_devman
+ * @brief Reads compressed numeric data with one read and one inflate
+ *
+ * Large numeric data of a compressed variable is read with one read of the
+ * rest of the variable and inflated with one call, directly into @c data
+ * when it is stored as the type of the class, instead of being inflated in
+ * small blocks by the ReadCompressed*Data functions.
+ * @ingroup mat_internal
+ * @param mat MAT file pointer
+ * @param matvar MAT variable pointer
+ * @param data Pointer to store the data
+ * @param data_type Data type of the stored data
+ * @param nBytes Number of bytes of the stored data from its tag
+ * @param N number of data elements allocated for the pointer
+ * @return Number of bytes of the stored data, 0 if it is to be read
+ *         with the ReadCompressed*Data functions, or -1 if inflating
+ *         failed, in which case @c data is zeroed
+ * @endif
+ */
+static int
+ReadCompressedWholeData(mat_t *mat,matvar_t *matvar,void *data,
+    enum matio_types data_type,int nBytes,size_t N)
+{
+    enum matio_types class_data_type = DataTypeOfClass(matvar->class_type);
+    size_t data_size = Mat_SizeOf(data_type);
+    void *buf = data;
+    size_t i;
+    int err;
+
+    if ( class_data_type == MAT_T_UNKNOWN || data_size == 0 || nBytes < MAT_INFLATE_WHOLE_MIN ||
+         (size_t)nBytes != N*data_size )
+        return 0;
+    switch ( data_type ) {
+        case MAT_T_DOUBLE: case MAT_T_SINGLE:
+#if defined(HAVE_MAT_INT64_T) && defined(HAVE_MAT_UINT64_T)
+        case MAT_T_INT64:  case MAT_T_UINT64:
+#endif
+        case MAT_T_INT32:  case MAT_T_UINT32:
+        case MAT_T_INT16:  case MAT_T_UINT16:
+        case MAT_T_INT8:   case MAT_T_UINT8:
+            break;
+        default:
+            return 0;
+    }
+
+    if ( data_type != class_data_type ) {
+        buf = malloc(nBytes);
+        if ( buf == NULL )
+            return 0;
+    }
+    err = InflateDataWhole(mat,matvar,buf,nBytes);
+    if ( err ) {
+        if ( buf != data )
+            free(buf);
+        if ( err < 0 )
+            return 0;
+        /* No partially inflated data after an error */
+        memset(data,0,N*Mat_SizeOf(class_data_type));
+        return -1;
+    }
+
+    if ( mat->byteswap && data_size > 1 ) {
+        mat_uint8_t *p = (mat_uint8_t*)buf, t;
+        size_t j;
+        for ( i = 0; i < N; i++, p += data_size ) {
+            for ( j = 0; j < data_size/2; j++ ) {
+                t = p[j];
+                p[j] = p[data_size-1-j];
+                p[data_size-1-j] = t;
+            }
+        }
+    }
+    if ( buf != data ) {
+        CastData(data,matvar->class_type,buf,data_type,N);
+        free(buf);
+    }
+
+    return nBytes;
+}
+#endif
+
 /** @if mat_devman
  * @brief Reads a data element including tag and data
  *
@@ -3733,53 +4721,61 @@ Mat_VarReadNumeric5(mat_t *mat,matvar_t *matvar,void *data,size_t N)
             (void)fseek((FILE*)mat->fp,8-(nBytes % 8),SEEK_CUR);
 #if defined(HAVE_ZLIB)
     } else if ( matvar->compression == MAT_COMPRESSION_ZLIB ) {
-        switch ( matvar->class_type ) {
-            case MAT_C_DOUBLE:
-                nBytes = ReadCompressedDoubleData(mat,matvar->internal->z,(double*)data,
-                                                  packed_type,N);
-                break;
-            case MAT_C_SINGLE:
-                nBytes = ReadCompressedSingleData(mat,matvar->internal->z,(float*)data,
-                                                  packed_type,N);
-                break;
-            case MAT_C_INT64:
+        int nread = ReadCompressedWholeData(mat,matvar,data,packed_type,nBytes,N);
+        if ( nread < 0 ) {
+            /* The stream is broken, so there is no padding to skip */
+            return;
+        } else if ( nread > 0 ) {
+            nBytes = nread;
+        } else {
+            switch ( matvar->class_type ) {
+                case MAT_C_DOUBLE:
+                    nBytes = ReadCompressedDoubleData(mat,matvar->internal->z,(double*)data,
+                                                      packed_type,N);
+                    break;
+                case MAT_C_SINGLE:
+                    nBytes = ReadCompressedSingleData(mat,matvar->internal->z,(float*)data,
+                                                      packed_type,N);
+                    break;
+                case MAT_C_INT64:
 #ifdef HAVE_MAT_INT64_T
-                nBytes = ReadCompressedInt64Data(mat,matvar->internal->z,(mat_int64_t*)data,
-                                                 packed_type,N);
+                    nBytes = ReadCompressedInt64Data(mat,matvar->internal->z,(mat_int64_t*)data,
+                                                     packed_type,N);
 #endif
-                break;
-            case MAT_C_UINT64:
+                    break;
+                case MAT_C_UINT64:
 #ifdef HAVE_MAT_UINT64_T
-                nBytes = ReadCompressedUInt64Data(mat,matvar->internal->z,(mat_uint64_t*)data,
-                                                  packed_type,N);
+                    nBytes = ReadCompressedUInt64Data(mat,matvar->internal->z,(mat_uint64_t*)data,
+                                                      packed_type,N);
 #endif
-                break;
-            case MAT_C_INT32:
-                nBytes = ReadCompressedInt32Data(mat,matvar->internal->z,(mat_int32_t*)data,
-                                                 packed_type,N);
-                break;
-            case MAT_C_UINT32:
-                nBytes = ReadCompressedUInt32Data(mat,matvar->internal->z,(mat_uint32_t*)data,
-                                                  packed_type,N);
-                break;
-            case MAT_C_INT16:
-                nBytes = ReadCompressedInt16Data(mat,matvar->internal->z,(mat_int16_t*)data,
-                                                 packed_type,N);
-                break;
-            case MAT_C_UINT16:
-                nBytes = ReadCompressedUInt16Data(mat,matvar->internal->z,(mat_uint16_t*)data,
-                                                  packed_type,N);
-                break;
-            case MAT_C_INT8:
-                nBytes = ReadCompressedInt8Data(mat,matvar->internal->z,(mat_int8_t*)data,
-                                                packed_type,N);
-                break;
-            case MAT_C_UINT8:
-                nBytes = ReadCompressedUInt8Data(mat,matvar->internal->z,(mat_uint8_t*)data,
-                                                 packed_type,N);
-                break;
-            default:
-                break;
+                    break;
+                case MAT_C_INT32:
+                    nBytes = ReadCompressedInt32Data(mat,matvar->internal->z,(mat_int32_t*)data,
+                                                     packed_type,N);
+                    break;
+                case MAT_C_UINT32:
+                    nBytes = ReadCompressedUInt32Data(mat,matvar->internal->z,(mat_uint32_t*)data,
+                                                      packed_type,N);
+                    break;
+                case MAT_C_INT16:
+                    nBytes = ReadCompressedInt16Data(mat,matvar->internal->z,(mat_int16_t*)data,
+                                                     packed_type,N);
+                    break;
+                case MAT_C_UINT16:
+                    nBytes = ReadCompressedUInt16Data(mat,matvar->internal->z,(mat_uint16_t*)data,
+                                                      packed_type,N);
+                    break;
+                case MAT_C_INT8:
+                    nBytes = ReadCompressedInt8Data(mat,matvar->internal->z,(mat_int8_t*)data,
+                                                    packed_type,N);
+                    break;
+                case MAT_C_UINT8:
+                    nBytes = ReadCompressedUInt8Data(mat,matvar->internal->z,(mat_uint8_t*)data,
+                                                     packed_type,N);
+                    break;
+                default:
+                    break;
+            }
         }
         /*
          * If the data was in the tag we started on a 4-byte
@@ -4839,6 +5835,7 @@ Read5(mat_t *mat, matvar_t *matvar)
         }
         default:
             Mat_Critical("Read5: %d is not a supported class", matvar->class_type);
+            break;
     }
     (void)fseek((FILE*)mat->fp,fpos,SEEK_SET);
 
@@ -6706,6 +7703,7 @@ ReadData5(mat_t *mat,matvar_t *matvar,void *data,
                 err = inflateCopy(&z,matvar->internal->z);
                 if ( err != Z_OK ) {
                     Mat_Critical("inflateCopy returned error %s",zError(err));
+                    return -1;
                 }
                 InflateSkip(mat,&z,real_bytes);
                 z.avail_in = 0;
@@ -6769,6 +7767,7 @@ ReadData5(mat_t *mat,matvar_t *matvar,void *data,
                 err = inflateCopy(&z,matvar->internal->z);
                 if ( err != Z_OK ) {
                     Mat_Critical("inflateCopy returned error %s",zError(err));
+                    return -1;
                 }
                 InflateSkip(mat,&z,real_bytes);
                 z.avail_in = 0;
@@ -6977,6 +7976,7 @@ Mat_VarReadDataLinear5(mat_t *mat,matvar_t *matvar,void *data,int start,
             err = inflateCopy(&z,matvar->internal->z);
             if ( err != Z_OK ) {
                 Mat_Critical("inflateCopy returned error %s",zError(err));
+                return -1;
             }
             InflateSkip(mat,&z,real_bytes);
             z.avail_in = 0;
@@ -7050,6 +8050,70 @@ Mat_VarReadDataLinear5(mat_t *mat,matvar_t *matvar,void *data,int start,
     return err;
 }
 
+/** @brief Reads a contiguous range of an uncompressed MAT variable
+ *
+ * Like Mat_VarReadDataLinear5 with a stride of 1, but the range is given
+ * with size_t, so that it can start beyond INT_MAX elements.  The data is
+ * read in blocks and converted to the class of the variable.  Only real,
+ * uncompressed numeric variables are supported.
+ * @ingroup mat_internal
+ * @param mat MAT file to read data from
+ * @param matvar MAT variable information
+ * @param data pointer to store data in (must be pre-allocated)
+ * @param start index of the first element
+ * @param edge number of elements to read
+ * @retval 0 on success
+ */
+int
+Mat_VarReadDataRange5(mat_t *mat,matvar_t *matvar,void *data,size_t start,
+                      size_t edge)
+{
+    const size_t block = 1 << 20;
+    mat_int32_t tag[2];
+    enum matio_types data_type;
+    size_t nmemb = 1, data_size, class_size, nbytes, i;
+    long pos;
+
+    if ( matvar->compression != MAT_COMPRESSION_NONE || matvar->isComplex )
+        return -1;
+
+    for ( i = 0; i < (size_t)matvar->rank; i++ )
+        nmemb *= matvar->dims[i];
+    if ( start > nmemb || edge > nmemb - start )
+        return 1;
+
+    (void)fseek((FILE*)mat->fp,matvar->internal->datapos,SEEK_SET);
+    if ( fread(tag,4,2,(FILE*)mat->fp) != 2 )
+        return 1;
+    if ( mat->byteswap ) {
+        Mat_int32Swap(tag);
+        Mat_int32Swap(tag+1);
+    }
+    data_type = (enum matio_types)(tag[0] & 0x000000ff);
+    if ( tag[0] & 0xffff0000 ) { /* Data is packed in the tag */
+        pos = matvar->internal->datapos + 4;
+        nbytes = tag[0] >> 16;
+    } else {
+        pos = matvar->internal->datapos + 8;
+        nbytes = (mat_uint32_t)tag[1];
+    }
+    data_size  = Mat_SizeOf(data_type);
+    class_size = Mat_SizeOfClass(matvar->class_type);
+    if ( 0 == data_size || 0 == class_size || nbytes / data_size < nmemb )
+        return 1;
+
+    if ( fseek((FILE*)mat->fp,pos + (long)(start*data_size),SEEK_SET) )
+        return 1;
+    for ( i = 0; i < edge; i += block ) {
+        int n = (int)(edge - i < block ? edge - i : block);
+        if ( ReadDataSlab1(mat,(char*)data + i*class_size,matvar->class_type,
+                           data_type,0,1,n) != (int)(n*data_size) )
+            return 1;
+    }
+
+    return 0;
+}
+
 /** @if mat_devman
  * @brief Writes a matlab variable to a version 5 matlab file
  *
@@ -7070,7 +8134,7 @@ Mat_VarWrite5(mat_t *mat,matvar_t *matvar,int compress)
     mat_int8_t pad1 = 0;
     int array_flags_type = MAT_T_UINT32, dims_array_type = MAT_T_INT32;
     int array_flags_size = 8, pad4 = 0, matrix_type = MAT_T_MATRIX;
-    int nBytes, i, nmemb = 1,nzmax = 0;
+    int nBytes, i, nmemb = 1,nzmax = 0, err = 0;
     long start = 0, end = 0;
 
     if ( NULL == mat )
@@ -7082,8 +8146,17 @@ Mat_VarWrite5(mat_t *mat,matvar_t *matvar,int compress)
     if ( NULL == matvar || NULL == matvar->name )
         return -1;
 
+    ClearBufSizeCache(matvar);
+    if ( AcquireDeferredData(mat,matvar) ) {
+        err = -1;
+        goto cleanup;
+    }
+
 #if !defined(HAVE_ZLIB)
     compress = MAT_COMPRESSION_NONE;
+#else
+    if ( compress == MAT_COMPRESSION_AUTO )
+        compress = SampleCompression(mat,matvar);
 #endif
 
     if ( compress == MAT_COMPRESSION_NONE ) {
@@ -7149,6 +8222,8 @@ Mat_VarWrite5(mat_t *mat,matvar_t *matvar,int compress)
         matvar->internal->datapos = ftell((FILE*)mat->fp);
         if ( matvar->internal->datapos == -1L ) {
             Mat_Critical("Couldn't determine file position");
+            err = -1;
+            goto cleanup;
         }
         switch ( matvar->class_type ) {
             case MAT_C_DOUBLE:
@@ -7179,7 +8254,7 @@ Mat_VarWrite5(mat_t *mat,matvar_t *matvar,int compress)
                         for ( i = nBytes % 8; i < 8; i++ )
                             fwrite(&pad1,1,1,(FILE*)mat->fp);
                 } else {
-                    nBytes=WriteData(mat,matvar->data,nmemb,matvar->data_type);
+                    nBytes=WriteVarData(mat,matvar,nmemb);
                     if ( nBytes % 8 )
                         for ( i = nBytes % 8; i < 8; i++ )
                             fwrite(&pad1,1,1,(FILE*)mat->fp);
@@ -7304,20 +8379,15 @@ Mat_VarWrite5(mat_t *mat,matvar_t *matvar,int compress)
     } else if ( compress == MAT_COMPRESSION_ZLIB ) {
         mat_uint32_t comp_buf[512];
         mat_uint32_t uncomp_buf[512] = {0,};
-        int buf_size = 512, err;
+        int buf_size = 512, zerr, finished = 0;
         size_t byteswritten = 0;
 
-        if (matvar->internal->z != NULL) {
-            inflateEnd(matvar->internal->z);
-            free(matvar->internal->z);
-        }
-        matvar->internal->z = (z_streamp)calloc(1,sizeof(*matvar->internal->z));
-        err = deflateInit(matvar->internal->z,Z_DEFAULT_COMPRESSION);
-        if ( err != Z_OK ) {
-            free(matvar->internal->z);
-            matvar->internal->z = NULL;
-            Mat_Critical("deflateInit returned %s",zError(err));
-            return -1;
+        Mat_InflateEnd(matvar);
+        matvar->internal->z = Mat_DeflateStream(mat);
+        if ( NULL == matvar->internal->z ) {
+            Mat_Critical("deflateInit failed");
+            err = -1;
+            goto cleanup;
         }
 
         matrix_type = MAT_T_COMPRESSED;
@@ -7418,6 +8488,8 @@ Mat_VarWrite5(mat_t *mat,matvar_t *matvar,int compress)
         matvar->internal->datapos = ftell((FILE*)mat->fp);
         if ( matvar->internal->datapos == -1L ) {
             Mat_Critical("Couldn't determine file position");
+            err = -1;
+            goto cleanup;
         }
         switch ( matvar->class_type ) {
             case MAT_C_DOUBLE:
@@ -7443,9 +8515,23 @@ Mat_VarWrite5(mat_t *mat,matvar_t *matvar,int compress)
                         complex_data->Re,nmemb,matvar->data_type);
                     byteswritten += WriteCompressedData(mat,matvar->internal->z,
                         complex_data->Im,nmemb,matvar->data_type);
+#if defined(MAT_DEFLATE_THREADS)
+                } else if ( mat->deflate_threads > 1 && NULL != matvar->data &&
+                            (size_t)nmemb*Mat_SizeOf(matvar->data_type) >
+                            MAT_DEFLATE_BLOCK ) {
+                    if ( WriteParallelCompressedData(mat,matvar->internal->z,
+                             matvar->data,nmemb,matvar->data_type,
+                             &byteswritten) ) {
+                        Mat_Critical("Deflating the data of variable %s failed",
+                                     matvar->name);
+                        err = -1;
+                        goto cleanup;
+                    }
+                    finished = 1;
+#endif
                 } else {
-                    byteswritten += WriteCompressedData(mat,matvar->internal->z,
-                        matvar->data,nmemb,matvar->data_type);
+                    byteswritten += WriteCompressedVarData(mat,
+                        matvar->internal->z,matvar,nmemb);
                 }
                 break;
             }
@@ -7568,15 +8654,18 @@ Mat_VarWrite5(mat_t *mat,matvar_t *matvar,int compress)
             case MAT_C_OPAQUE:
                 break;
         }
-        matvar->internal->z->next_in  = NULL;
-        matvar->internal->z->avail_in = 0;
-        do {
-            matvar->internal->z->next_out  = ZLIB_BYTE_PTR(comp_buf);
-            matvar->internal->z->avail_out = buf_size*sizeof(*comp_buf);
-            err = deflate(matvar->internal->z,Z_FINISH);
-            byteswritten += fwrite(comp_buf,1,
-                buf_size*sizeof(*comp_buf)-matvar->internal->z->avail_out,(FILE*)mat->fp);
-        } while ( err != Z_STREAM_END && matvar->internal->z->avail_out == 0 );
+        /* WriteParallelCompressedData finishes the stream itself */
+        if ( !finished ) {
+            matvar->internal->z->next_in  = NULL;
+            matvar->internal->z->avail_in = 0;
+            do {
+                matvar->internal->z->next_out  = ZLIB_BYTE_PTR(comp_buf);
+                matvar->internal->z->avail_out = buf_size*sizeof(*comp_buf);
+                zerr = deflate(matvar->internal->z,Z_FINISH);
+                byteswritten += fwrite(comp_buf,1,
+                    buf_size*sizeof(*comp_buf)-matvar->internal->z->avail_out,(FILE*)mat->fp);
+            } while ( zerr != Z_STREAM_END && matvar->internal->z->avail_out == 0 );
+        }
         /* End the compression and set to NULL so Mat_VarFree doesn't try
          * to free matvar->internal->z with inflateEnd
          */
@@ -7585,9 +8674,6 @@ Mat_VarWrite5(mat_t *mat,matvar_t *matvar,int compress)
             for ( i = 0; i < 8-(byteswritten % 8); i++ )
                 fwrite(&pad1,1,1,(FILE*)mat->fp);
 #endif
-        (void)deflateEnd(matvar->internal->z);
-        free(matvar->internal->z);
-        matvar->internal->z = NULL;
 #endif
     }
     end = ftell((FILE*)mat->fp);
@@ -7598,9 +8684,24 @@ Mat_VarWrite5(mat_t *mat,matvar_t *matvar,int compress)
         (void)fseek((FILE*)mat->fp,end,SEEK_SET);
     } else {
         Mat_Critical("Couldn't determine file position");
+        err = -1;
+    }
+    if ( !err && ferror((FILE*)mat->fp) ) {
+        Mat_Critical("Couldn't write variable %s",matvar->name);
+        err = -1;
     }
 
-    return 0;
+cleanup:
+#if defined(HAVE_ZLIB)
+    /* The stream belongs to the MAT file, see Mat_DeflateStream */
+    if ( compress == MAT_COMPRESSION_ZLIB )
+        matvar->internal->z = NULL;
+#endif
+    /* Every exit after AcquireDeferredData releases the data, also
+     * when writing failed */
+    ReleaseDeferredData(mat,matvar);
+
+    return err;
 }
 
 /** @if mat_devman
@@ -7624,6 +8725,7 @@ WriteInfo5(mat_t *mat, matvar_t *matvar)
     /* FIXME: SEEK_END is not Guaranteed by the C standard */
     (void)fseek((FILE*)mat->fp,0,SEEK_END);         /* Always write at end of file */
 
+    ClearBufSizeCache(matvar);
     if ( matvar->compression == MAT_COMPRESSION_NONE ) {
         int i;
         fwrite(&matrix_type,4,1,(FILE*)mat->fp);
@@ -7683,6 +8785,7 @@ WriteInfo5(mat_t *mat, matvar_t *matvar)
         matvar->internal->datapos = ftell((FILE*)mat->fp);
         if ( matvar->internal->datapos == -1L ) {
             Mat_Critical("Couldn't determine file position");
+            return;
         }
         switch ( matvar->class_type ) {
             case MAT_C_DOUBLE:
@@ -7890,6 +8993,10 @@ WriteInfo5(mat_t *mat, matvar_t *matvar)
         matvar->internal->datapos = ftell((FILE*)mat->fp);
         if ( matvar->internal->datapos == -1L ) {
             Mat_Critical("Couldn't determine file position");
+            (void)deflateEnd(matvar->internal->z);
+            free(matvar->internal->z);
+            matvar->internal->z = NULL;
+            return;
         }
         deflateCopy(&z_save,matvar->internal->z);
         switch ( matvar->class_type ) {
@@ -7994,8 +9101,8 @@ Mat_VarReadNextInfo5( mat_t *mat )
 
             matvar->internal->fp = mat;
             matvar->internal->fpos = fpos;
-            matvar->internal->z = (z_streamp)calloc(1,sizeof(z_stream));
-            err = inflateInit(matvar->internal->z);
+            matvar->internal->zend = fpos+8+nBytes;
+            err = Mat_InflateInit(mat,matvar);
             if ( err != Z_OK ) {
                 Mat_VarFree(matvar);
                 matvar = NULL;
@@ -8085,10 +9192,15 @@ Mat_VarReadNextInfo5( mat_t *mat )
                     memcpy(matvar->name,uncomp_buf+1,len);
                     matvar->name[len] = '\0';
                 }
-                if ( matvar->class_type == MAT_C_STRUCT )
-                    (void)ReadNextStructField(mat,matvar);
-                else if ( matvar->class_type == MAT_C_CELL )
-                    (void)ReadNextCell(mat,matvar);
+                if ( mat->read_fields ) {
+                    if ( mat->use_arena && (matvar->class_type == MAT_C_STRUCT ||
+                         matvar->class_type == MAT_C_CELL) )
+                        matvar->internal->arena = Mat_ArenaCreate();
+                    if ( matvar->class_type == MAT_C_STRUCT )
+                        (void)ReadNextStructField(mat,matvar);
+                    else if ( matvar->class_type == MAT_C_CELL )
+                        (void)ReadNextCell(mat,matvar);
+                }
                 (void)fseek((FILE*)mat->fp,-(int)matvar->internal->z->avail_in,SEEK_CUR);
                 matvar->internal->datapos = ftell((FILE*)mat->fp);
                 if ( matvar->internal->datapos == -1L ) {
@@ -8187,12 +9299,17 @@ Mat_VarReadNextInfo5( mat_t *mat )
                 memcpy(matvar->name,buf+1,len);
                 matvar->name[len] = '\0';
             }
-            if ( matvar->class_type == MAT_C_STRUCT )
-                (void)ReadNextStructField(mat,matvar);
-            else if ( matvar->class_type == MAT_C_CELL )
-                (void)ReadNextCell(mat,matvar);
-            else if ( matvar->class_type == MAT_C_FUNCTION )
-                (void)ReadNextFunctionHandle(mat,matvar);
+            if ( mat->read_fields ) {
+                if ( mat->use_arena && (matvar->class_type == MAT_C_STRUCT ||
+                     matvar->class_type == MAT_C_CELL) )
+                    matvar->internal->arena = Mat_ArenaCreate();
+                if ( matvar->class_type == MAT_C_STRUCT )
+                    (void)ReadNextStructField(mat,matvar);
+                else if ( matvar->class_type == MAT_C_CELL )
+                    (void)ReadNextCell(mat,matvar);
+                else if ( matvar->class_type == MAT_C_FUNCTION )
+                    (void)ReadNextFunctionHandle(mat,matvar);
+            }
             matvar->internal->datapos = ftell((FILE*)mat->fp);
             if ( matvar->internal->datapos == -1L ) {
                 Mat_Critical("Couldn't determine file position");
@@ -68,6 +68,8 @@
 
 /*   mat5.c    */
 EXTERN mat_t *Mat_Create5(const char *matname,const char *hdr_str);
+EXTERN mat_t *Mat_CreateStream5(FILE *fp,const char *matname,
+                  const char *hdr_str);
 
 matvar_t *Mat_VarReadNextInfo5( mat_t *mat );
 void      Read5(mat_t *mat, matvar_t *matvar);
@@ -75,6 +77,8 @@ int       ReadData5(mat_t *mat,matvar_t *matvar,void *data,
               int *start,int *stride,int *edge);
 int       Mat_VarReadDataLinear5(mat_t *mat,matvar_t *matvar,void *data,
               int start,int stride,int edge);
+int       Mat_VarReadDataRange5(mat_t *mat,matvar_t *matvar,void *data,
+              size_t start,size_t edge);
 int       Mat_VarWrite5(mat_t *mat,matvar_t *matvar,int compress);
 int       WriteCharDataSlab2(mat_t *mat,void *data,enum matio_types data_type,
               size_t *dims,int *start,int *stride,int *edge);
@@ -35,14 +35,14 @@
  *
  * - The io routines have been adopted to use R printing and error routines.
  *   See the R manual Writing R Extensions
+ * - Mat_Critical and Mat_Warning call Rf_error and Rf_warning, unless
+ *   the messages of the calling thread are collected with Mat_LogCapture
  */
 
 #ifndef MATIO_H
 #define MATIO_H
 
 #include <Rdefines.h>
-#define Mat_Critical Rf_error
-#define Mat_Warning Rf_warning
 #define strdup_printf(format, str) strdup((str))
 #define mat_snprintf snprintf
 
@@ -157,7 +157,9 @@ enum matio_flags {
  */
 enum matio_compression {
     MAT_COMPRESSION_NONE = 0,   /**< @brief No compression */
-    MAT_COMPRESSION_ZLIB = 1    /**< @brief zlib compression */
+    MAT_COMPRESSION_ZLIB = 1,   /**< @brief zlib compression */
+    MAT_COMPRESSION_AUTO = 2    /**< @brief zlib compression of variables
+                                 *   with data that samples as compressible */
 };
 
 /** @brief matio lookup type
@@ -232,6 +234,47 @@ typedef struct mat_sparse_t {
     void *data;              /**< Array of data elements */
 } mat_sparse_t;
 
+/** @brief Callback supplying the data of a deferred MAT variable
+ *
+ * Called with @c release equal to 0 just before the data of a variable
+ * with a data source (see Mat_VarSetDataSource) is written, and with
+ * @c release equal to 1 once the data has been written.  On acquire the
+ * callback sets matvar->data, on release it frees it and resets
+ * matvar->data to NULL.
+ * @ingroup MAT
+ */
+typedef int (*mat_write_data_fn)(matvar_t *matvar,void *source,int release);
+
+/** @brief Callback copying a region of the data of a streamed MAT variable
+ *
+ * Called to copy the @c n elements starting at element @c start of a
+ * deferred numeric variable into @c buf, in the data type of the
+ * variable, when the write data function left matvar->data NULL (see
+ * Mat_SetDataRegionFunc).  Returns the number of elements copied.
+ * @ingroup MAT
+ */
+typedef size_t (*mat_data_region_fn)(matvar_t *matvar,void *source,
+                   size_t start,size_t n,void *buf);
+
+/** @brief Size of a message of Mat_Critical and Mat_Warning
+ *
+ * The size of the error buffer of R, so long messages, e.g. with a
+ * file name, reach Rf_error untruncated.
+ * @ingroup MAT
+ */
+#define MAT_LOG_SIZE 8192
+
+/** @brief Messages collected for a thread reading a MAT file
+ *
+ * See Mat_LogCapture.  Only the first message of each kind is kept.
+ * @ingroup MAT
+ */
+typedef struct mat_log_t {
+    int  critical;          /**< Non-zero if Mat_Critical has been called */
+    char message[MAT_LOG_SIZE]; /**< The first message of Mat_Critical */
+    char warning[MAT_LOG_SIZE]; /**< The first message of Mat_Warning */
+} mat_log_t;
+
 /** @cond 0 */
 #define MATIO_LOG_LEVEL_ERROR    1
 #define MATIO_LOG_LEVEL_CRITICAL 1 << 1
@@ -249,7 +292,7 @@ EXTERN void Mat_GetLibraryVersion(int *major,int *minor,int *release);
 /* EXTERN char  *strdup_printf(const char *format, ...); */
 /* EXTERN int    Mat_SetVerbose( int verb, int s ); */
 /* EXTERN int    Mat_SetDebug( int d ); */
-/* EXTERN void   Mat_Critical( const char *format, ... ); */
+EXTERN void   Mat_Critical( const char *format, ... );
 /* EXTERN MATIO_NORETURN void Mat_Error( const char *format, ... ) MATIO_NORETURNATTR; */
 /* EXTERN void   Mat_Help( const char *helpstr[] ); */
 /* EXTERN int    Mat_LogInit( const char *progname ); */
@@ -259,7 +302,8 @@ EXTERN void Mat_GetLibraryVersion(int *major,int *minor,int *release);
 /* EXTERN int    Mat_Message( const char *format, ... ); */
 /* EXTERN int    Mat_DebugMessage( int level, const char *format, ... ); */
 /* EXTERN int    Mat_VerbMessage( int level, const char *format, ... ); */
-/* EXTERN void   Mat_Warning( const char *format, ... ); */
+EXTERN void   Mat_Warning( const char *format, ... );
+EXTERN void   Mat_LogCapture(mat_log_t *log);
 EXTERN size_t Mat_SizeOf(enum matio_types data_type);
 EXTERN size_t Mat_SizeOfClass(int class_type);
 
@@ -270,10 +314,20 @@ EXTERN mat_t      *Mat_CreateVer(const char *matname,const char *hdr_str,
                        enum mat_ft mat_file_ver);
 EXTERN int         Mat_Close(mat_t *mat);
 EXTERN mat_t      *Mat_Open(const char *matname,int mode);
+EXTERN mat_t      *Mat_OpenMem(const void *buf,size_t len);
+EXTERN mat_t      *Mat_CreateMem(const char *hdr_str,
+                      enum mat_ft mat_file_ver);
+EXTERN size_t      Mat_MemSize(mat_t *mat);
+EXTERN size_t      Mat_MemCopy(mat_t *mat,void *buf,size_t len);
 EXTERN const char *Mat_GetFilename(mat_t *mat);
 EXTERN enum mat_ft Mat_GetVersion(mat_t *mat);
 EXTERN char      **Mat_GetDir(mat_t *mat, size_t *n);
 EXTERN int         Mat_Rewind(mat_t *mat);
+EXTERN int         Mat_SetWriteDataFunc(mat_t *mat,mat_write_data_fn fn);
+EXTERN int         Mat_SetDataRegionFunc(mat_t *mat,mat_data_region_fn fn);
+EXTERN int         Mat_SetReadArena(mat_t *mat,int enable);
+EXTERN int         Mat_SetReadFields(mat_t *mat,int enable);
+EXTERN int         Mat_SetDeflateThreads(mat_t *mat,int threads);
 
 /* MAT variable functions */
 EXTERN matvar_t  *Mat_VarCalloc(void);
@@ -296,9 +350,15 @@ EXTERN matvar_t **Mat_VarGetCells(matvar_t *matvar,int *start,int *stride,
 EXTERN matvar_t **Mat_VarGetCellsLinear(matvar_t *matvar,int start,int stride,
                       int edge);
 EXTERN size_t     Mat_VarGetSize(matvar_t *matvar);
+EXTERN long       Mat_VarGetFilePos(const matvar_t *matvar);
+EXTERN void       Mat_VarReleaseStream(matvar_t *matvar);
 EXTERN unsigned   Mat_VarGetNumberOfFields(matvar_t *matvar);
 EXTERN int        Mat_VarAddStructField(matvar_t *matvar,const char *fieldname);
+EXTERN int        Mat_VarAddStructFields(matvar_t *matvar,
+                      const char * const *fieldnames,unsigned n);
 EXTERN char * const *Mat_VarGetStructFieldnames(const matvar_t *matvar);
+EXTERN int        Mat_VarGetStructFieldIndex(matvar_t *matvar,
+                      const char *field_name);
 EXTERN matvar_t  *Mat_VarGetStructFieldByIndex(matvar_t *matvar,
                       size_t field_index,size_t index);
 EXTERN matvar_t  *Mat_VarGetStructFieldByName(matvar_t *matvar,
@@ -311,19 +371,30 @@ EXTERN matvar_t  *Mat_VarGetStructsLinear(matvar_t *matvar,int start,int stride,
                       int edge,int copy_fields);
 EXTERN void       Mat_VarPrint( matvar_t *matvar, int printdata );
 EXTERN matvar_t  *Mat_VarRead(mat_t *mat, const char *name );
+EXTERN matvar_t **Mat_VarReadMany(mat_t *mat, const char * const *names, size_t n );
+EXTERN matvar_t **Mat_VarReadManyInfo(mat_t *mat, const char * const *names,
+                      size_t n );
 EXTERN int        Mat_VarReadData(mat_t *mat,matvar_t *matvar,void *data,
                       int *start,int *stride,int *edge);
 EXTERN int        Mat_VarReadDataAll(mat_t *mat,matvar_t *matvar);
 EXTERN int        Mat_VarReadDataLinear(mat_t *mat,matvar_t *matvar,void *data,
                       int start,int stride,int edge);
+EXTERN int        Mat_VarReadDataRange(mat_t *mat,matvar_t *matvar,void *data,
+                      size_t start,size_t edge);
 EXTERN matvar_t  *Mat_VarReadInfo( mat_t *mat, const char *name );
 EXTERN matvar_t  *Mat_VarReadNext( mat_t *mat );
+EXTERN matvar_t  *Mat_VarReadAt( mat_t *mat, long fpos );
 EXTERN matvar_t  *Mat_VarReadNextInfo( mat_t *mat );
 EXTERN matvar_t  *Mat_VarSetCell(matvar_t *matvar,int index,matvar_t *cell);
+EXTERN int        Mat_VarSetDataSource(matvar_t *matvar,void *source);
 EXTERN matvar_t  *Mat_VarSetStructFieldByIndex(matvar_t *matvar,
                       size_t field_index,size_t index,matvar_t *field);
 EXTERN matvar_t  *Mat_VarSetStructFieldByName(matvar_t *matvar,
                       const char *field_name,size_t index,matvar_t *field);
+EXTERN int        Mat_VarSetStructFieldColumn(matvar_t *matvar,
+                      size_t field_index,enum matio_classes class_type,
+                      enum matio_types data_type,void *data,const size_t *len,
+                      int opt);
 EXTERN int        Mat_VarWrite(mat_t *mat,matvar_t *matvar,
                       enum matio_compression compress );
 EXTERN int        Mat_VarWriteInfo(mat_t *mat,matvar_t *matvar);
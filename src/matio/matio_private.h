@@ -53,6 +53,75 @@
 #   define ZLIB_BYTE_PTR(a) ((Bytef *)(a))
 #endif
 
+/* Deflate large variables on several threads, see Mat_SetDeflateThreads */
+#if defined(HAVE_ZLIB) && HAVE_ZLIB && !defined(_WIN32)
+#   define MAT_DEFLATE_THREADS 1
+#endif
+
+/** @if mat_devman
+ * @brief Block of memory in an arena
+ * @ingroup mat_internal
+ * @endif
+ */
+struct mat_arena_block {
+    struct mat_arena_block *next; /**< Previous block of the arena */
+    size_t size;                  /**< Number of usable bytes in the block */
+    size_t used;                  /**< Number of bytes handed out */
+};
+
+/** @if mat_devman
+ * @brief Arena allocator for the fields and cells of a variable
+ *
+ * The fields and cells read with a variable are allocated from a few large
+ * blocks owned by the top-level variable, and released all at once when it
+ * is freed.
+ * @ingroup mat_internal
+ * @endif
+ */
+struct mat_arena {
+    struct mat_arena_block *blocks; /**< Blocks of the arena, newest first */
+};
+
+/** Number of fields from which the fieldnames of a structure are hashed */
+#define MAT_FIELD_INDEX_MIN 16
+
+/** @if mat_devman
+ * @brief Hash index of the fieldnames of a structure
+ *
+ * Open addressing table of the fields of a structure by their name, so that
+ * fields are found by name without comparing all fieldnames.
+ * @ingroup mat_internal
+ * @endif
+ */
+struct mat_fieldindex {
+    unsigned  nfields; /**< Number of fields in the index */
+    unsigned  mask;    /**< Number of slots minus one, a power of two minus one */
+    unsigned *slots;   /**< 1-relative index of the field in each slot, 0 if empty */
+};
+
+#if defined(HAVE_ZLIB)
+/** Maximum number of idle streams kept by a pool of inflate streams */
+#define MAT_ZPOOL_SIZE 8
+
+/** @if mat_devman
+ * @brief Pool of initialized zlib inflate streams
+ *
+ * Compressed variables take an inflate stream from the pool of their MAT
+ * file and give it back when they are freed, so that the stream is reset
+ * instead of reallocated for each variable.  The pool is shared by the MAT
+ * file and the variables holding one of its streams and is freed by the
+ * last of them.
+ * @ingroup mat_internal
+ * @endif
+ */
+struct mat_zpool {
+    int       refs;     /**< Number of owners: the MAT file and its variables */
+    int       closed;   /**< 1 once the MAT file has been closed */
+    int       nstreams; /**< Number of idle streams */
+    z_streamp streams[MAT_ZPOOL_SIZE]; /**< Idle streams, ready for use */
+};
+#endif
+
 /** @if mat_devman
  * @brief Matlab MAT File information
  *
@@ -73,6 +142,16 @@ struct _mat_t {
     size_t num_datasets;    /**< Number of datasets in the file */
     hid_t  refs_id;         /**< Id of the /#refs# group in HDF5 */
     char **dir;             /**< Names of the datasets in the file */
+    mat_write_data_fn write_data; /**< Supplies the data of deferred variables */
+    mat_data_region_fn data_region; /**< Copies the data of streamed variables */
+    int    use_arena;       /**< Allocate fields and cells from an arena on read */
+    int    read_fields;     /**< Read the fields and cells with the variable information */
+    int    deflate_threads; /**< Number of threads deflating a large variable */
+#if defined(HAVE_ZLIB)
+    struct mat_zpool *zpool; /**< Pool of inflate streams for reading */
+    z_streamp zdeflate;     /**< Deflate stream reused for writing */
+    z_streamp zsample;      /**< Deflate stream for sampling compressibility */
+#endif
 };
 
 /** @if mat_devman
@@ -89,9 +168,16 @@ struct matvar_internal {
     mat_t     *fp;          /**< Pointer to the MAT file structure (mat_t) */
     unsigned   num_fields;  /**< Number of fields */
     char     **fieldnames;  /**< Pointer to fieldnames */
+    struct mat_fieldindex *fieldindex; /**< Hash index of the fieldnames, or NULL */
+    void      *source;      /**< Source of deferred data, see Mat_VarSetDataSource */
+    size_t     bufsize;     /**< Cached size of the element when nested, 0 if unknown */
+    struct mat_arena *arena; /**< Arena of the fields and cells of the variable */
+    int        in_arena;    /**< 1 if allocated from the arena of its parent */
 #if defined(HAVE_ZLIB)
     z_streamp  z;           /**< zlib compression state */
+    struct mat_zpool *zpool; /**< Pool the stream z is returned to, or NULL */
     void      *data;        /**< Inflated data array */
+    long       zend;        /**< Offset from the beginning of the MAT file to the end of the compressed variable, 0 if unknown */
 #endif
 };
 
@@ -193,13 +279,31 @@ EXTERN size_t InflateVarName(mat_t *mat,matvar_t *matvar,void *buf,int N);
 EXTERN size_t InflateDataTag(mat_t *mat, matvar_t *matvar, void *buf);
 EXTERN size_t InflateDataType(mat_t *mat, z_stream *matvar, void *buf);
 EXTERN size_t InflateData(mat_t *mat, z_streamp z, void *buf, int nBytes);
+EXTERN int    InflateDataWhole(mat_t *mat, matvar_t *matvar, void *buf, size_t nBytes);
 EXTERN size_t InflateFieldNameLength(mat_t *mat,matvar_t *matvar,void *buf);
 EXTERN size_t InflateFieldNamesTag(mat_t *mat,matvar_t *matvar,void *buf);
 EXTERN size_t InflateFieldNames(mat_t *mat,matvar_t *matvar,void *buf,int nfields,
                int fieldname_length,int padding);
 #endif
 
+/* matvar_struct.c */
+EXTERN int  Mat_FieldIndexUpdate(matvar_t *matvar);
+EXTERN int  Mat_FieldIndexFind(matvar_t *matvar,const char *fieldname);
+EXTERN void Mat_FieldIndexFree(matvar_t *matvar);
+
 /* mat.c */
 EXTERN mat_complex_split_t *ComplexMalloc(size_t nbytes);
+EXTERN struct mat_arena *Mat_ArenaCreate(void);
+EXTERN void     *Mat_ArenaAlloc(struct mat_arena *arena,size_t nbytes);
+EXTERN void      Mat_ArenaFree(struct mat_arena *arena);
+EXTERN matvar_t *Mat_VarCallocArena(struct mat_arena *arena);
+EXTERN int       AcquireDeferredData(mat_t *mat,matvar_t *matvar);
+EXTERN void      ReleaseDeferredData(mat_t *mat,matvar_t *matvar);
+#if defined(HAVE_ZLIB)
+EXTERN int       Mat_InflateInit(mat_t *mat,matvar_t *matvar);
+EXTERN void      Mat_InflateEnd(matvar_t *matvar);
+EXTERN z_streamp Mat_DeflateStream(mat_t *mat);
+EXTERN z_streamp Mat_SampleStream(mat_t *mat);
+#endif
 
 #endif
@@ -180,6 +180,7 @@ Mat_VarSetCell(matvar_t *matvar,int index,matvar_t *cell)
     if ( index < nmemb ) {
         old_cell = cells[index];
         cells[index] = cell;
+        matvar->internal->bufsize = 0;
     }
 
     return old_cell;
@@ -112,36 +112,76 @@ Mat_VarCreateStruct(const char *name,int rank,size_t *dims,const char **fields,
 int
 Mat_VarAddStructField(matvar_t *matvar,const char *fieldname)
 {
-    int       i, f, nfields, nmemb, cnt = 0;
+    return Mat_VarAddStructFields(matvar,&fieldname,1);
+}
+
+/** @brief Adds several fields to a structure
+ *
+ * Adds the given fields to the structure with one reallocation of the fields
+ * of the structure, instead of one for each field as with
+ * Mat_VarAddStructField.  The new fields are NULL in each structure element.
+ * @ingroup MAT
+ * @param matvar Pointer to the Structure MAT variable
+ * @param fieldnames Array of @c n names of the fields to be added
+ * @param n Number of fields to be added
+ * @retval 0 on success
+ */
+int
+Mat_VarAddStructFields(matvar_t *matvar,const char * const *fieldnames,
+    unsigned n)
+{
+    int       i, nmemb, cnt = 0;
+    unsigned  f, nfields, old_nfields;
     matvar_t **new_data, **old_data;
+    char    **names;
 
-    if ( matvar == NULL || fieldname == NULL )
+    if ( matvar == NULL || fieldnames == NULL )
         return -1;
+    for ( f = 0; f < n; f++ ) {
+        if ( fieldnames[f] == NULL )
+            return -1;
+    }
+    if ( n == 0 )
+        return 0;
     nmemb = 1;
     for ( i = 0; i < matvar->rank; i++ )
         nmemb *= matvar->dims[i];
 
-    nfields = matvar->internal->num_fields+1;
-    matvar->internal->num_fields = nfields;
-    matvar->internal->fieldnames =
-    (char**)realloc(matvar->internal->fieldnames,
-            nfields*sizeof(*matvar->internal->fieldnames));
-    matvar->internal->fieldnames[nfields-1] = strdup(fieldname);
-
-    new_data = (matvar_t**)malloc(nfields*nmemb*sizeof(*new_data));
-    if ( new_data == NULL )
+    old_nfields = matvar->internal->num_fields;
+    nfields = old_nfields+n;
+    names = (char**)realloc(matvar->internal->fieldnames,
+                            nfields*sizeof(*matvar->internal->fieldnames));
+    if ( names == NULL )
         return -1;
+    matvar->internal->fieldnames = names;
 
     old_data = (matvar_t**)matvar->data;
-    for ( i = 0; i < nmemb; i++ ) {
-        for ( f = 0; f < nfields-1; f++ )
-            new_data[cnt++] = old_data[i*(nfields-1)+f];
-        new_data[cnt++] = NULL;
+    if ( nmemb == 1 ) {
+        /* The new fields follow the old fields of the only element */
+        new_data = (matvar_t**)realloc(old_data,nfields*sizeof(*new_data));
+        if ( new_data == NULL )
+            return -1;
+        for ( f = old_nfields; f < nfields; f++ )
+            new_data[f] = NULL;
+    } else {
+        new_data = (matvar_t**)malloc(nfields*nmemb*sizeof(*new_data));
+        if ( new_data == NULL )
+            return -1;
+        for ( i = 0; i < nmemb; i++ ) {
+            for ( f = 0; f < old_nfields; f++ )
+                new_data[cnt++] = old_data[i*old_nfields+f];
+            for ( f = old_nfields; f < nfields; f++ )
+                new_data[cnt++] = NULL;
+        }
+        free(old_data);
     }
 
-    free(matvar->data);
+    for ( f = 0; f < n; f++ )
+        matvar->internal->fieldnames[old_nfields+f] = strdup(fieldnames[f]);
+    matvar->internal->num_fields = nfields;
     matvar->data = new_data;
     matvar->nbytes = nfields*nmemb*sizeof(*new_data);
+    matvar->internal->bufsize = 0;
 
     return 0;
 }
@@ -224,6 +264,23 @@ Mat_VarGetStructFieldByIndex(matvar_t *matvar,size_t field_index,size_t index)
     return field;
 }
 
+/** @brief Returns the index of a field of a structure by the field's name
+ *
+ * @ingroup MAT
+ * @param matvar Pointer to the Structure MAT variable
+ * @param field_name Name of the structure field
+ * @return 0-relative index of the first field named @c field_name, or -1 if
+ *         the structure has no such field
+ */
+int
+Mat_VarGetStructFieldIndex(matvar_t *matvar,const char *field_name)
+{
+    if ( matvar == NULL || matvar->class_type != MAT_C_STRUCT )
+        return -1;
+
+    return Mat_FieldIndexFind(matvar,field_name);
+}
+
 /** @brief Finds a field of a structure by the field's name
  *
  * Returns a pointer to the structure field at the given 0-relative index.
@@ -250,13 +307,7 @@ Mat_VarGetStructFieldByName(matvar_t *matvar,const char *field_name,
         nmemb *= matvar->dims[i];
 
     nfields = matvar->internal->num_fields;
-    field_index = -1;
-    for ( i = 0; i < nfields; i++ ) {
-        if ( !strcmp(matvar->internal->fieldnames[i],field_name) ) {
-            field_index = i;
-            break;
-        }
-    }
+    field_index = Mat_FieldIndexFind(matvar,field_name);
 
     if ( index >= nmemb ) {
         Mat_Critical("Mat_VarGetStructField: structure index out of bounds");
@@ -498,10 +549,18 @@ Mat_VarSetStructFieldByIndex(matvar_t *matvar,size_t field_index,size_t index,
         matvar_t **fields = (matvar_t**)matvar->data;
         old_field = fields[index*nfields+field_index];
         fields[index*nfields+field_index] = field;
-        if ( NULL != field->name ) {
-            free(field->name);
+        if ( field->internal->in_arena ) {
+            const char *fieldname = matvar->internal->fieldnames[field_index];
+            field->name = (char*)Mat_ArenaAlloc(field->internal->arena,
+                                                strlen(fieldname)+1);
+            if ( NULL != field->name )
+                strcpy(field->name,fieldname);
+        } else {
+            if ( NULL != field->name )
+                free(field->name);
+            field->name = strdup(matvar->internal->fieldnames[field_index]);
         }
-        field->name = strdup(matvar->internal->fieldnames[field_index]);
+        matvar->internal->bufsize = 0;
     }
 
     return old_field;
@@ -535,23 +594,262 @@ Mat_VarSetStructFieldByName(matvar_t *matvar,const char *field_name,
         nmemb *= matvar->dims[i];
 
     nfields = matvar->internal->num_fields;
-    field_index = -1;
-    for ( i = 0; i < nfields; i++ ) {
-        if ( !strcmp(matvar->internal->fieldnames[i],field_name) ) {
-            field_index = i;
-            break;
-        }
-    }
+    field_index = Mat_FieldIndexFind(matvar,field_name);
 
     if ( index < nmemb && field_index >= 0 ) {
         matvar_t **fields = (matvar_t**)matvar->data;
         old_field = fields[index*nfields+field_index];
         fields[index*nfields+field_index] = field;
-        if ( NULL != field->name ) {
-            free(field->name);
+        if ( field->internal->in_arena ) {
+            const char *fieldname = matvar->internal->fieldnames[field_index];
+            field->name = (char*)Mat_ArenaAlloc(field->internal->arena,
+                                                strlen(fieldname)+1);
+            if ( NULL != field->name )
+                strcpy(field->name,fieldname);
+        } else {
+            if ( NULL != field->name )
+                free(field->name);
+            field->name = strdup(matvar->internal->fieldnames[field_index]);
         }
-        field->name = strdup(matvar->internal->fieldnames[field_index]);
+        matvar->internal->bufsize = 0;
     }
 
     return old_field;
 }
+
+/** @brief Sets a field of every element of a structure array
+ *
+ * Creates the field @c field_index of each element of the structure array as
+ * a 1 x n array of class @c class_type stored as @c data_type, which points
+ * to its data without copying it.  If @c len is NULL, @c data is an array of
+ * one element of @c data_type per structure element, and n is 1.  Otherwise
+ * @c data is an array of pointers to the data of each field, and n is the
+ * corresponding element of @c len.  The fields are allocated together from an
+ * arena of the structure, instead of one by one as with
+ * Mat_VarSetStructFieldByIndex, and are freed with the structure.  The data
+ * must remain valid until then.
+ * @ingroup MAT
+ * @param matvar Pointer to the structure MAT variable
+ * @param field_index 0-relative index of the field
+ * @param class_type class of the fields
+ * @param data_type type of the data of the fields
+ * @param data Data of the fields
+ * @param len Array of the number of elements of each field, or NULL
+ * @param opt Bit-wise OR of MAT_F_LOGICAL for logical fields
+ * @retval 0 on success
+ */
+int
+Mat_VarSetStructFieldColumn(matvar_t *matvar,size_t field_index,
+    enum matio_classes class_type,enum matio_types data_type,void *data,
+    const size_t *len,int opt)
+{
+    size_t i, nmemb = 1, nfields, data_size;
+    matvar_t **fields;
+    char *fieldname;
+    struct mat_arena *arena;
+
+    if ( matvar == NULL || matvar->class_type != MAT_C_STRUCT ||
+         matvar->data == NULL || data == NULL )
+        return -1;
+
+    nfields = matvar->internal->num_fields;
+    if ( field_index >= nfields )
+        return -1;
+    for ( i = 0; i < (size_t)matvar->rank; i++ )
+        nmemb *= matvar->dims[i];
+    data_size = Mat_SizeOf(data_type);
+    if ( data_size == 0 )
+        return -1;
+
+    if ( NULL == matvar->internal->arena ) {
+        matvar->internal->arena = Mat_ArenaCreate();
+        if ( NULL == matvar->internal->arena )
+            return -1;
+    }
+    arena = matvar->internal->arena;
+
+    /* The fields of the column share one copy of the fieldname */
+    fieldname = (char*)Mat_ArenaAlloc(arena,
+        strlen(matvar->internal->fieldnames[field_index])+1);
+    if ( NULL == fieldname )
+        return -1;
+    strcpy(fieldname,matvar->internal->fieldnames[field_index]);
+
+    fields = (matvar_t**)matvar->data;
+    for ( i = 0; i < nmemb; i++ ) {
+        matvar_t *field = Mat_VarCallocArena(arena);
+        size_t *dims = (size_t*)Mat_ArenaAlloc(arena,2*sizeof(*dims));
+
+        if ( NULL == field || NULL == dims )
+            return -1;
+        dims[0] = 1;
+        dims[1] = (NULL == len) ? 1 : len[i];
+        field->name         = fieldname;
+        field->rank         = 2;
+        field->dims         = dims;
+        field->class_type   = class_type;
+        field->data_type    = data_type;
+        field->data_size    = (int)data_size;
+        field->nbytes       = dims[1]*data_size;
+        field->isLogical    = (opt & MAT_F_LOGICAL) ? 1 : 0;
+        field->compression  = MAT_COMPRESSION_NONE;
+        field->mem_conserve = 1;
+        if ( NULL == len )
+            field->data = (char*)data+i*data_size;
+        else
+            field->data = ((void**)data)[i];
+
+        Mat_VarFree(fields[i*nfields+field_index]);
+        fields[i*nfields+field_index] = field;
+    }
+    matvar->internal->bufsize = 0;
+
+    return 0;
+}
+
+/** @cond mat_devman */
+
+/** @brief Hashes a fieldname
+ *
+ * @ingroup mat_internal
+ * @param fieldname Name of the field
+ * @return FNV-1a hash of the fieldname
+ */
+static unsigned
+FieldIndexHash(const char *fieldname)
+{
+    unsigned hash = 2166136261u;
+
+    while ( *fieldname ) {
+        hash ^= (unsigned char)*fieldname++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/** @brief Updates the hash index of the fieldnames of a structure
+ *
+ * Adds the fields added since the index was last updated, and creates or
+ * enlarges the index when needed.  Structures with fewer than
+ * MAT_FIELD_INDEX_MIN fields are not indexed.  The index is only built by
+ * Mat_FieldIndexFind, so structures whose fields are never looked up by
+ * name do not pay for it.
+ * @ingroup mat_internal
+ * @param matvar Pointer to the Structure MAT variable
+ * @retval 0 on success
+ */
+int
+Mat_FieldIndexUpdate(matvar_t *matvar)
+{
+    struct mat_fieldindex *index;
+    unsigned nfields, i, slot;
+
+    if ( matvar == NULL || matvar->internal == NULL )
+        return -1;
+    nfields = matvar->internal->num_fields;
+    index   = matvar->internal->fieldindex;
+    if ( nfields < MAT_FIELD_INDEX_MIN || matvar->internal->fieldnames == NULL ) {
+        Mat_FieldIndexFree(matvar);
+        return 0;
+    }
+
+    if ( index == NULL || index->nfields > nfields ||
+         2*nfields > index->mask+1 ) {
+        unsigned nslots = 2*MAT_FIELD_INDEX_MIN;
+        while ( nslots < 4*nfields )
+            nslots *= 2;
+        Mat_FieldIndexFree(matvar);
+        index = (struct mat_fieldindex*)malloc(sizeof(*index));
+        if ( index == NULL )
+            return -1;
+        index->slots = (unsigned*)calloc(nslots,sizeof(*index->slots));
+        if ( index->slots == NULL ) {
+            free(index);
+            return -1;
+        }
+        index->nfields = 0;
+        index->mask    = nslots-1;
+        matvar->internal->fieldindex = index;
+    }
+
+    for ( i = index->nfields; i < nfields; i++ ) {
+        const char *fieldname = matvar->internal->fieldnames[i];
+        slot = FieldIndexHash(fieldname) & index->mask;
+        while ( index->slots[slot] != 0 ) {
+            /* The first of fields with the same name is found */
+            if ( !strcmp(matvar->internal->fieldnames[index->slots[slot]-1],
+                         fieldname) )
+                break;
+            slot = (slot+1) & index->mask;
+        }
+        if ( index->slots[slot] == 0 )
+            index->slots[slot] = i+1;
+    }
+    index->nfields = nfields;
+
+    return 0;
+}
+
+/** @brief Finds the index of a field of a structure by its name
+ *
+ * Looks the field up in the hash index of the structure, building the index
+ * on the first lookup or updating it if fields have been added since, or
+ * compares the fieldnames in turn if the structure has too few fields to be
+ * indexed.
+ * @ingroup mat_internal
+ * @param matvar Pointer to the Structure MAT variable
+ * @param fieldname Name of the field
+ * @return 0-relative index of the field, or -1 if there is no such field
+ */
+int
+Mat_FieldIndexFind(matvar_t *matvar,const char *fieldname)
+{
+    struct mat_fieldindex *index;
+    unsigned nfields, i, slot;
+
+    if ( matvar == NULL || matvar->internal == NULL || fieldname == NULL ||
+         matvar->internal->fieldnames == NULL )
+        return -1;
+    nfields = matvar->internal->num_fields;
+    index   = matvar->internal->fieldindex;
+    if ( nfields >= MAT_FIELD_INDEX_MIN &&
+         (index == NULL || index->nfields != nfields) ) {
+        (void)Mat_FieldIndexUpdate(matvar);
+        index = matvar->internal->fieldindex;
+    }
+
+    if ( index != NULL && index->nfields == nfields ) {
+        slot = FieldIndexHash(fieldname) & index->mask;
+        while ( index->slots[slot] != 0 ) {
+            i = index->slots[slot]-1;
+            if ( !strcmp(matvar->internal->fieldnames[i],fieldname) )
+                return i;
+            slot = (slot+1) & index->mask;
+        }
+        return -1;
+    }
+
+    for ( i = 0; i < nfields; i++ ) {
+        if ( !strcmp(matvar->internal->fieldnames[i],fieldname) )
+            return i;
+    }
+    return -1;
+}
+
+/** @brief Frees the hash index of the fieldnames of a structure
+ *
+ * @ingroup mat_internal
+ * @param matvar Pointer to the Structure MAT variable
+ */
+void
+Mat_FieldIndexFree(matvar_t *matvar)
+{
+    if ( matvar == NULL || matvar->internal == NULL ||
+         matvar->internal->fieldindex == NULL )
+        return;
+    free(matvar->internal->fieldindex->slots);
+    free(matvar->internal->fieldindex);
+    matvar->internal->fieldindex = NULL;
+}
+
+/** @endcond */
@@ -20,8 +20,41 @@
 #include <R.h>
 #include <Rinternals.h>
 #include <R_ext/Rdynload.h>
+#include <Rversion.h>
 #include "matio/matio.h"
 
+#if defined(R_VERSION) && R_VERSION >= R_Version(3, 5, 0)
+#define RMATIO_ALTREP 1
+#include <R_ext/Altrep.h>
+static R_altrep_class_t lazy_real_class;
+static R_altrep_class_t lazy_integer_class;
+#endif
+
+/** Read int64 and uint64 data as bit64 'integer64' vectors */
+#define RMATIO_READ_INT64 0x1
+/** Read narrow numeric and logical data without widening it */
+#define RMATIO_READ_PRESERVE_TYPES 0x2
+/** Read cell arrays of strings as character vectors */
+#define RMATIO_READ_CELLSTR 0x4
+/** Read structure arrays of scalars as data.frames */
+#define RMATIO_READ_DATA_FRAME 0x8
+/** Read cell arrays of equal numeric arrays as one array */
+#define RMATIO_READ_STACK_CELLS 0x10
+/** Number of strings transposed at a time to or from a char matrix */
+#define RMATIO_CHAR_BLOCK 64
+/** Number of strings cached when reading a cell array of strings */
+#define RMATIO_CELLSTR_CACHE 256
+
+#if defined(R_VERSION) && R_VERSION >= R_Version(3, 6, 0)
+#define RMATIO_ALTLOGICAL 1
+#endif
+
+/* Read the variables of a MAT file ahead on a thread */
+#if !defined(_WIN32)
+#define RMATIO_READ_AHEAD 1
+#include <pthread.h>
+#endif
+
 /*
  * -------------------------------------------------------------
  *
@@ -33,12 +66,22 @@
 static int
 read_mat_cell(SEXP list,
               int index,
-              matvar_t *matvar);
+              matvar_t *matvar,
+              int flags);
 
 static int
 read_mat_struct(SEXP list,
                 int index,
-                matvar_t *matvar);
+                matvar_t *matvar,
+                int flags);
+
+static SEXPTYPE
+narrow_type(matvar_t *matvar);
+
+static int
+read_narrow(SEXP list,
+            int index,
+            matvar_t *matvar);
 
 static int
 write_elmt(const SEXP elmt,
@@ -49,7 +92,9 @@ write_elmt(const SEXP elmt,
            size_t field_index,
            size_t index,
            int ragged,
-           int compression);
+           int compression,
+           int pack,
+           int data_frame);
 
 /*
  * -------------------------------------------------------------
@@ -463,6 +508,14 @@ Mat_VarCreateEmpty(const SEXP elmt)
 
     switch (TYPEOF(elmt)) {
     case REALSXP:
+        if (Rf_inherits(elmt, "integer64"))
+            return Mat_VarCreate(NULL,
+                                 MAT_C_INT64,
+                                 MAT_T_INT64,
+                                 rank,
+                                 dims_0_1,
+                                 NULL,
+                                 0);
         return Mat_VarCreate(NULL,
                              MAT_C_DOUBLE,
                              MAT_T_DOUBLE,
@@ -507,8 +560,477 @@ Mat_VarCreateEmpty(const SEXP elmt)
     }
 }
 
+/** @brief Check if the data of an R vector is written in chunks
+ *
+ * ALTREP vectors without a data pointer, e.g. compact sequences and
+ * lazy vectors, are written in chunks copied by write_data_region,
+ * so their data is never materialised in memory.
+ *
+ * @ingroup rmatio
+ * @param elmt R object to check
+ * @return 1 if the data is written in chunks, else 0.
+ */
+static int
+write_streamed(const SEXP elmt)
+{
+#if defined(RMATIO_ALTREP)
+    switch (TYPEOF(elmt)) {
+    case REALSXP:
+    case INTSXP:
+    case LGLSXP:
+        return ALTREP(elmt) && NULL == DATAPTR_OR_NULL(elmt);
+    default:
+        return 0;
+    }
+#else
+    return 0;
+#endif
+}
+
+/** @brief Check if a vector is stored in a narrower type than its class
+ *
+ *
+ * @ingroup rmatio
+ * @param matvar The MAT variable of the vector
+ * @param elmt The R object of the MAT variable
+ * @return 1 if the data is packed with pack_region, else 0.
+ */
+static int
+write_packed(const matvar_t *matvar, const SEXP elmt)
+{
+    switch (TYPEOF(elmt)) {
+    case REALSXP:
+        return Mat_SizeOf(matvar->data_type) < sizeof(double);
+    case INTSXP:
+        return Mat_SizeOf(matvar->data_type) < sizeof(int);
+    default:
+        return 0;
+    }
+}
+
+/** @brief Copy a region of a double or integer vector
+ *
+ *
+ * @ingroup rmatio
+ * @param elmt The double or integer vector
+ * @param start Index of the first element to copy
+ * @param n Number of elements to copy
+ * @param buf Buffer of n doubles or ints
+ * @return the number of elements copied.
+ */
+static size_t
+get_region(const SEXP elmt, size_t start, size_t n, void *buf)
+{
+#if defined(RMATIO_ALTREP)
+    if (REALSXP == TYPEOF(elmt))
+        return REAL_GET_REGION(elmt, start, n, (double*)buf);
+    return INTEGER_GET_REGION(elmt, start, n, (int*)buf);
+#else
+    if (REALSXP == TYPEOF(elmt))
+        memcpy(buf, REAL(elmt) + start, n * sizeof(double));
+    else
+        memcpy(buf, INTEGER(elmt) + start, n * sizeof(int));
+    return n;
+#endif
+}
+
+/** @brief Smallest storage type that holds the values of a vector
+ *
+ * Scans a double or integer vector in chunks for its range and, for a
+ * double vector, whether all values are integers other than -0. The
+ * values can be stored losslessly in a narrower integer type if they
+ * fit in it. A MAT variable keeps its class when the data is stored
+ * in a narrower type, and the data is converted back to the class
+ * when it is read.
+ *
+ * @ingroup rmatio
+ * @param elmt The double or integer vector
+ * @return the MAT data type to store the vector with, which is
+ * MAT_T_DOUBLE or MAT_T_INT32 if it can not be stored narrower.
+ */
+static enum matio_types
+pack_data_type(const SEXP elmt)
+{
+    enum matio_types data_type = MAT_T_INT32;
+    size_t len = XLENGTH(elmt);
+    double min = 0, max = 0;
+
+    if (REALSXP == TYPEOF(elmt)) {
+        double buf[1024];
+
+        data_type = MAT_T_DOUBLE;
+        if (!len || Rf_inherits(elmt, "integer64"))
+            return data_type;
+
+        for (size_t i = 0; i < len; i += 1024) {
+            size_t n = len - i < 1024 ? len - i : 1024;
+            int nonint = 0;
+
+            if (get_region(elmt, i, n, buf) != n)
+                return data_type;
+
+            /* NaN fails both comparisons */
+            for (size_t j = 0; j < n; j++) {
+                nonint |= !(buf[j] >= INT_MIN && buf[j] <= UINT_MAX);
+                if (buf[j] < min)
+                    min = buf[j];
+                if (buf[j] > max)
+                    max = buf[j];
+            }
+            if (nonint)
+                return data_type;
+
+            /* All values in range, check that they are integers. An
+             * integer type would lose the sign of -0. */
+            for (size_t j = 0; j < n; j++)
+                nonint |= (buf[j] != (double)(mat_int64_t)buf[j])
+                    | (0 == buf[j] && signbit(buf[j]));
+            if (nonint)
+                return data_type;
+        }
+    } else {
+        int buf[1024], imin = 0, imax = 0;
+
+        if (!len)
+            return data_type;
+
+        for (size_t i = 0; i < len; i += 1024) {
+            size_t n = len - i < 1024 ? len - i : 1024;
+
+            if (get_region(elmt, i, n, buf) != n)
+                return data_type;
+
+            /* NA is INT_MIN, and is kept as int32 */
+            for (size_t j = 0; j < n; j++) {
+                imin = buf[j] < imin ? buf[j] : imin;
+                imax = buf[j] > imax ? buf[j] : imax;
+            }
+        }
+
+        min = imin;
+        max = imax;
+    }
+
+    if (min >= 0) {
+        if (max <= UINT8_MAX)
+            return MAT_T_UINT8;
+        if (max <= UINT16_MAX)
+            return MAT_T_UINT16;
+        if (max <= UINT32_MAX && MAT_T_DOUBLE == data_type)
+            return MAT_T_UINT32;
+    } else if (min > INT_MIN || MAT_T_DOUBLE == data_type) {
+        if (min >= INT8_MIN && max <= INT8_MAX)
+            return MAT_T_INT8;
+        if (min >= INT16_MIN && max <= INT16_MAX)
+            return MAT_T_INT16;
+        if (max <= INT32_MAX)
+            return MAT_T_INT32;
+    }
+
+    return data_type;
+}
+
+/** @brief Copy a region of a vector converted to a narrower type
+ *
+ *
+ * @ingroup rmatio
+ * @param elmt The double or integer vector
+ * @param data_type The MAT data type to convert to, from
+ * pack_data_type
+ * @param start Index of the first element to copy
+ * @param n Number of elements to copy
+ * @param buf Buffer of n elements of the data type
+ * @return the number of elements copied.
+ */
+static size_t
+pack_region(const SEXP elmt, enum matio_types data_type, size_t start,
+            size_t n, void *buf)
+{
+    double values[1024];
+    int ints[1024];
+    size_t done = 0;
+
+    while (done < n) {
+        size_t m = n - done < 1024 ? n - done : 1024;
+
+        if (REALSXP == TYPEOF(elmt)) {
+            if (get_region(elmt, start + done, m, values) != m)
+                break;
+        } else {
+            if (get_region(elmt, start + done, m, ints) != m)
+                break;
+            for (size_t i=0;i<m;i++)
+                values[i] = ints[i];
+        }
+
+        switch (data_type) {
+        case MAT_T_INT32:
+            for (size_t i=0;i<m;i++)
+                ((mat_int32_t*)buf)[done + i] = values[i];
+            break;
+        case MAT_T_UINT32:
+            for (size_t i=0;i<m;i++)
+                ((mat_uint32_t*)buf)[done + i] = values[i];
+            break;
+        case MAT_T_INT16:
+            for (size_t i=0;i<m;i++)
+                ((mat_int16_t*)buf)[done + i] = values[i];
+            break;
+        case MAT_T_UINT16:
+            for (size_t i=0;i<m;i++)
+                ((mat_uint16_t*)buf)[done + i] = values[i];
+            break;
+        case MAT_T_INT8:
+            for (size_t i=0;i<m;i++)
+                ((mat_int8_t*)buf)[done + i] = values[i];
+            break;
+        case MAT_T_UINT8:
+            for (size_t i=0;i<m;i++)
+                ((mat_uint8_t*)buf)[done + i] = values[i];
+            break;
+        default:
+            return done;
+        }
+
+        done += m;
+    }
+
+    return done;
+}
+
+/** @brief Copy a region of the data of a MAT variable from its R object
+ *
+ * Called by matio to write the data of a vector for which
+ * write_streamed is true, or that is stored in a narrower type than
+ * its class, in chunks of a fixed number of elements.
+ *
+ * @ingroup rmatio
+ * @param matvar MAT variable to copy the data of
+ * @param source The R object of the MAT variable
+ * @param start Index of the first element to copy
+ * @param n Number of elements to copy
+ * @param buf Buffer of n elements of the data type of matvar
+ * @return the number of elements copied.
+ */
+static size_t
+write_data_region(matvar_t *matvar, void *source, size_t start,
+                  size_t n, void *buf)
+{
+    SEXP elmt = (SEXP)source;
+
+    switch (TYPEOF(elmt)) {
+    case REALSXP:
+    case INTSXP:
+        if (write_packed(matvar, elmt))
+            return pack_region(elmt, matvar->data_type, start, n, buf);
+        return get_region(elmt, start, n, buf);
+#if defined(RMATIO_ALTREP)
+    case LGLSXP:
+    {
+        int logical[1024];
+        size_t done = 0;
+
+        while (done < n) {
+            size_t m = n - done;
+            if (m > 1024)
+                m = 1024;
+            if ((size_t)LOGICAL_GET_REGION(elmt, start + done, m, logical) != m)
+                break;
+            for (size_t i=0;i<m;i++)
+                ((mat_uint8_t*)buf)[done + i] = logical[i] != 0;
+            done += m;
+        }
+
+        return done;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+/** @brief Supply the data of a MAT variable from its R object
+ *
+ * The write functions below create the MAT variables of R vectors
+ * without data and with the R object as data source. The data is
+ * converted here just before the variable is written and released
+ * directly afterwards, so the leaves of a nested list are never held
+ * in memory all at once. Double and integer vectors are written
+ * directly from the R object without a copy. ALTREP vectors without
+ * a data pointer, and vectors stored in a narrower type, are left
+ * without data to be written in chunks by write_data_region.
+ *
+ * @ingroup rmatio
+ * @param matvar MAT variable to supply the data for
+ * @param source The R object of the MAT variable
+ * @param release 0 to supply the data and 1 to release it.
+ * @return 0 on succes or 1 on failure.
+ */
+static int
+write_deferred_data(matvar_t *matvar, void *source, int release)
+{
+    SEXP elmt = (SEXP)source;
+    size_t len = 1;
+
+    if (NULL == matvar)
+        return 1;
+
+    if (release) {
+        if (NULL != matvar->data && !matvar->mem_conserve) {
+            if (matvar->isComplex) {
+                mat_complex_split_t *z = matvar->data;
+                free(z->Re);
+                free(z->Im);
+            }
+            free(matvar->data);
+        }
+        matvar->data = NULL;
+        matvar->mem_conserve = 0;
+        return 0;
+    }
+
+    for (int i=0;i<matvar->rank;i++)
+        len *= matvar->dims[i];
+
+    if (write_streamed(elmt) || write_packed(matvar, elmt))
+        return 0;
+
+    switch (TYPEOF(elmt)) {
+    case REALSXP:
+        matvar->data = REAL(elmt);
+        matvar->mem_conserve = 1;
+        break;
+    case INTSXP:
+        matvar->data = INTEGER(elmt);
+        matvar->mem_conserve = 1;
+        break;
+    case CPLXSXP:
+    {
+        mat_complex_split_t *z = malloc(sizeof(mat_complex_split_t));
+        if (NULL == z)
+            return 1;
+        z->Re = malloc(len*sizeof(double));
+        z->Im = malloc(len*sizeof(double));
+        if (len && (NULL == z->Re || NULL == z->Im)) {
+            free(z->Re);
+            free(z->Im);
+            free(z);
+            return 1;
+        }
+        for (size_t i=0;i<len;i++) {
+            ((double*)z->Re)[i] = COMPLEX(elmt)[i].r;
+            ((double*)z->Im)[i] = COMPLEX(elmt)[i].i;
+        }
+        matvar->data = z;
+        break;
+    }
+    case LGLSXP:
+    {
+        mat_uint8_t *logical = malloc(len*sizeof(mat_uint8_t));
+        if (len && NULL == logical)
+            return 1;
+        for (size_t i=0;i<len;i++)
+            logical[i] = LOGICAL(elmt)[i] != 0;
+        matvar->data = logical;
+        break;
+    }
+    case CHARSXP:
+    {
+        mat_uint16_t *buf = malloc(len*sizeof(mat_uint16_t));
+        if (len && NULL == buf)
+            return 1;
+        for (size_t i=0;i<len;i++)
+            buf[i] = CHAR(elmt)[i];
+        matvar->data = buf;
+        break;
+    }
+    case STRSXP:
+    {
+        /* Strings of equal length written as a char matrix. The
+         * matrix is stored by column, so it is filled from a block of
+         * strings at a time, one column after the other, to write
+         * each column of the block contiguously. */
+        const char *chars[RMATIO_CHAR_BLOCK];
+        size_t nrow = matvar->dims[0], ncol = matvar->dims[1];
+        mat_uint16_t *buf = malloc(len*sizeof(mat_uint16_t));
+        if (len && NULL == buf)
+            return 1;
+        for (size_t i0=0;i0<nrow;i0+=RMATIO_CHAR_BLOCK) {
+            size_t n = nrow - i0;
+            if (n > RMATIO_CHAR_BLOCK)
+                n = RMATIO_CHAR_BLOCK;
+            for (size_t i=0;i<n;i++)
+                chars[i] = CHAR(STRING_ELT(elmt, i0 + i));
+            for (size_t j=0;j<ncol;j++) {
+                mat_uint16_t *col = buf + nrow*j + i0;
+                for (size_t i=0;i<n;i++)
+                    col[i] = chars[i][j];
+            }
+        }
+        matvar->data = buf;
+        break;
+    }
+    default:
+        return 1;
+    }
+
+    return 0;
+}
+
+/** @brief State of writing a MAT variable to a file
+ *
+ *
+ * @ingroup rmatio
+ */
+struct write_matvar_state {
+    mat_t *mat;
+    matvar_t *matvar;
+    int compression;
+    int err;           /* The return value of Mat_VarWrite */
+    mat_log_t log;     /* The messages of matio while writing */
+};
+
+/** @brief Write a MAT variable to a file
+ *
+ *
+ * @ingroup rmatio
+ * @param data The state of writing the variable
+ * @return R_NilValue.
+ */
+static SEXP
+write_matvar_exec(void *data)
+{
+    struct write_matvar_state *ws = (struct write_matvar_state*)data;
+
+    ws->err = Mat_VarWrite(ws->mat, ws->matvar, ws->compression);
+
+    return R_NilValue;
+}
+
+/** @brief Clean up after writing a MAT variable to a file
+ *
+ * Also runs if an R error interrupts the write, e.g. in an ALTREP
+ * method, so that the variable and the data it was given are freed.
+ *
+ * @ingroup rmatio
+ * @param data The state of writing the variable
+ */
+static void
+write_matvar_cleanup(void *data)
+{
+    struct write_matvar_state *ws = (struct write_matvar_state*)data;
+
+    Mat_LogCapture(NULL);
+    Mat_VarFree(ws->matvar);
+    ws->matvar = NULL;
+}
+
 /** @brief Write the matvar data
  *
+ * A matvar written to the file is written with the messages of
+ * matio collected, so that a failing write returns to release the
+ * data of the variable, see Mat_VarWrite5, instead of raising an R
+ * error from within matio. The message is then given as a warning.
  *
  * @ingroup rmatio
  * @param mat MAT file pointer. If mat_struct and mat_cell
@@ -540,8 +1062,22 @@ write_matvar(mat_t *mat,
     } else if(mat_cell) {
         Mat_VarSetCell(mat_cell, index, matvar);
     } else {
-        Mat_VarWrite(mat, matvar, compression);
-        Mat_VarFree(matvar);
+        struct write_matvar_state ws;
+
+        memset(&ws, 0, sizeof(ws));
+        ws.mat = mat;
+        ws.matvar = matvar;
+        ws.compression = compression;
+        Mat_LogCapture(&ws.log);
+        R_ExecWithCleanup(write_matvar_exec, &ws, write_matvar_cleanup, &ws);
+        if (ws.log.warning[0] != '\0')
+            Rf_warning("%s", ws.log.warning);
+        if (ws.log.critical) {
+            Rf_warning("%s", ws.log.message);
+            return 1;
+        }
+        if (ws.err)
+            return 1;
     }
 
     return 0;
@@ -577,7 +1113,6 @@ write_charsxp(const SEXP elmt,
     size_t dims[2];
     const int rank = 2;
     matvar_t *matvar;
-    mat_uint16_t *buf;
 
     if (Rf_isNull(elmt) || CHARSXP != TYPEOF(elmt))
         return 1;
@@ -585,24 +1120,17 @@ write_charsxp(const SEXP elmt,
     dims[0] = 1;
     dims[1] = LENGTH(elmt);
 
-    buf = malloc(dims[1]*sizeof(mat_uint16_t));
-    if (NULL == buf)
-        return 1;
-    for (size_t i=0;i<dims[1];i++)
-        buf[i] = CHAR(elmt)[i];
-
     matvar = Mat_VarCreate(name,
                            MAT_C_CHAR,
                            MAT_T_UINT16,
                            rank,
                            dims,
-                           (void*)buf,
+                           NULL,
                            0);
 
-    free(buf);
-
     if (NULL == matvar)
         return 1;
+    Mat_VarSetDataSource(matvar, elmt);
 
     return write_matvar(mat,
                         matvar,
@@ -629,6 +1157,8 @@ write_charsxp(const SEXP elmt,
  * @param field_index
  * @param index
  * @param compression Write the file with compression or not
+ * @param pack Store double and integer arrays in the smallest
+ * integer type that holds their values
  * @return 0 on succes or 1 on failure.
  */
 static int
@@ -639,7 +1169,8 @@ write_realsxp(const SEXP elmt,
               matvar_t *mat_cell,
               size_t field_index,
               size_t index,
-              int compression)
+              int compression,
+              int pack)
 {
     size_t *dims;
     int rank;
@@ -651,15 +1182,27 @@ write_realsxp(const SEXP elmt,
     if (map_R_object_rank_and_dims(elmt, &rank, &dims))
         return 1;
 
-    matvar = Mat_VarCreate(name,
-                           MAT_C_DOUBLE,
-                           MAT_T_DOUBLE,
-                           rank,
-                           dims,
-                           REAL(elmt),
-                           0);
+    /* The payload of a bit64 'integer64' vector is the 64 bit
+     * integers, which are written as they are. */
+    if (Rf_inherits(elmt, "integer64"))
+        matvar = Mat_VarCreate(name,
+                               MAT_C_INT64,
+                               MAT_T_INT64,
+                               rank,
+                               dims,
+                               NULL,
+                               0);
+    else
+        matvar = Mat_VarCreate(name,
+                               MAT_C_DOUBLE,
+                               pack ? pack_data_type(elmt) : MAT_T_DOUBLE,
+                               rank,
+                               dims,
+                               NULL,
+                               0);
 
     free(dims);
+    Mat_VarSetDataSource(matvar, elmt);
 
     return write_matvar(mat,
                         matvar,
@@ -686,6 +1229,8 @@ write_realsxp(const SEXP elmt,
  * @param field_index
  * @param index
  * @param compression Write the file with compression or not
+ * @param pack Store double and integer arrays in the smallest
+ * integer type that holds their values
  * @return 0 on succes or 1 on failure.
  */
 static int
@@ -696,7 +1241,8 @@ write_intsxp(const SEXP elmt,
              matvar_t *mat_cell,
              size_t field_index,
              size_t index,
-             int compression)
+             int compression,
+             int pack)
 {
     size_t *dims;
     int rank;
@@ -710,13 +1256,14 @@ write_intsxp(const SEXP elmt,
 
     matvar = Mat_VarCreate(name,
                            MAT_C_INT32,
-                           MAT_T_INT32,
+                           pack ? pack_data_type(elmt) : MAT_T_INT32,
                            rank,
                            dims,
-                           INTEGER(elmt),
+                           NULL,
                            0);
 
     free(dims);
+    Mat_VarSetDataSource(matvar, elmt);
 
     return write_matvar(mat,
                         matvar,
@@ -758,9 +1305,6 @@ write_cplxsxp(const SEXP elmt,
     size_t *dims;
     int rank;
     matvar_t *matvar=NULL;
-    double *re = NULL;
-    double *im = NULL;
-    struct mat_complex_split_t z;
 
     if (Rf_isNull(elmt) || CPLXSXP != TYPEOF(elmt))
         return 1;
@@ -768,37 +1312,16 @@ write_cplxsxp(const SEXP elmt,
     if (map_R_object_rank_and_dims(elmt, &rank, &dims))
         return 1;
 
-    re = malloc(LENGTH(elmt)*sizeof(double));
-    if (NULL == re) {
-        free(dims);
-        return 1;
-    }
-
-    im = malloc(LENGTH(elmt)*sizeof(double));
-    if (NULL == im) {
-        free(dims);
-        free(re);
-        return 1;
-    }
-
-    for (int i=0;i<LENGTH(elmt);i++) {
-        re[i] = COMPLEX(elmt)[i].r;
-        im[i] = COMPLEX(elmt)[i].i;
-    }
-
-    z.Re = re;
-    z.Im = im;
     matvar = Mat_VarCreate(name,
                            MAT_C_DOUBLE,
                            MAT_T_DOUBLE,
                            rank,
                            dims,
-                           &z,
+                           NULL,
                            MAT_F_COMPLEX);
 
     free(dims);
-    free(re);
-    free(im);
+    Mat_VarSetDataSource(matvar, elmt);
 
     return write_matvar(mat,
                         matvar,
@@ -837,10 +1360,9 @@ write_lglsxp(const SEXP elmt,
              size_t index,
              int compression)
 {
-    size_t *dims, len;
+    size_t *dims;
     int rank;
     matvar_t *matvar = NULL;
-    mat_uint8_t *logical = NULL;
 
     if (Rf_isNull(elmt) || LGLSXP != TYPEOF(elmt))
         return 1;
@@ -848,29 +1370,16 @@ write_lglsxp(const SEXP elmt,
     if (map_R_object_rank_and_dims(elmt, &rank, &dims))
         return 1;
 
-    len = dims[0];
-    for (int i=1;i<rank;i++)
-        len *= dims[i];
-
-    logical = malloc(len*sizeof(mat_uint8_t));
-    if (NULL == logical) {
-        free(dims);
-        return 1;
-    }
-
-    for (size_t i=0;i<len;i++)
-        logical[i] = LOGICAL(elmt)[i] != 0;
-
     matvar = Mat_VarCreate(name,
                            MAT_C_UINT8,
                            MAT_T_UINT8,
                            rank,
                            dims,
-                           logical,
+                           NULL,
                            MAT_F_LOGICAL);
 
     free(dims);
-    free(logical);
+    Mat_VarSetDataSource(matvar, elmt);
 
     return write_matvar(mat,
                         matvar,
@@ -898,6 +1407,8 @@ write_lglsxp(const SEXP elmt,
  * @param index
  * @param ragged
  * @param compression Write the file with compression or not
+ * @param pack Store double and integer arrays in the smallest
+ * integer type that holds their values
  * @return 0 on succes or 1 on failure.
  */
 static int
@@ -909,7 +1420,8 @@ write_strsxp(const SEXP elmt,
              size_t field_index,
              size_t index,
              int ragged,
-             int compression)
+             int compression,
+             int pack)
 {
     size_t dims[2] = {0, 0};
     matvar_t *matvar;
@@ -936,7 +1448,9 @@ write_strsxp(const SEXP elmt,
                           field_index,
                           index,
                           ragged,
-                          compression);
+                          compression,
+                          pack,
+                          0);
 
     dims[0] = LENGTH(elmt);
     if (dims[0])
@@ -946,27 +1460,17 @@ write_strsxp(const SEXP elmt,
         return 1;
 
     if (equal_length) {
-        mat_uint16_t *buf = malloc(dims[0]*dims[1]*sizeof(mat_uint16_t));
-        if (NULL == buf)
-            return 1;
-
-        for (size_t i=0;i<dims[0];i++) {
-            for (size_t j=0;j<dims[1];j++)
-                buf[dims[0]*j + i] = CHAR(STRING_ELT(elmt, i))[j];
-        }
-
         matvar = Mat_VarCreate(name,
                                MAT_C_CHAR,
                                MAT_T_UINT16,
                                rank,
                                dims,
-                               (void*)buf,
+                               NULL,
                                0);
 
-        free(buf);
-
         if (NULL == matvar)
             return 1;
+        Mat_VarSetDataSource(matvar, elmt);
     } else {
         /* Write strings in a cell */
         dims[1] = 1;
@@ -990,7 +1494,9 @@ write_strsxp(const SEXP elmt,
                            0,
                            i,
                            0,
-                           compression)) {
+                           compression,
+                           pack,
+                           0)) {
                 Mat_VarFree(matvar);
                 return 1;
             }
@@ -1143,19 +1649,22 @@ write_lgCMatrix(const SEXP elmt,
  *
  * @ingroup rmatio
  * @param elmt R object to write
- * @param names
- * @param matvar
- * @param dims
- * @param ragged
+ * @param mat_cell The cell array to write the data to
+ * @param len Number of strings to write when elmt is a character vector
  * @param compression Write the file with compression or not
+ * @param pack Store double and integer arrays in the smallest
+ * integer type that holds their values
+ * @param data_frame Write a data.frame as a structure array with
+ * one element per row, see write_data_frame
  * @return 0 on succes or 1 on failure.
  */
 static int
 write_ragged_data(SEXP elmt,
-                  matvar_t *mat_struct,
                   matvar_t *mat_cell,
                   size_t len,
-                  int compression)
+                  int compression,
+                  int pack,
+                  int data_frame)
 {
     if (Rf_isNull(elmt))
         return 1;
@@ -1171,7 +1680,9 @@ write_ragged_data(SEXP elmt,
                            0,
                            j,
                            0,
-                           compression)) {
+                           compression,
+                           pack,
+                           data_frame)) {
                 return 1;
             }
         }
@@ -1190,7 +1701,9 @@ write_ragged_data(SEXP elmt,
                        0,
                        0,
                        0,
-                       compression)) {
+                       compression,
+                       pack,
+                       data_frame)) {
             return 1;
         }
         break;
@@ -1205,7 +1718,9 @@ static int
 write_ragged(const SEXP elmt,
              const SEXP names,
              matvar_t *matvar,
-             int compression)
+             int compression,
+             int pack,
+             int data_frame)
 {
     size_t dims[2] = {0, 0};
     const int rank = 2;
@@ -1239,10 +1754,11 @@ write_ragged(const SEXP elmt,
             Mat_VarSetStructFieldByIndex(matvar, i, 0, cell);
 
         write_ragged_data(VECTOR_ELT(elmt, i),
-                          NULL,
                           cell,
                           dims[0],
-                          compression);
+                          compression,
+                          pack,
+                          data_frame);
     }
 
     return 0;
@@ -1258,6 +1774,10 @@ write_ragged(const SEXP elmt,
  * @param dims
  * @param ragged
  * @param compression Write the file with compression or not
+ * @param pack Store double and integer arrays in the smallest
+ * integer type that holds their values
+ * @param data_frame Write a data.frame as a structure array with
+ * one element per row, see write_data_frame
  * @return 0 on succes or 1 on failure.
  */
 static int
@@ -1266,7 +1786,9 @@ write_vecsxp_data(const SEXP elmt,
                        matvar_t *mat_cell,
                        size_t *dims,
                        int ragged,
-                       int compression)
+                       int compression,
+                       int pack,
+                       int data_frame)
 {
     if (Rf_isNull(elmt) || VECSXP != TYPEOF(elmt) || !LENGTH(elmt) || NULL == dims)
         return 1;
@@ -1306,7 +1828,9 @@ write_vecsxp_data(const SEXP elmt,
                            field_index,
                            index,
                            ragged,
-                           compression)) {
+                           compression,
+                           pack,
+                           data_frame)) {
                 return 1;
             }
         }
@@ -1315,16 +1839,37 @@ write_vecsxp_data(const SEXP elmt,
     return 0;
 }
 
-/** @brief
- *
+/** @brief Check that the fieldnames of a structure are unique
  *
+ * Matlab can not load a structure with two fields of the same name.
  * @ingroup rmatio
- * @param elmt R object to write
- * @param mat_cell
- * @return 0 on succes or 1 on failure.
+ * @param matvar MAT structure variable
+ * @return 0 if the fieldnames are unique, else 1.
  */
 static int
-write_cell_array_with_empty_arrays(const SEXP elmt, matvar_t *mat_cell)
+check_fieldnames(matvar_t *matvar)
+{
+    char * const *fieldnames = Mat_VarGetStructFieldnames(matvar);
+    unsigned nfields = Mat_VarGetNumberOfFields(matvar);
+
+    for (unsigned i=0;i<nfields;i++) {
+        if (Mat_VarGetStructFieldIndex(matvar, fieldnames[i]) != (int)i)
+            return 1;
+    }
+
+    return 0;
+}
+
+/** @brief
+ *
+ *
+ * @ingroup rmatio
+ * @param elmt R object to write
+ * @param mat_cell
+ * @return 0 on succes or 1 on failure.
+ */
+static int
+write_cell_array_with_empty_arrays(const SEXP elmt, matvar_t *mat_cell)
 {
     SEXP names;
     size_t len;
@@ -1384,6 +1929,10 @@ write_cell_array_with_empty_arrays(const SEXP elmt, matvar_t *mat_cell)
                     free(fieldnames);
                     if (NULL == cell)
                         return 1;
+                    if (check_fieldnames(cell)) {
+                        Mat_VarFree(cell);
+                        return 1;
+                    }
 
                     if (1 == dims[0]) {
                         for (size_t j=0;j<LENGTH(item);j++) {
@@ -1448,6 +1997,10 @@ write_cell_array_with_empty_arrays(const SEXP elmt, matvar_t *mat_cell)
  * @param field_index
  * @param index
  * @param compression Write the file with compression or not
+ * @param pack Store double and integer arrays in the smallest
+ * integer type that holds their values
+ * @param data_frame Write a data.frame as a structure array with
+ * one element per row, see write_data_frame
  * @return 0 on succes or 1 on failure.
  */
 static int
@@ -1458,7 +2011,9 @@ write_vecsxp_as_cell(const SEXP elmt,
                      matvar_t *mat_cell,
                      size_t field_index,
                      size_t index,
-                     int compression)
+                     int compression,
+                     int pack,
+                     int data_frame)
 
 {
     size_t dims[2] = {1, 1};
@@ -1494,7 +2049,8 @@ write_vecsxp_as_cell(const SEXP elmt,
         return 1;
 
     if (ragged) {
-        err = write_ragged(elmt, R_NilValue, matvar, compression);
+        err = write_ragged(elmt, R_NilValue, matvar, compression, pack,
+                           data_frame);
     } else if (dims[0] == 0 && dims[1] == 0) {
         err = 0;
     } else if (dims[0] && dims[1]) {
@@ -1506,7 +2062,9 @@ write_vecsxp_as_cell(const SEXP elmt,
                                     matvar,
                                     dims,
                                     ragged,
-                                    compression);
+                                    compression,
+                                    pack,
+                                    data_frame);
     }
 
     if (err) {
@@ -1557,6 +2115,256 @@ write_structure_array_with_empty_fields(const SEXP elmt,
     return 0;
 }
 
+/** @brief Set the fields of a data.frame column in every row
+ *
+ * The fields of all rows are created together from the column by
+ * Mat_VarSetStructFieldColumn. Double and integer fields point to
+ * the elements of the column without a copy, unless the column is an
+ * ALTREP vector without a data pointer, which is copied once. String
+ * fields point to the characters of the CHARSXP, or of the level of
+ * a factor, and a missing string or level is written as an empty
+ * string. Matlab has no missing logical value, so a logical column
+ * with missing values is written as doubles 0, 1 and NA.
+ *
+ * @ingroup rmatio
+ * @param matvar The structure array of the data.frame
+ * @param field_index The index of the column
+ * @param col The column of the data.frame
+ * @return 0 on success or 1 on failure.
+ */
+static int
+set_data_frame_column(matvar_t *matvar, size_t field_index, const SEXP col)
+{
+    size_t n = XLENGTH(col);
+    int streamed = write_streamed(col);
+
+    if (Rf_isFactor(col) || STRSXP == TYPEOF(col)) {
+        SEXP levels = R_NilValue;
+        const char **data = (const char**)R_alloc(n, sizeof(char*));
+        size_t *len = (size_t*)R_alloc(n, sizeof(size_t));
+
+        if (Rf_isFactor(col))
+            levels = Rf_getAttrib(col, R_LevelsSymbol);
+
+        for (size_t j=0;j<n;j++) {
+            SEXP s = NA_STRING;
+
+            if (STRSXP == TYPEOF(col)) {
+                s = STRING_ELT(col, j);
+            } else {
+                int level = INTEGER(col)[j];
+                if (level >= 1 && level <= LENGTH(levels))
+                    s = STRING_ELT(levels, level - 1);
+            }
+
+            if (NA_STRING == s) {
+                data[j] = "";
+                len[j] = 0;
+            } else {
+                data[j] = CHAR(s);
+                len[j] = LENGTH(s);
+            }
+        }
+
+        return 0 != Mat_VarSetStructFieldColumn(matvar,
+                                                field_index,
+                                                MAT_C_CHAR,
+                                                MAT_T_UINT8,
+                                                (void*)data,
+                                                len,
+                                                0);
+    }
+
+    switch (TYPEOF(col)) {
+    case REALSXP:
+    case INTSXP:
+    {
+        enum matio_classes class_type = MAT_C_DOUBLE;
+        enum matio_types data_type = MAT_T_DOUBLE;
+        void *data;
+
+        if (INTSXP == TYPEOF(col)) {
+            class_type = MAT_C_INT32;
+            data_type = MAT_T_INT32;
+        } else if (Rf_inherits(col, "integer64")) {
+            class_type = MAT_C_INT64;
+            data_type = MAT_T_INT64;
+        }
+
+        if (streamed) {
+            data = R_alloc(n, INTSXP == TYPEOF(col) ? sizeof(int) : sizeof(double));
+            if (get_region(col, 0, n, data) != n)
+                return 1;
+        } else if (INTSXP == TYPEOF(col)) {
+            data = INTEGER(col);
+        } else {
+            data = REAL(col);
+        }
+
+        return 0 != Mat_VarSetStructFieldColumn(matvar,
+                                                field_index,
+                                                class_type,
+                                                data_type,
+                                                data,
+                                                NULL,
+                                                0);
+    }
+
+    case LGLSXP:
+    {
+        int *lgl;
+        int na = 0;
+
+#if defined(RMATIO_ALTREP)
+        if (streamed) {
+            lgl = (int*)R_alloc(n, sizeof(int));
+            if ((size_t)LOGICAL_GET_REGION(col, 0, n, lgl) != n)
+                return 1;
+        } else {
+            lgl = LOGICAL(col);
+        }
+#else
+        lgl = LOGICAL(col);
+#endif
+
+        for (size_t j=0;j<n && !na;j++)
+            na = NA_LOGICAL == lgl[j];
+
+        if (na) {
+            double *data = (double*)R_alloc(n, sizeof(double));
+
+            for (size_t j=0;j<n;j++)
+                data[j] = NA_LOGICAL == lgl[j] ? NA_REAL : (lgl[j] != 0);
+            return 0 != Mat_VarSetStructFieldColumn(matvar,
+                                                    field_index,
+                                                    MAT_C_DOUBLE,
+                                                    MAT_T_DOUBLE,
+                                                    data,
+                                                    NULL,
+                                                    0);
+        } else {
+            mat_uint8_t *data = (mat_uint8_t*)R_alloc(n, sizeof(mat_uint8_t));
+
+            for (size_t j=0;j<n;j++)
+                data[j] = lgl[j] != 0;
+            return 0 != Mat_VarSetStructFieldColumn(matvar,
+                                                    field_index,
+                                                    MAT_C_UINT8,
+                                                    MAT_T_UINT8,
+                                                    data,
+                                                    NULL,
+                                                    MAT_F_LOGICAL);
+        }
+    }
+
+    default:
+        return 1;
+    }
+}
+
+/** @brief Write a data.frame as a structure array
+ *
+ * A data.frame with rows, where every column is a double, integer,
+ * logical, character or factor vector, is written as a 1 x nrow
+ * structure array with one field per column, where each element
+ * holds the values of one row as scalars and strings, e.g. to be
+ * converted with struct2table in Matlab. This is the layout read
+ * back as a data.frame by read_structure_array_as_data_frame. The
+ * fields of each column are created together from the column, see
+ * set_data_frame_column, without checking and dispatching each value
+ * as an R object of its own. A factor is written as the strings of
+ * its levels.
+ *
+ * @ingroup rmatio
+ * @param elmt R object to write
+ * @param names The names of the columns
+ * @param mat MAT file pointer. If mat_struct and mat_cell
+ *  equals NULL, then the matvar data are written to the mat
+ *  file.
+ * @param name Name of the variable to write
+ * @param mat_struct MAT variable pointer to a struct field.
+ *  If non-zero, the matvar data is written to the mat_struct.
+ * @param mat_cell MAT variable pointer to a struct field.
+ *  If non-zero, the matvar data is written to the mat_cell.
+ * @param field_index
+ * @param index
+ * @param compression Write the file with compression or not
+ * @return 0 on succes, 1 on failure, or -1 if the data.frame has no
+ * rows or other columns, and was not written.
+ */
+static int
+write_data_frame(const SEXP elmt,
+                 const SEXP names,
+                 mat_t *mat,
+                 const char *name,
+                 matvar_t *mat_struct,
+                 matvar_t *mat_cell,
+                 size_t field_index,
+                 size_t index,
+                 int compression)
+{
+    size_t dims[2] = {1, 0};
+    size_t nfields;
+    matvar_t *matvar;
+    const int rank = 2;
+    const char **fieldnames;
+
+    nfields = LENGTH(elmt);
+    if (!nfields)
+        return -1;
+    dims[1] = LENGTH(VECTOR_ELT(elmt, 0));
+    if (!dims[1])
+        return -1;
+
+    for (size_t i=0;i<nfields;i++) {
+        SEXP col = VECTOR_ELT(elmt, i);
+
+        switch (TYPEOF(col)) {
+        case REALSXP:
+        case INTSXP:
+        case LGLSXP:
+        case STRSXP:
+            break;
+        default:
+            return -1;
+        }
+
+        if ((size_t)LENGTH(col) != dims[1]
+            || !Rf_isNull(Rf_getAttrib(col, R_DimSymbol)))
+            return -1;
+    }
+
+    fieldnames = malloc(nfields*sizeof(char*));
+    if (NULL == fieldnames)
+        return 1;
+    for (size_t i=0;i<nfields;i++)
+        fieldnames[i] = CHAR(STRING_ELT(names, i));
+
+    matvar = Mat_VarCreateStruct(name, rank, dims, fieldnames, nfields);
+    free(fieldnames);
+    if (NULL == matvar)
+        return 1;
+    if (check_fieldnames(matvar)) {
+        Mat_VarFree(matvar);
+        return 1;
+    }
+
+    for (size_t i=0;i<nfields;i++) {
+        if (set_data_frame_column(matvar, i, VECTOR_ELT(elmt, i))) {
+            Mat_VarFree(matvar);
+            return 1;
+        }
+    }
+
+    return write_matvar(mat,
+                        matvar,
+                        mat_struct,
+                        mat_cell,
+                        field_index,
+                        index,
+                        compression);
+}
+
 /** @brief
  *
  *
@@ -1574,6 +2382,10 @@ write_structure_array_with_empty_fields(const SEXP elmt,
  * @param field_index
  * @param index
  * @param compression Write the file with compression or not
+ * @param pack Store double and integer arrays in the smallest
+ * integer type that holds their values
+ * @param data_frame Write a data.frame as a structure array with
+ * one element per row, see write_data_frame
  * @return 0 on succes or 1 on failure.
  */
 static int
@@ -1585,7 +2397,9 @@ write_vecsxp_as_struct(const SEXP elmt,
                        matvar_t *mat_cell,
                        size_t field_index,
                        size_t index,
-                       int compression)
+                       int compression,
+                       int pack,
+                       int data_frame)
 {
     size_t dims[2] = {1, 1};
     size_t nfields;
@@ -1598,6 +2412,20 @@ write_vecsxp_as_struct(const SEXP elmt,
     if (Rf_isNull(elmt) || VECSXP != TYPEOF(elmt) || Rf_isNull(names))
         return 1;
 
+    if (data_frame && Rf_inherits(elmt, "data.frame")) {
+        int written = write_data_frame(elmt,
+                                       names,
+                                       mat,
+                                       name,
+                                       mat_struct,
+                                       mat_cell,
+                                       field_index,
+                                       index,
+                                       compression);
+        if (written >= 0)
+            return written;
+    }
+
     if (check_ragged(elmt, &ragged))
         return 1;
 
@@ -1626,9 +2454,13 @@ write_vecsxp_as_struct(const SEXP elmt,
 
     if (NULL == matvar)
         return 1;
+    if (check_fieldnames(matvar)) {
+        Mat_VarFree(matvar);
+        return 1;
+    }
 
     if (ragged) {
-        err = write_ragged(elmt, names, matvar, compression);
+        err = write_ragged(elmt, names, matvar, compression, pack, data_frame);
     } else if (nfields && dims[0] && dims[1]) {
         if (empty)
             err = write_structure_array_with_empty_fields(elmt, names, matvar);
@@ -1638,7 +2470,9 @@ write_vecsxp_as_struct(const SEXP elmt,
                                     NULL,
                                     dims,
                                     ragged,
-                                    compression);
+                                    compression,
+                                    pack,
+                                    data_frame);
     } else if (nfields == 0 && dims[0] == 1 && dims[1] == 1) {
         /* Empty structure array */
         err = 0;
@@ -1676,6 +2510,10 @@ write_vecsxp_as_struct(const SEXP elmt,
  * @param field_index
  * @param index
  * @param compression Write the file with compression or not
+ * @param pack Store double and integer arrays in the smallest
+ * integer type that holds their values
+ * @param data_frame Write a data.frame as a structure array with
+ * one element per row, see write_data_frame
  * @return 0 on succes or 1 on failure.
  */
 static int
@@ -1686,7 +2524,9 @@ write_vecsxp(const SEXP elmt,
              matvar_t *mat_cell,
              size_t field_index,
              size_t index,
-             int compression)
+             int compression,
+             int pack,
+             int data_frame)
 {
     int error;
     SEXP names;
@@ -1701,7 +2541,9 @@ write_vecsxp(const SEXP elmt,
             mat_cell,
             field_index,
             index,
-            compression);
+            compression,
+            pack,
+            data_frame);
     } else {
         error = write_vecsxp_as_struct(
             elmt,
@@ -1712,7 +2554,9 @@ write_vecsxp(const SEXP elmt,
             mat_cell,
             field_index,
             index,
-            compression);
+            compression,
+            pack,
+            data_frame);
     }
 
     UNPROTECT(1);
@@ -1736,6 +2580,10 @@ write_vecsxp(const SEXP elmt,
  * @param field_index
  * @param index
  * @param compression Write the file with compression or not
+ * @param pack Store double and integer arrays in the smallest
+ * integer type that holds their values
+ * @param data_frame Write a data.frame as a structure array with
+ * one element per row, see write_data_frame
  * @return 0 on succes or 1 on failure.
  */
 static int
@@ -1747,7 +2595,9 @@ write_elmt(const SEXP elmt,
            size_t field_index,
            size_t index,
            int ragged,
-           int compression)
+           int compression,
+           int pack,
+           int data_frame)
 {
     SEXP class_name;
 
@@ -1772,7 +2622,8 @@ write_elmt(const SEXP elmt,
                              mat_cell,
                              field_index,
                              index,
-                             compression);
+                             compression,
+                             pack);
     case INTSXP:
         return write_intsxp(elmt,
                             mat,
@@ -1781,7 +2632,8 @@ write_elmt(const SEXP elmt,
                             mat_cell,
                             field_index,
                             index,
-                            compression);
+                            compression,
+                            pack);
     case CPLXSXP:
         return write_cplxsxp(elmt,
                              mat,
@@ -1809,7 +2661,8 @@ write_elmt(const SEXP elmt,
                             field_index,
                             index,
                             ragged,
-                            compression);
+                            compression,
+                            pack);
     case VECSXP:
         return write_vecsxp(elmt,
                             mat,
@@ -1818,7 +2671,9 @@ write_elmt(const SEXP elmt,
                             mat_cell,
                             field_index,
                             index,
-                            compression);
+                            compression,
+                            pack,
+                            data_frame);
     case S4SXP:
         class_name = Rf_getAttrib(elmt, R_ClassSymbol);
         if (strcmp(CHAR(STRING_ELT(class_name, 0)), "dgCMatrix") == 0)
@@ -1862,6 +2717,12 @@ set_dim(SEXP m,
     /* Assign dimension to the allocated vector, if not   */
     /* the rank is two and one of the dimensions is <= 1  */
     if (!(matvar->rank == 2 && (matvar->dims[0] <= 1 || matvar->dims[1] <= 1))) {
+        /* The 'dim' attribute is an integer vector */
+        for (int j=0;j<matvar->rank;j++) {
+            if (matvar->dims[j] > INT_MAX)
+                return 1;
+        }
+
         PROTECT(dim = Rf_allocVector(INTSXP, matvar->rank));
         for (size_t j=0;j<matvar->rank;j++)
             INTEGER(dim)[j] = matvar->dims[j];
@@ -1901,17 +2762,33 @@ read_mat_char(SEXP list,
     case MAT_T_UINT8:
     case MAT_T_UNKNOWN:
     {
-        char *buf = malloc((matvar->dims[1]+1)*sizeof(char));
+        /* The matrix is stored by column, so a block of rows is
+         * gathered into a buffer one column after the other, to read
+         * each column of the block contiguously. The strings are then
+         * made from the rows of the buffer. */
+        const char *data = matvar->data;
+        size_t nrow = matvar->dims[0], ncol = matvar->dims[1];
+        char *buf = malloc(RMATIO_CHAR_BLOCK*ncol + 1);
         if (NULL == buf) {
             UNPROTECT(1);
             return 1;
         }
 
-        for (size_t i=0;i<matvar->dims[0];i++) {
-            for (size_t j=0;j<matvar->dims[1];j++)
-                buf[j] = ((char*)matvar->data)[matvar->dims[0]*j + i];
-            buf[matvar->dims[1]] = 0;
-            SET_STRING_ELT(c, i, Rf_mkChar(buf));
+        for (size_t i0=0;i0<nrow;i0+=RMATIO_CHAR_BLOCK) {
+            size_t n = nrow - i0;
+            if (n > RMATIO_CHAR_BLOCK)
+                n = RMATIO_CHAR_BLOCK;
+            for (size_t j=0;j<ncol;j++) {
+                const char *col = data + nrow*j + i0;
+                for (size_t i=0;i<n;i++)
+                    buf[ncol*i + j] = col[i];
+            }
+            for (size_t i=0;i<n;i++) {
+                const char *row = buf + ncol*i;
+                SET_STRING_ELT(c, i0 + i,
+                               Rf_mkCharLenCE(row, strnlen(row, ncol),
+                                              CE_NATIVE));
+            }
         }
         free(buf);
         break;
@@ -2186,12 +3063,15 @@ read_mat_complex(SEXP list,
  * @param list The list to hold the read data
  * @param index The position in the list where to store the read data
  * @param matvar MAT variable pointer
+ * @param flags Flags controlling the conversion to R objects, see
+ * RMATIO_READ_INT64.
  * @return 0 on succes or 1 on failure.
  */
 static int
 read_mat_data(SEXP list,
               int index,
-              matvar_t *matvar)
+              matvar_t *matvar,
+              int flags)
 {
     SEXP m;
     size_t len;
@@ -2203,6 +3083,9 @@ read_mat_data(SEXP list,
         || matvar->isComplex)
         return 1;
 
+    if ((flags & RMATIO_READ_PRESERVE_TYPES) && NILSXP != narrow_type(matvar))
+        return read_narrow(list, index, matvar);
+
     len = matvar->dims[0];
     for (size_t j=1;j<matvar->rank;j++)
         len *= matvar->dims[j];
@@ -2222,8 +3105,13 @@ read_mat_data(SEXP list,
 
     case MAT_T_INT64:
         PROTECT(m = Rf_allocVector(REALSXP, len));
-        for (size_t j=0;j<len;j++)
-            REAL(m)[j] = ((mat_int64_t*)matvar->data)[j];
+        if (flags & RMATIO_READ_INT64) {
+            memcpy(REAL(m), matvar->data, len * sizeof(mat_int64_t));
+            Rf_setAttrib(m, R_ClassSymbol, Rf_mkString("integer64"));
+        } else {
+            for (size_t j=0;j<len;j++)
+                REAL(m)[j] = ((mat_int64_t*)matvar->data)[j];
+        }
         break;
 
     case MAT_T_INT32:
@@ -2246,8 +3134,25 @@ read_mat_data(SEXP list,
 
     case MAT_T_UINT64:
         PROTECT(m = Rf_allocVector(REALSXP, len));
-        for (size_t j=0;j<len;j++)
-            REAL(m)[j] = ((mat_uint64_t*)matvar->data)[j];
+        if (flags & RMATIO_READ_INT64) {
+            /* Values that do not fit in an integer64 are NA, which
+             * is the smallest integer64. */
+            size_t n_na = 0;
+            memcpy(REAL(m), matvar->data, len * sizeof(mat_uint64_t));
+            for (size_t j=0;j<len;j++) {
+                if (((mat_uint64_t*)matvar->data)[j] > INT64_MAX) {
+                    ((mat_int64_t*)REAL(m))[j] = INT64_MIN;
+                    n_na++;
+                }
+            }
+            Rf_setAttrib(m, R_ClassSymbol, Rf_mkString("integer64"));
+            if (n_na)
+                Rf_warning("uint64 values larger than 2^63-1 read as NA: %s",
+                           matvar->name == NULL ? "" : matvar->name);
+        } else {
+            for (size_t j=0;j<len;j++)
+                REAL(m)[j] = ((mat_uint64_t*)matvar->data)[j];
+        }
         break;
 
     case MAT_T_UINT32:
@@ -2290,12 +3195,15 @@ read_mat_data(SEXP list,
  * @param list The list to hold the read data
  * @param index The position in the list where to store the read data
  * @param matvar MAT variable pointer
+ * @param flags Flags controlling the conversion to R objects, see
+ * RMATIO_READ_INT64.
  * @return 0 on succes or 1 on failure.
  */
 static int
 read_logical(SEXP list,
              int index,
-             matvar_t *matvar)
+             matvar_t *matvar,
+             int flags)
 {
     SEXP m;
     size_t len;
@@ -2308,6 +3216,9 @@ read_logical(SEXP list,
         || MAT_T_UINT8 != matvar->data_type)
         return 1;
 
+    if ((flags & RMATIO_READ_PRESERVE_TYPES) && NILSXP != narrow_type(matvar))
+        return read_narrow(list, index, matvar);
+
     len = matvar->dims[0];
     for (size_t j=1;j<matvar->rank;j++)
         len *= matvar->dims[j];
@@ -2522,12 +3433,15 @@ cleanup:
  * @param list The list to hold the read data
  * @param index The position in the list where to store the read data
  * @param matvar MAT variable pointer
+ * @param flags Flags controlling the conversion to R objects, see
+ * RMATIO_READ_INT64.
  * @return 0 on succes or 1 on failure.
  */
 static int
 read_structure_array_with_fields(SEXP list,
                                  int index,
-                                 matvar_t *matvar)
+                                 matvar_t *matvar,
+                                 int flags)
 {
     SEXP names;
     SEXP struc;
@@ -2608,11 +3522,11 @@ read_structure_array_with_fields(SEXP list,
             case MAT_C_UINT16:
             case MAT_C_UINT8:
                 if (field->isLogical)
-                    err = read_logical(s, j, field);
+                    err = read_logical(s, j, field, flags);
                 else if (field->isComplex)
                     err = read_mat_complex(s, j, field);
                 else
-                    err = read_mat_data(s, j, field);
+                    err = read_mat_data(s, j, field, flags);
                 break;
 
             case MAT_C_SPARSE:
@@ -2644,11 +3558,11 @@ read_structure_array_with_fields(SEXP list,
                 break;
 
             case MAT_C_CELL:
-                err = read_mat_cell(struc, i, field);
+                err = read_mat_cell(struc, i, field, flags);
                 break;
 
             case MAT_C_STRUCT:
-                err = read_mat_struct(struc, i, field);
+                err = read_mat_struct(struc, i, field, flags);
                 break;
 
             case MAT_C_EMPTY:
@@ -2687,119 +3601,467 @@ cleanup:
     return err;
 }
 
-/** @brief Read struct
+/** @brief Make a CHARSXP from the characters of a string
  *
+ * A small cache of the CHARSXPs made, indexed by a hash of the
+ * characters, returns the CHARSXP of a repeated string, e.g. a
+ * categorical label, without looking it up in the global CHARSXP
+ * cache of R again.
  *
  * @ingroup rmatio
- * @param list The list to hold the read data
- * @param index The position in the list where to store the read data
- * @param matvar MAT variable pointer
- * @return 0 on succes or 1 on failure.
+ * @param cache The cache of RMATIO_CELLSTR_CACHE CHARSXPs
+ * @param chars The characters of the string
+ * @param nchar The number of characters
+ * @return the CHARSXP.
  */
-static int
-read_mat_struct(SEXP list,
-                int index,
-                matvar_t *matvar)
+static SEXP
+cached_mkchar(SEXP *cache, const char *chars, size_t nchar)
 {
-    if (NULL == matvar
-        || MAT_C_STRUCT != matvar->class_type
-        || 2 != matvar->rank
-        || NULL == matvar->dims)
-        return 1;
-
-    if (Mat_VarGetNumberOfFields(matvar)) {
-        if (matvar->dims[0] == 0 && matvar->dims[1] == 1) {
-            return read_empty_structure_array_with_fields(list,
-                                                          index,
-                                                          matvar);
-        } else if (matvar->dims[0] && matvar->dims[1]) {
-            matvar_t *field = Mat_VarGetStructFieldByIndex(matvar, 0, 0);
-            if (field == NULL)
-                return 1;
+    unsigned int hash = 2166136261u;
+    SEXP elmt;
 
-            if (!field->dims[0])
-                return read_structure_array_with_empty_fields(list,
-                                                              index,
-                                                              matvar);
-            else
-                return read_structure_array_with_fields(list,
-                                                        index,
-                                                        matvar);
-        }
-    } else if (matvar->dims[0] == 1 && matvar->dims[1] == 1) {
-        return read_empty_structure_array(list, index, matvar);
+    for (size_t j=0;j<nchar;j++) {
+        hash ^= (unsigned char)chars[j];
+        hash *= 16777619u;
+    }
+    hash %= RMATIO_CELLSTR_CACHE;
+
+    elmt = cache[hash];
+    if (NULL == elmt
+        || (size_t)LENGTH(elmt) != nchar
+        || memcmp(CHAR(elmt), chars, nchar)) {
+        elmt = Rf_mkCharLenCE(chars, nchar, CE_NATIVE);
+        cache[hash] = elmt;
     }
 
-    return 1;
+    return elmt;
 }
 
-/*
- * -------------------------------------------------------------
- *   Read cell arrays
- * -------------------------------------------------------------
- */
-
-/** @brief Read empty cell array
+/** @brief Find the type of a data.frame column for a field
  *
+ * A field can be read as a column of a data.frame if it holds a real
+ * scalar of the same class in every element of the structure array,
+ * or a character array with at most one row in every element.
  *
  * @ingroup rmatio
- * @param list The list to hold the read data
- * @param index The position in the list where to store the read data
- * @param matvar MAT variable pointer
- * @return 0 on succes or 1 on failure.
+ * @param matvar MAT variable pointer to the structure array
+ * @param field_index The index of the field
+ * @param len The number of elements of the structure array
+ * @return STRSXP, LGLSXP, INTSXP or REALSXP, or NILSXP if the field
+ * can not be read as a column.
  */
-static int
-read_empty_cell_array(SEXP list,
-                      int index,
-                      matvar_t *matvar)
+static SEXPTYPE
+data_frame_column_type(matvar_t *matvar, size_t field_index, size_t len)
 {
-    SEXP cell;
+    matvar_t *first = Mat_VarGetStructFieldByIndex(matvar, field_index, 0);
+    SEXPTYPE type;
 
-    if (NULL == matvar
-        || MAT_C_CELL != matvar->class_type
-        || MAT_T_CELL != matvar->data_type
-        || 2 != matvar->rank
-        || NULL == matvar->dims
-        || 0 != matvar->dims[0])
-        return 1;
+    if (NULL == first)
+        return NILSXP;
 
-    PROTECT(cell = Rf_allocVector(VECSXP, 0));
-    SET_VECTOR_ELT(list, index, cell);
-    UNPROTECT(1);
+    switch (first->class_type) {
+    case MAT_C_CHAR:
+        type = STRSXP;
+        break;
 
-    return 0;
+    case MAT_C_DOUBLE:
+    case MAT_C_SINGLE:
+    case MAT_C_INT64:
+    case MAT_C_INT32:
+    case MAT_C_INT16:
+    case MAT_C_INT8:
+    case MAT_C_UINT64:
+    case MAT_C_UINT32:
+    case MAT_C_UINT16:
+    case MAT_C_UINT8:
+        if (first->isLogical) {
+            type = LGLSXP;
+            break;
+        }
+
+        switch (first->data_type) {
+        case MAT_T_INT32:
+        case MAT_T_INT16:
+        case MAT_T_INT8:
+        case MAT_T_UINT16:
+        case MAT_T_UINT8:
+            type = INTSXP;
+            break;
+        case MAT_T_DOUBLE:
+        case MAT_T_SINGLE:
+        case MAT_T_INT64:
+        case MAT_T_UINT64:
+        case MAT_T_UINT32:
+            type = REALSXP;
+            break;
+        default:
+            return NILSXP;
+        }
+        break;
+
+    default:
+        return NILSXP;
+    }
+
+    for (size_t j=0;j<len;j++) {
+        matvar_t *field = Mat_VarGetStructFieldByIndex(matvar, field_index, j);
+        if (NULL == field
+            || field->class_type != first->class_type
+            || field->isLogical != first->isLogical
+            || field->isComplex
+            || 2 != field->rank
+            || NULL == field->dims)
+            return NILSXP;
+
+        if (STRSXP == type) {
+            if (field->dims[0] > 1
+                || (field->dims[0] && field->dims[1] && NULL == field->data)
+                || (MAT_T_UINT8 != field->data_type
+                    && MAT_T_UNKNOWN != field->data_type))
+                return NILSXP;
+        } else if (field->data_type != first->data_type
+                   || 1 != field->dims[0]
+                   || 1 != field->dims[1]
+                   || NULL == field->data) {
+            return NILSXP;
+        }
+    }
+
+    return type;
 }
 
-/** @brief Read cell array with empty arrays
+/* Fill a column of len elements from the scalar of type T in field
+ * i of every element of the structure array matvar */
+#define RMATIO_FILL_COLUMN(ptr, matvar, i, len, T)                      \
+    for (size_t j=0;j<(len);j++)                                        \
+        (ptr)[j] = *(T*)Mat_VarGetStructFieldByIndex((matvar), (i), j)  \
+            ->data
+
+/** @brief Fill a data.frame column from a field
  *
  *
  * @ingroup rmatio
- * @param list The list to hold the read data
- * @param index The position in the list where to store the read data
- * @param matvar MAT variable pointer
+ * @param col The column to fill, of the type given by
+ * data_frame_column_type
+ * @param matvar MAT variable pointer to the structure array
+ * @param i The index of the field
+ * @param len The number of elements of the structure array
+ * @param flags Flags controlling the conversion to R objects, see
+ * RMATIO_READ_INT64.
  * @return 0 on succes or 1 on failure.
  */
 static int
-read_cell_array_with_empty_arrays(SEXP list,
-                                  int index,
-                                  matvar_t *matvar)
+read_data_frame_column(SEXP col,
+                       matvar_t *matvar,
+                       size_t i,
+                       size_t len,
+                       int flags)
 {
-    SEXP cell_array;
-    char * const * fieldnames;
-    int err = 0;
-    int protected = 0;
+    matvar_t *first = Mat_VarGetStructFieldByIndex(matvar, i, 0);
 
-    if (NULL == matvar
-        || MAT_C_CELL != matvar->class_type
-        || MAT_T_CELL != matvar->data_type
-        || 2 != matvar->rank
-        || NULL == matvar->dims
-        || 1 != matvar->dims[0]
-        || 1 > matvar->dims[1])
-        return 1;
+    switch (TYPEOF(col)) {
+    case STRSXP:
+    {
+        SEXP cache[RMATIO_CELLSTR_CACHE] = {NULL};
 
-    PROTECT(cell_array = Rf_allocVector(VECSXP, matvar->dims[1]));
-    protected++;
+        for (size_t j=0;j<len;j++) {
+            matvar_t *field = Mat_VarGetStructFieldByIndex(matvar, i, j);
+            const char *chars = "";
+            size_t nchar = 0;
+
+            if (field->dims[0] && field->dims[1]) {
+                chars = (const char*)field->data;
+                nchar = strnlen(chars, field->dims[1]);
+            }
+            SET_STRING_ELT(col, j, cached_mkchar(cache, chars, nchar));
+        }
+        break;
+    }
+
+    case LGLSXP:
+        for (size_t j=0;j<len;j++) {
+            matvar_t *field = Mat_VarGetStructFieldByIndex(matvar, i, j);
+            LOGICAL(col)[j] = (0 != *(mat_uint8_t*)field->data);
+        }
+        break;
+
+    case INTSXP:
+        switch (first->data_type) {
+        case MAT_T_INT32:
+            RMATIO_FILL_COLUMN(INTEGER(col), matvar, i, len, mat_int32_t);
+            break;
+        case MAT_T_INT16:
+            RMATIO_FILL_COLUMN(INTEGER(col), matvar, i, len, mat_int16_t);
+            break;
+        case MAT_T_INT8:
+            RMATIO_FILL_COLUMN(INTEGER(col), matvar, i, len, mat_int8_t);
+            break;
+        case MAT_T_UINT16:
+            RMATIO_FILL_COLUMN(INTEGER(col), matvar, i, len, mat_uint16_t);
+            break;
+        case MAT_T_UINT8:
+            RMATIO_FILL_COLUMN(INTEGER(col), matvar, i, len, mat_uint8_t);
+            break;
+        default:
+            return 1;
+        }
+        break;
+
+    case REALSXP:
+        switch (first->data_type) {
+        case MAT_T_DOUBLE:
+            RMATIO_FILL_COLUMN(REAL(col), matvar, i, len, double);
+            break;
+        case MAT_T_SINGLE:
+            RMATIO_FILL_COLUMN(REAL(col), matvar, i, len, float);
+            break;
+        case MAT_T_UINT32:
+            RMATIO_FILL_COLUMN(REAL(col), matvar, i, len, mat_uint32_t);
+            break;
+        case MAT_T_INT64:
+            if (flags & RMATIO_READ_INT64) {
+                RMATIO_FILL_COLUMN((mat_int64_t*)REAL(col), matvar, i, len,
+                                   mat_int64_t);
+                Rf_setAttrib(col, R_ClassSymbol, Rf_mkString("integer64"));
+            } else {
+                RMATIO_FILL_COLUMN(REAL(col), matvar, i, len, mat_int64_t);
+            }
+            break;
+        case MAT_T_UINT64:
+            if (flags & RMATIO_READ_INT64) {
+                /* Values that do not fit in an integer64 are NA, as
+                 * in read_mat_data. */
+                size_t n_na = 0;
+                for (size_t j=0;j<len;j++) {
+                    matvar_t *field = Mat_VarGetStructFieldByIndex(matvar, i, j);
+                    mat_uint64_t value = *(mat_uint64_t*)field->data;
+                    if (value > INT64_MAX) {
+                        ((mat_int64_t*)REAL(col))[j] = INT64_MIN;
+                        n_na++;
+                    } else {
+                        ((mat_int64_t*)REAL(col))[j] = value;
+                    }
+                }
+                Rf_setAttrib(col, R_ClassSymbol, Rf_mkString("integer64"));
+                if (n_na)
+                    Rf_warning("uint64 values larger than 2^63-1 read as NA: %s",
+                               first->name == NULL ? "" : first->name);
+            } else {
+                RMATIO_FILL_COLUMN(REAL(col), matvar, i, len, mat_uint64_t);
+            }
+            break;
+        default:
+            return 1;
+        }
+        break;
+
+    default:
+        return 1;
+    }
+
+    return 0;
+}
+
+#undef RMATIO_FILL_COLUMN
+
+/** @brief Read a structure array of scalars as a data.frame
+ *
+ * A structure array with one row or one column, where every field
+ * holds a real scalar or a string in each element, e.g. a table
+ * exported from Matlab with table2struct, is read column by column
+ * into a data.frame with one atomic vector per field, instead of a
+ * list with one vector of length one per element and field. The
+ * type of each field is checked once, and the column is then filled
+ * from the elements in one loop. Narrow types are widened as usual,
+ * also with RMATIO_READ_PRESERVE_TYPES.
+ *
+ * @ingroup rmatio
+ * @param list The list to hold the read data
+ * @param index The position in the list where to store the read data
+ * @param matvar MAT variable pointer
+ * @param flags Flags controlling the conversion to R objects, see
+ * RMATIO_READ_INT64.
+ * @return 0 on succes, 1 on failure, or -1 if the structure array
+ * is not a structure array of scalars and was not read.
+ */
+static int
+read_structure_array_as_data_frame(SEXP list,
+                                   int index,
+                                   matvar_t *matvar,
+                                   int flags)
+{
+    SEXP df, names, row_names;
+    char * const * fieldnames;
+    size_t nfields, len;
+
+    if (2 != matvar->rank || (1 != matvar->dims[0] && 1 != matvar->dims[1]))
+        return -1;
+    len = matvar->dims[0] * matvar->dims[1];
+    nfields = Mat_VarGetNumberOfFields(matvar);
+    if (!len || len > INT_MAX || !nfields)
+        return -1;
+
+    fieldnames = Mat_VarGetStructFieldnames(matvar);
+    PROTECT(df = Rf_allocVector(VECSXP, nfields));
+    PROTECT(names = Rf_allocVector(STRSXP, nfields));
+
+    for (size_t i=0;i<nfields;i++) {
+        SEXPTYPE type = data_frame_column_type(matvar, i, len);
+        SEXP col;
+
+        if (NILSXP == type) {
+            UNPROTECT(2);
+            return -1;
+        }
+
+        if (fieldnames[i])
+            SET_STRING_ELT(names, i, Rf_mkChar(fieldnames[i]));
+
+        PROTECT(col = Rf_allocVector(type, len));
+        if (read_data_frame_column(col, matvar, i, len, flags)) {
+            UNPROTECT(3);
+            return 1;
+        }
+        SET_VECTOR_ELT(df, i, col);
+        UNPROTECT(1);
+    }
+
+    /* Compact row names c(NA, -len) */
+    PROTECT(row_names = Rf_allocVector(INTSXP, 2));
+    INTEGER(row_names)[0] = NA_INTEGER;
+    INTEGER(row_names)[1] = -(int)len;
+    Rf_setAttrib(df, R_NamesSymbol, names);
+    Rf_setAttrib(df, R_RowNamesSymbol, row_names);
+    Rf_setAttrib(df, R_ClassSymbol, Rf_mkString("data.frame"));
+    SET_VECTOR_ELT(list, index, df);
+    UNPROTECT(3);
+
+    return 0;
+}
+
+/** @brief Read struct
+ *
+ *
+ * @ingroup rmatio
+ * @param list The list to hold the read data
+ * @param index The position in the list where to store the read data
+ * @param matvar MAT variable pointer
+ * @param flags Flags controlling the conversion to R objects, see
+ * RMATIO_READ_INT64.
+ * @return 0 on succes or 1 on failure.
+ */
+static int
+read_mat_struct(SEXP list,
+                int index,
+                matvar_t *matvar,
+                int flags)
+{
+    if (NULL == matvar
+        || MAT_C_STRUCT != matvar->class_type
+        || 2 != matvar->rank
+        || NULL == matvar->dims)
+        return 1;
+
+    if (Mat_VarGetNumberOfFields(matvar)) {
+        if ((flags & RMATIO_READ_DATA_FRAME)
+            && 0 == read_structure_array_as_data_frame(list,
+                                                       index,
+                                                       matvar,
+                                                       flags))
+            return 0;
+
+        if (matvar->dims[0] == 0 && matvar->dims[1] == 1) {
+            return read_empty_structure_array_with_fields(list,
+                                                          index,
+                                                          matvar);
+        } else if (matvar->dims[0] && matvar->dims[1]) {
+            matvar_t *field = Mat_VarGetStructFieldByIndex(matvar, 0, 0);
+            if (field == NULL)
+                return 1;
+
+            if (!field->dims[0])
+                return read_structure_array_with_empty_fields(list,
+                                                              index,
+                                                              matvar);
+            else
+                return read_structure_array_with_fields(list,
+                                                        index,
+                                                        matvar, flags);
+        }
+    } else if (matvar->dims[0] == 1 && matvar->dims[1] == 1) {
+        return read_empty_structure_array(list, index, matvar);
+    }
+
+    return 1;
+}
+
+/*
+ * -------------------------------------------------------------
+ *   Read cell arrays
+ * -------------------------------------------------------------
+ */
+
+/** @brief Read empty cell array
+ *
+ *
+ * @ingroup rmatio
+ * @param list The list to hold the read data
+ * @param index The position in the list where to store the read data
+ * @param matvar MAT variable pointer
+ * @return 0 on succes or 1 on failure.
+ */
+static int
+read_empty_cell_array(SEXP list,
+                      int index,
+                      matvar_t *matvar)
+{
+    SEXP cell;
+
+    if (NULL == matvar
+        || MAT_C_CELL != matvar->class_type
+        || MAT_T_CELL != matvar->data_type
+        || 2 != matvar->rank
+        || NULL == matvar->dims
+        || 0 != matvar->dims[0])
+        return 1;
+
+    PROTECT(cell = Rf_allocVector(VECSXP, 0));
+    SET_VECTOR_ELT(list, index, cell);
+    UNPROTECT(1);
+
+    return 0;
+}
+
+/** @brief Read cell array with empty arrays
+ *
+ *
+ * @ingroup rmatio
+ * @param list The list to hold the read data
+ * @param index The position in the list where to store the read data
+ * @param matvar MAT variable pointer
+ * @return 0 on succes or 1 on failure.
+ */
+static int
+read_cell_array_with_empty_arrays(SEXP list,
+                                  int index,
+                                  matvar_t *matvar)
+{
+    SEXP cell_array;
+    char * const * fieldnames;
+    int err = 0;
+    int protected = 0;
+
+    if (NULL == matvar
+        || MAT_C_CELL != matvar->class_type
+        || MAT_T_CELL != matvar->data_type
+        || 2 != matvar->rank
+        || NULL == matvar->dims
+        || 1 != matvar->dims[0]
+        || 1 > matvar->dims[1])
+        return 1;
+
+    PROTECT(cell_array = Rf_allocVector(VECSXP, matvar->dims[1]));
+    protected++;
 
     for (size_t i=0;i<matvar->dims[1];i++) {
         SEXP cell_item;
@@ -2959,12 +4221,15 @@ cleanup:
  * @param list The list to hold the read data
  * @param index The position in the list where to store the read data
  * @param matvar MAT variable pointer
+ * @param flags Flags controlling the conversion to R objects, see
+ * RMATIO_READ_INT64.
  * @return 0 on succes or 1 on failure.
  */
 static int
 read_cell_array_with_arrays(SEXP list,
                             int index,
-                            matvar_t *matvar)
+                            matvar_t *matvar,
+                            int flags)
 {
     SEXP cell;
     int err = 0;
@@ -3003,18 +4268,18 @@ read_cell_array_with_arrays(SEXP list,
             case MAT_C_UINT8:
                 if (Rf_isNull(cell_row)) {
                     if (mat_cell->isLogical)
-                        err = read_logical(cell, i, mat_cell);
+                        err = read_logical(cell, i, mat_cell, flags);
                     else if (mat_cell->isComplex)
                         err = read_mat_complex(cell, i, mat_cell);
                     else
-                        err = read_mat_data(cell, i, mat_cell);
+                        err = read_mat_data(cell, i, mat_cell, flags);
                 } else {
                     if (mat_cell->isLogical)
-                        err = read_logical(cell_row, j, mat_cell);
+                        err = read_logical(cell_row, j, mat_cell, flags);
                     else if (mat_cell->isComplex)
                         err = read_mat_complex(cell_row, j, mat_cell);
                     else
-                        err = read_mat_data(cell_row, j, mat_cell);
+                        err = read_mat_data(cell_row, j, mat_cell, flags);
                 }
                 break;
 
@@ -3034,16 +4299,16 @@ read_cell_array_with_arrays(SEXP list,
 
             case MAT_C_STRUCT:
                 if (Rf_isNull(cell_row))
-                    err = read_mat_struct(cell, i, mat_cell);
+                    err = read_mat_struct(cell, i, mat_cell, flags);
                 else
-                    err = read_mat_struct(cell_row, j, mat_cell);
+                    err = read_mat_struct(cell_row, j, mat_cell, flags);
                 break;
 
             case MAT_C_CELL:
                 if (Rf_isNull(cell_row))
-                    err = read_mat_cell(cell, i, mat_cell);
+                    err = read_mat_cell(cell, i, mat_cell, flags);
                 else
-                    err = read_mat_cell(cell_row, j, mat_cell);
+                    err = read_mat_cell(cell_row, j, mat_cell, flags);
                 break;
 
             default:
@@ -3071,79 +4336,1551 @@ cleanup:
     return err;
 }
 
-/** @brief Read cell
+/** @brief Read a cell array of strings as a character vector
  *
+ * A cell array with one row or one column, where every cell is a
+ * character array with at most one row, is read directly into a
+ * character vector, instead of a list of character vectors of length
+ * one. The characters of a cell with one row are contiguous, so the
+ * CHARSXP is made from the data of the cell without a copy, see
+ * cached_mkchar.
  *
  * @ingroup rmatio
  * @param list The list to hold the read data
  * @param index The position in the list where to store the read data
  * @param matvar MAT variable pointer
- * @return 0 on succes or 1 on failure.
+ * @return 0 on succes, or -1 if the cell array is not a cell array
+ * of strings and was not read.
  */
 static int
-read_mat_cell(SEXP list,
-              int index,
-              matvar_t *matvar)
+read_cellstr(SEXP list,
+             int index,
+             matvar_t *matvar)
 {
-    if (NULL == matvar
-        || MAT_C_CELL != matvar->class_type
-        || MAT_T_CELL != matvar->data_type
-        || NULL == matvar->dims)
-        return 1;
+    SEXP c, cache[RMATIO_CELLSTR_CACHE] = {NULL};
+    size_t len;
 
-    if (0 == matvar->dims[0]) {
-        return read_empty_cell_array(list, index, matvar);
-    } else if (matvar->dims[0] && matvar->dims[1]) {
-        matvar_t *cell = Mat_VarGetCell(matvar, 0);
+    if (2 != matvar->rank || (1 != matvar->dims[0] && 1 != matvar->dims[1]))
+        return -1;
+    len = matvar->dims[0] * matvar->dims[1];
 
-        if (NULL == cell || NULL == cell->dims)
-            return 1;
+    for (size_t i=0;i<len;i++) {
+        matvar_t *cell = Mat_VarGetCell(matvar, i);
+        if (NULL == cell
+            || MAT_C_CHAR != cell->class_type
+            || 2 != cell->rank
+            || NULL == cell->dims
+            || cell->dims[0] > 1
+            || (cell->dims[0] && cell->dims[1] && NULL == cell->data)
+            || cell->isComplex
+            || (MAT_T_UINT8 != cell->data_type
+                && MAT_T_UNKNOWN != cell->data_type))
+            return -1;
+    }
 
-        if (MAT_C_CELL == cell->class_type
-            && 0 == cell->dims[0]
-            && 1 == cell->dims[1]) {
-            return read_cell_array_with_empty_arrays(list, index, matvar);
-        } else if (MAT_C_STRUCT == cell->class_type
-                   && 1 == cell->dims[0]
-                   && 1 == cell->dims[1]) {
+    PROTECT(c = Rf_allocVector(STRSXP, len));
+    for (size_t i=0;i<len;i++) {
+        matvar_t *cell = Mat_VarGetCell(matvar, i);
+        const char *chars = "";
+        size_t nchar = 0;
 
-            if(Mat_VarGetNumberOfFields(cell))
-                return read_cell_array_with_arrays(list, index, matvar);
-            else
-                return read_cell_array_with_empty_arrays(list, index, matvar);
-        } else if (cell->dims[0] && cell->dims[1]) {
-            return read_cell_array_with_arrays(list, index, matvar);
-        } else {
-            return read_cell_array_with_empty_arrays(list, index, matvar);
+        /* The data of an empty cell can be NULL */
+        if (cell->dims[0] && cell->dims[1]) {
+            chars = (const char*)cell->data;
+            nchar = strnlen(chars, cell->dims[1]);
         }
+        SET_STRING_ELT(c, i, cached_mkchar(cache, chars, nchar));
     }
 
-    return 1;
+    SET_VECTOR_ELT(list, index, c);
+    UNPROTECT(1);
+
+    return 0;
 }
 
-/*
- * -------------------------------------------------------------
- *   Functions to interface R
- * -------------------------------------------------------------
- */
+/* Convert the len elements of type T at data to the slice of the
+ * stacked array at ptr */
+#define RMATIO_STACK_CELL(ptr, data, len, T)                            \
+    for (size_t j=0;j<(len);j++)                                        \
+        (ptr)[j] = ((T*)(data))[j]
 
-/** @brief Number of variables in MAT-file
+/** @brief Read a cell array of equal numeric arrays as one array
  *
+ * A cell array with one row or one column, where every cell is a
+ * real numeric or logical array of the same class and dimensions,
+ * e.g. one trajectory per trial, is read into one array with the
+ * cells along the last dimension, instead of a list with one array
+ * per cell. The cells have already been read by matio, so this only
+ * saves the R vector of each cell: the array is allocated once and
+ * the data of each cell is converted into its slice of the array.
+ * Vector cells, as in set_dim, become the columns of a matrix and
+ * scalar cells the elements of a vector. Cells with more than INT_MAX
+ * rows in the matrix are read as a list. Narrow types are widened,
+ * also with RMATIO_READ_PRESERVE_TYPES.
  *
  * @ingroup rmatio
- * @param mat MAT file pointer
- * @return 0 on succes or 1 on failure.
+ * @param list The list to hold the read data
+ * @param index The position in the list where to store the read data
+ * @param matvar MAT variable pointer
+ * @param flags Flags controlling the conversion to R objects, see
+ * RMATIO_READ_INT64.
+ * @return 0 on succes, or -1 if the cells are not equal numeric
+ * arrays and were not read.
  */
 static int
-number_of_variables(mat_t *mat)
+read_stacked_cells(SEXP list,
+                   int index,
+                   matvar_t *matvar,
+                   int flags)
 {
-    int len=0;
-    matvar_t *matvar;
+    SEXP m, dim;
+    SEXPTYPE type;
+    matvar_t *first;
+    size_t ncells, len = 1, rank, n_na = 0;
+
+    if (2 != matvar->rank || (1 != matvar->dims[0] && 1 != matvar->dims[1]))
+        return -1;
+    ncells = matvar->dims[0] * matvar->dims[1];
+    if (ncells > INT_MAX)
+        return -1;
+
+    first = Mat_VarGetCell(matvar, 0);
+    if (NULL == first
+        || NULL == first->dims
+        || NULL == first->data
+        || first->isComplex)
+        return -1;
+
+    switch (first->class_type) {
+    case MAT_C_DOUBLE:
+    case MAT_C_SINGLE:
+    case MAT_C_INT64:
+    case MAT_C_INT32:
+    case MAT_C_INT16:
+    case MAT_C_INT8:
+    case MAT_C_UINT64:
+    case MAT_C_UINT32:
+    case MAT_C_UINT16:
+    case MAT_C_UINT8:
+        break;
+    default:
+        return -1;
+    }
 
-    if (mat != NULL) {
-        if (!Mat_Rewind(mat)) {
-            while ((matvar = Mat_VarReadNextInfo(mat)) != NULL) {
-                len++;
+    if (first->isLogical) {
+        if (MAT_T_UINT8 != first->data_type)
+            return -1;
+        type = LGLSXP;
+    } else {
+        switch (first->data_type) {
+        case MAT_T_INT32:
+        case MAT_T_INT16:
+        case MAT_T_INT8:
+        case MAT_T_UINT16:
+        case MAT_T_UINT8:
+            type = INTSXP;
+            break;
+        case MAT_T_DOUBLE:
+        case MAT_T_SINGLE:
+        case MAT_T_INT64:
+        case MAT_T_UINT64:
+        case MAT_T_UINT32:
+            type = REALSXP;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    for (int i=0;i<first->rank;i++) {
+        if (first->dims[i] > INT_MAX)
+            return -1;
+        len *= first->dims[i];
+    }
+    if (!len)
+        return -1;
+
+    /* The dimensions of a cell as in set_dim, followed by the
+     * number of cells. A vector cell is one column of the matrix. */
+    rank = first->rank;
+    if (2 == rank && (first->dims[0] <= 1 || first->dims[1] <= 1))
+        rank = len > 1;
+    if (1 == rank && len > INT_MAX)
+        return -1;
+
+    for (size_t k=1;k<ncells;k++) {
+        matvar_t *cell = Mat_VarGetCell(matvar, k);
+        if (NULL == cell
+            || NULL == cell->dims
+            || NULL == cell->data
+            || cell->class_type != first->class_type
+            || cell->data_type != first->data_type
+            || cell->isLogical != first->isLogical
+            || cell->isComplex
+            || cell->rank != first->rank
+            || memcmp(cell->dims, first->dims, first->rank*sizeof(size_t)))
+            return -1;
+    }
+
+    PROTECT(m = Rf_allocVector(type, len * ncells));
+    for (size_t k=0;k<ncells;k++) {
+        matvar_t *cell = Mat_VarGetCell(matvar, k);
+
+        switch (type) {
+        case LGLSXP:
+        {
+            int *ptr = LOGICAL(m) + k*len;
+            for (size_t j=0;j<len;j++)
+                ptr[j] = (0 != ((mat_uint8_t*)cell->data)[j]);
+            break;
+        }
+
+        case INTSXP:
+        {
+            int *ptr = INTEGER(m) + k*len;
+            switch (cell->data_type) {
+            case MAT_T_INT32:
+                memcpy(ptr, cell->data, len*sizeof(int));
+                break;
+            case MAT_T_INT16:
+                RMATIO_STACK_CELL(ptr, cell->data, len, mat_int16_t);
+                break;
+            case MAT_T_INT8:
+                RMATIO_STACK_CELL(ptr, cell->data, len, mat_int8_t);
+                break;
+            case MAT_T_UINT16:
+                RMATIO_STACK_CELL(ptr, cell->data, len, mat_uint16_t);
+                break;
+            default:
+                RMATIO_STACK_CELL(ptr, cell->data, len, mat_uint8_t);
+                break;
+            }
+            break;
+        }
+
+        default:
+        {
+            double *ptr = REAL(m) + k*len;
+            switch (cell->data_type) {
+            case MAT_T_DOUBLE:
+                memcpy(ptr, cell->data, len*sizeof(double));
+                break;
+            case MAT_T_SINGLE:
+                RMATIO_STACK_CELL(ptr, cell->data, len, float);
+                break;
+            case MAT_T_UINT32:
+                RMATIO_STACK_CELL(ptr, cell->data, len, mat_uint32_t);
+                break;
+            case MAT_T_INT64:
+                if (flags & RMATIO_READ_INT64)
+                    memcpy(ptr, cell->data, len*sizeof(mat_int64_t));
+                else
+                    RMATIO_STACK_CELL(ptr, cell->data, len, mat_int64_t);
+                break;
+            default:
+                if (flags & RMATIO_READ_INT64) {
+                    /* Values that do not fit in an integer64 are NA,
+                     * as in read_mat_data. */
+                    mat_int64_t *ptr64 = (mat_int64_t*)ptr;
+                    for (size_t j=0;j<len;j++) {
+                        mat_uint64_t value = ((mat_uint64_t*)cell->data)[j];
+                        if (value > INT64_MAX) {
+                            ptr64[j] = INT64_MIN;
+                            n_na++;
+                        } else {
+                            ptr64[j] = value;
+                        }
+                    }
+                } else {
+                    RMATIO_STACK_CELL(ptr, cell->data, len, mat_uint64_t);
+                }
+                break;
+            }
+            break;
+        }
+        }
+    }
+
+    if ((flags & RMATIO_READ_INT64)
+        && (MAT_T_INT64 == first->data_type
+            || MAT_T_UINT64 == first->data_type))
+        Rf_setAttrib(m, R_ClassSymbol, Rf_mkString("integer64"));
+    if (n_na)
+        Rf_warning("uint64 values larger than 2^63-1 read as NA: %s",
+                   matvar->name == NULL ? "" : matvar->name);
+
+    if (rank) {
+        PROTECT(dim = Rf_allocVector(INTSXP, rank + 1));
+        if (1 == rank) {
+            INTEGER(dim)[0] = len;
+        } else {
+            for (size_t i=0;i<rank;i++)
+                INTEGER(dim)[i] = first->dims[i];
+        }
+        INTEGER(dim)[rank] = ncells;
+        Rf_setAttrib(m, R_DimSymbol, dim);
+        UNPROTECT(1);
+    }
+
+    SET_VECTOR_ELT(list, index, m);
+    UNPROTECT(1);
+
+    return 0;
+}
+
+#undef RMATIO_STACK_CELL
+
+/** @brief Read cell
+ *
+ *
+ * @ingroup rmatio
+ * @param list The list to hold the read data
+ * @param index The position in the list where to store the read data
+ * @param matvar MAT variable pointer
+ * @param flags Flags controlling the conversion to R objects, see
+ * RMATIO_READ_INT64.
+ * @return 0 on succes or 1 on failure.
+ */
+static int
+read_mat_cell(SEXP list,
+              int index,
+              matvar_t *matvar,
+              int flags)
+{
+    if (NULL == matvar
+        || MAT_C_CELL != matvar->class_type
+        || MAT_T_CELL != matvar->data_type
+        || NULL == matvar->dims)
+        return 1;
+
+    if (0 == matvar->dims[0]) {
+        return read_empty_cell_array(list, index, matvar);
+    } else if (matvar->dims[0] && matvar->dims[1]) {
+        matvar_t *cell = Mat_VarGetCell(matvar, 0);
+
+        if ((flags & RMATIO_READ_CELLSTR)
+            && 0 == read_cellstr(list, index, matvar))
+            return 0;
+
+        if ((flags & RMATIO_READ_STACK_CELLS)
+            && 0 == read_stacked_cells(list, index, matvar, flags))
+            return 0;
+
+        if (NULL == cell || NULL == cell->dims)
+            return 1;
+
+        if (MAT_C_CELL == cell->class_type
+            && 0 == cell->dims[0]
+            && 1 == cell->dims[1]) {
+            return read_cell_array_with_empty_arrays(list, index, matvar);
+        } else if (MAT_C_STRUCT == cell->class_type
+                   && 1 == cell->dims[0]
+                   && 1 == cell->dims[1]) {
+
+            if(Mat_VarGetNumberOfFields(cell))
+                return read_cell_array_with_arrays(list, index, matvar, flags);
+            else
+                return read_cell_array_with_empty_arrays(list, index, matvar);
+        } else if (cell->dims[0] && cell->dims[1]) {
+            return read_cell_array_with_arrays(list, index, matvar, flags);
+        } else {
+            return read_cell_array_with_empty_arrays(list, index, matvar);
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * -------------------------------------------------------------
+ *   Lazy numeric vectors
+ * -------------------------------------------------------------
+ */
+
+/** @brief Close the MAT file shared by lazy vectors
+ *
+ * A temporary file, such as a downloaded MAT file, is removed once
+ * it has been closed.
+ *
+ * @ingroup rmatio
+ * @param file External pointer to the MAT file
+ */
+static void
+lazy_file_finalizer(SEXP file)
+{
+    mat_t *mat = (mat_t*)R_ExternalPtrAddr(file);
+    SEXP filename = R_ExternalPtrTag(file);
+
+    if (mat) {
+        Mat_Close(mat);
+        R_ClearExternalPtr(file);
+        if (Rf_isString(filename))
+            remove(CHAR(STRING_ELT(filename, 0)));
+    }
+}
+
+/** @brief Create the external pointer to a MAT file shared by lazy
+ * vectors
+ *
+ * The MAT file is closed by lazy_file_finalizer when the external
+ * pointer is garbage collected. The external pointer also keeps a
+ * MAT file in a raw vector.
+ *
+ * @ingroup rmatio
+ * @param mat MAT file pointer
+ * @param filename The file, a filename or a raw vector
+ * @param temporary Remove the file when it is closed
+ * @return the external pointer, which is not protected.
+ */
+static SEXP
+lazy_file(mat_t *mat, const SEXP filename, const SEXP temporary)
+{
+    SEXP file, tag = R_NilValue;
+
+    if (Rf_isString(filename) && LOGICAL(temporary)[0])
+        tag = filename;
+    file = R_MakeExternalPtr(mat, tag, filename);
+    R_RegisterCFinalizerEx(file, lazy_file_finalizer, TRUE);
+
+    return file;
+}
+
+/** @brief Free the MAT variable information of a lazy vector
+ *
+ *
+ * @ingroup rmatio
+ * @param ptr External pointer to the MAT variable
+ */
+static void
+lazy_matvar_finalizer(SEXP ptr)
+{
+    matvar_t *matvar = (matvar_t*)R_ExternalPtrAddr(ptr);
+
+    if (matvar) {
+        Mat_VarFree(matvar);
+        R_ClearExternalPtr(ptr);
+    }
+}
+
+/** @brief The type of the vector a MAT variable is read into
+ *
+ * Same as in read_mat_data.
+ * @ingroup rmatio
+ * @param matvar MAT variable pointer
+ * @return REALSXP, INTSXP or NILSXP if the class can not be read lazily.
+ */
+static SEXPTYPE
+lazy_type(matvar_t *matvar)
+{
+    switch (matvar->class_type) {
+    case MAT_C_DOUBLE:
+    case MAT_C_SINGLE:
+    case MAT_C_INT64:
+    case MAT_C_UINT64:
+    case MAT_C_UINT32:
+        return REALSXP;
+    case MAT_C_INT32:
+    case MAT_C_INT16:
+    case MAT_C_INT8:
+    case MAT_C_UINT16:
+    case MAT_C_UINT8:
+        return INTSXP;
+    default:
+        return NILSXP;
+    }
+}
+
+/** @brief Check if a MAT variable can be read lazily
+ *
+ * The data of an uncompressed real numeric variable in a version 5
+ * MAT file is stored contiguously at a known file position and can
+ * be read in parts.
+ * @ingroup rmatio
+ * @param mat MAT file pointer
+ * @param matvar MAT variable pointer with the variable information
+ * @param flags Flags controlling the conversion to R objects. Data
+ * read as 'integer64' or without widening is not read lazily.
+ * @return 1 if the variable can be read lazily, else 0.
+ */
+static int
+lazy_candidate(mat_t *mat, matvar_t *matvar, int flags)
+{
+    size_t len;
+
+    if (MAT_FT_MAT5 != Mat_GetVersion(mat)
+        || MAT_COMPRESSION_NONE != matvar->compression
+        || matvar->isComplex
+        || matvar->isLogical
+        || NILSXP == lazy_type(matvar)
+        || ((flags & RMATIO_READ_INT64)
+            && (MAT_C_INT64 == matvar->class_type
+                || MAT_C_UINT64 == matvar->class_type))
+        || ((flags & RMATIO_READ_PRESERVE_TYPES)
+            && NILSXP != narrow_type(matvar))
+        || 2 > matvar->rank
+        || NULL == matvar->dims)
+        return 0;
+
+    len = matvar->dims[0];
+    for (int j=1;j<matvar->rank;j++)
+        len *= matvar->dims[j];
+
+    return len > 0;
+}
+
+#if defined(RMATIO_ALTREP)
+
+/** @brief Length of a lazy vector
+ *
+ *
+ * @ingroup rmatio
+ * @param x The lazy vector
+ * @return The length.
+ */
+static R_xlen_t
+lazy_length(SEXP x)
+{
+    matvar_t *matvar = (matvar_t*)R_ExternalPtrAddr(R_altrep_data1(x));
+    R_xlen_t len;
+
+    len = matvar->dims[0];
+    for (int j=1;j<matvar->rank;j++)
+        len *= matvar->dims[j];
+
+    return len;
+}
+
+/** @brief Read elements of a lazy vector from the MAT file
+ *
+ *
+ * @ingroup rmatio
+ * @param x The lazy vector
+ * @param start Index of the first element to read
+ * @param n Number of elements to read
+ * @param buf Buffer of 'n' doubles or ints, depending on the type
+ * of 'x', to store the elements in
+ */
+static void
+lazy_read(SEXP x, R_xlen_t start, R_xlen_t n, void *buf)
+{
+    SEXP ptr = R_altrep_data1(x);
+    matvar_t *matvar = (matvar_t*)R_ExternalPtrAddr(ptr);
+    mat_t *mat = (mat_t*)R_ExternalPtrAddr(R_ExternalPtrProtected(ptr));
+    const void *vmax = vmaxget();
+    void *data;
+
+    if (!matvar || !mat)
+        Rf_error("Unable to read lazy variable: the MAT file is closed.");
+    if (n <= 0)
+        return;
+
+    /* Read directly into the buffer when the types agree */
+    if (MAT_C_DOUBLE == matvar->class_type || MAT_C_INT32 == matvar->class_type)
+        data = buf;
+    else
+        data = R_alloc(n, Mat_SizeOfClass(matvar->class_type));
+
+    if (Mat_VarReadDataRange(mat, matvar, data, start, n))
+        Rf_error("Unable to read lazy variable '%s'.", matvar->name);
+
+    switch (matvar->class_type) {
+    case MAT_C_SINGLE:
+        for (R_xlen_t j=0;j<n;j++)
+            ((double*)buf)[j] = ((float*)data)[j];
+        break;
+    case MAT_C_INT64:
+        for (R_xlen_t j=0;j<n;j++)
+            ((double*)buf)[j] = ((mat_int64_t*)data)[j];
+        break;
+    case MAT_C_UINT64:
+        for (R_xlen_t j=0;j<n;j++)
+            ((double*)buf)[j] = ((mat_uint64_t*)data)[j];
+        break;
+    case MAT_C_UINT32:
+        for (R_xlen_t j=0;j<n;j++)
+            ((double*)buf)[j] = ((mat_uint32_t*)data)[j];
+        break;
+    case MAT_C_INT16:
+        for (R_xlen_t j=0;j<n;j++)
+            ((int*)buf)[j] = ((mat_int16_t*)data)[j];
+        break;
+    case MAT_C_INT8:
+        for (R_xlen_t j=0;j<n;j++)
+            ((int*)buf)[j] = ((mat_int8_t*)data)[j];
+        break;
+    case MAT_C_UINT16:
+        for (R_xlen_t j=0;j<n;j++)
+            ((int*)buf)[j] = ((mat_uint16_t*)data)[j];
+        break;
+    case MAT_C_UINT8:
+        for (R_xlen_t j=0;j<n;j++)
+            ((int*)buf)[j] = ((mat_uint8_t*)data)[j];
+        break;
+    default:
+        break;
+    }
+
+    vmaxset(vmax);
+}
+
+/** @brief Pointer to the data of a lazy vector
+ *
+ * Reads the complete vector from the MAT file the first time it is
+ * requested.
+ * @ingroup rmatio
+ * @param x The lazy vector
+ * @param writeable Unused
+ * @return Pointer to the data.
+ */
+static void*
+lazy_dataptr(SEXP x, Rboolean writeable)
+{
+    SEXP data2 = R_altrep_data2(x);
+
+    (void)writeable;
+
+    if (Rf_isNull(data2)) {
+        PROTECT(data2 = Rf_allocVector(TYPEOF(x), lazy_length(x)));
+        if (REALSXP == TYPEOF(x))
+            lazy_read(x, 0, XLENGTH(data2), REAL(data2));
+        else
+            lazy_read(x, 0, XLENGTH(data2), INTEGER(data2));
+        R_set_altrep_data2(x, data2);
+        UNPROTECT(1);
+    }
+
+    if (REALSXP == TYPEOF(data2))
+        return REAL(data2);
+    return INTEGER(data2);
+}
+
+/** @brief Pointer to the data of a lazy vector if it has been read
+ *
+ *
+ * @ingroup rmatio
+ * @param x The lazy vector
+ * @return Pointer to the data or NULL.
+ */
+static const void*
+lazy_dataptr_or_null(SEXP x)
+{
+    SEXP data2 = R_altrep_data2(x);
+
+    if (Rf_isNull(data2))
+        return NULL;
+    if (REALSXP == TYPEOF(data2))
+        return REAL(data2);
+    return INTEGER(data2);
+}
+
+/** @brief Read a region of a lazy vector
+ *
+ *
+ * @ingroup rmatio
+ * @param x The lazy vector
+ * @param i Index of the first element
+ * @param n Number of elements
+ * @param buf Buffer to store the elements in
+ * @return The number of elements read.
+ */
+static R_xlen_t
+lazy_region(SEXP x, R_xlen_t i, R_xlen_t n, void *buf)
+{
+    SEXP data2 = R_altrep_data2(x);
+    R_xlen_t len = lazy_length(x);
+
+    if (i >= len)
+        return 0;
+    if (n > len - i)
+        n = len - i;
+
+    if (Rf_isNull(data2))
+        lazy_read(x, i, n, buf);
+    else if (REALSXP == TYPEOF(data2))
+        memcpy(buf, REAL(data2) + i, n * sizeof(double));
+    else
+        memcpy(buf, INTEGER(data2) + i, n * sizeof(int));
+
+    return n;
+}
+
+static R_xlen_t
+lazy_real_region(SEXP x, R_xlen_t i, R_xlen_t n, double *buf)
+{
+    return lazy_region(x, i, n, buf);
+}
+
+static R_xlen_t
+lazy_integer_region(SEXP x, R_xlen_t i, R_xlen_t n, int *buf)
+{
+    return lazy_region(x, i, n, buf);
+}
+
+static double
+lazy_real_elt(SEXP x, R_xlen_t i)
+{
+    double value;
+    lazy_region(x, i, 1, &value);
+    return value;
+}
+
+static int
+lazy_integer_elt(SEXP x, R_xlen_t i)
+{
+    int value;
+    lazy_region(x, i, 1, &value);
+    return value;
+}
+
+/** @brief Subset a lazy vector
+ *
+ * Reads each run of consecutive indices with one read from the MAT
+ * file, instead of reading the indexed elements one at a time.
+ * @ingroup rmatio
+ * @param x The lazy vector
+ * @param indx The 1-based indices
+ * @param call Unused
+ * @return The subset, or NULL to let R subset the vector.
+ */
+static SEXP
+lazy_extract_subset(SEXP x, SEXP indx, SEXP call)
+{
+    SEXP result;
+    R_xlen_t len = lazy_length(x), n = XLENGTH(indx), k = 0;
+
+    (void)call;
+
+    if (!Rf_isNull(R_altrep_data2(x))
+        || (INTSXP != TYPEOF(indx) && REALSXP != TYPEOF(indx)))
+        return NULL;
+
+    PROTECT(result = Rf_allocVector(TYPEOF(x), n));
+    while (k < n) {
+        R_xlen_t first, run = 1;
+        char *buf = REALSXP == TYPEOF(x) ?
+            (char*)(REAL(result) + k) : (char*)(INTEGER(result) + k);
+
+        if (INTSXP == TYPEOF(indx)) {
+            int j = INTEGER(indx)[k];
+            first = (NA_INTEGER == j) ? 0 : j;
+            if (first > 0 && first <= len) {
+                while (k + run < n
+                       && INTEGER(indx)[k + run] == first + run
+                       && first + run <= len)
+                    run++;
+            }
+        } else {
+            double j = REAL(indx)[k];
+            first = (ISNAN(j) || j < 1 || j >= len + 1) ? 0 : (R_xlen_t)j;
+            if (first > 0) {
+                /* Compare as doubles, a NaN index ends the run */
+                while (k + run < n
+                       && first + run <= len
+                       && REAL(indx)[k + run] >= first + run
+                       && REAL(indx)[k + run] < first + run + 1)
+                    run++;
+            }
+        }
+
+        if (first > 0 && first <= len) {
+            lazy_region(x, first - 1, run, buf);
+        } else if (REALSXP == TYPEOF(x)) {
+            *(double*)buf = NA_REAL;
+        } else {
+            *(int*)buf = NA_INTEGER;
+        }
+
+        k += run;
+    }
+    UNPROTECT(1);
+
+    return result;
+}
+
+/** @brief Print information about a lazy vector for .Internal(inspect)
+ *
+ *
+ * @ingroup rmatio
+ */
+static Rboolean
+lazy_inspect(SEXP x, int pre, int deep, int pvec,
+             void (*inspect_subtree)(SEXP, int, int, int))
+{
+    (void)pre;
+    (void)deep;
+    (void)pvec;
+    (void)inspect_subtree;
+    Rprintf(" rmatio lazy %s (%s)\n",
+            REALSXP == TYPEOF(x) ? "real" : "integer",
+            Rf_isNull(R_altrep_data2(x)) ? "not read" : "read");
+    return TRUE;
+}
+
+/** @brief Initialize the ALTREP classes of lazy vectors
+ *
+ *
+ * @ingroup rmatio
+ * @param dll The DLL info of the package
+ */
+static void
+lazy_init(DllInfo *dll)
+{
+    lazy_real_class = R_make_altreal_class("lazy_real", "rmatio", dll);
+    R_set_altrep_Length_method(lazy_real_class, lazy_length);
+    R_set_altrep_Inspect_method(lazy_real_class, lazy_inspect);
+    R_set_altvec_Dataptr_method(lazy_real_class, lazy_dataptr);
+    R_set_altvec_Dataptr_or_null_method(lazy_real_class, lazy_dataptr_or_null);
+    R_set_altvec_Extract_subset_method(lazy_real_class, lazy_extract_subset);
+    R_set_altreal_Elt_method(lazy_real_class, lazy_real_elt);
+    R_set_altreal_Get_region_method(lazy_real_class, lazy_real_region);
+
+    lazy_integer_class = R_make_altinteger_class("lazy_integer", "rmatio", dll);
+    R_set_altrep_Length_method(lazy_integer_class, lazy_length);
+    R_set_altrep_Inspect_method(lazy_integer_class, lazy_inspect);
+    R_set_altvec_Dataptr_method(lazy_integer_class, lazy_dataptr);
+    R_set_altvec_Dataptr_or_null_method(lazy_integer_class, lazy_dataptr_or_null);
+    R_set_altvec_Extract_subset_method(lazy_integer_class, lazy_extract_subset);
+    R_set_altinteger_Elt_method(lazy_integer_class, lazy_integer_elt);
+    R_set_altinteger_Get_region_method(lazy_integer_class, lazy_integer_region);
+}
+
+/** @brief Read data lazily
+ *
+ * Creates a lazy vector that reads the data of the variable from the
+ * MAT file when it is accessed.  The lazy vector takes ownership of
+ * 'matvar'.
+ * @ingroup rmatio
+ * @param list The list to hold the read data
+ * @param index The position in the list where to store the read data
+ * @param matvar MAT variable pointer with the variable information
+ * @param file External pointer to the MAT file
+ * @return 0 on succes or 1 on failure.
+ */
+static int
+read_lazy(SEXP list,
+          int index,
+          matvar_t *matvar,
+          SEXP file)
+{
+    SEXP ptr, m;
+
+    PROTECT(ptr = R_MakeExternalPtr(matvar, R_NilValue, file));
+    R_RegisterCFinalizerEx(ptr, lazy_matvar_finalizer, TRUE);
+
+    if (REALSXP == lazy_type(matvar))
+        PROTECT(m = R_new_altrep(lazy_real_class, ptr, R_NilValue));
+    else
+        PROTECT(m = R_new_altrep(lazy_integer_class, ptr, R_NilValue));
+
+    if (set_dim(m, matvar)) {
+        UNPROTECT(2);
+        return 1;
+    }
+
+    SET_VECTOR_ELT(list, index, m);
+    UNPROTECT(2);
+
+    return 0;
+}
+
+#else
+
+static int
+read_lazy(SEXP list,
+          int index,
+          matvar_t *matvar,
+          SEXP file)
+{
+    Rf_error("Reading lazily requires R >= 3.5.0.");
+    return 1;
+}
+
+#endif
+
+/*
+ * -------------------------------------------------------------
+ *   Narrow numeric vectors
+ * -------------------------------------------------------------
+ */
+
+/** @brief R type of a MAT variable read without widening
+ *
+ * uint8 data is read as a raw vector. The other integer classes
+ * narrower than int32, single and uint32 data, and logical data, are
+ * read as ALTREP vectors that keep the data as it is stored in the
+ * MAT file and convert the elements when they are accessed.
+ * @ingroup rmatio
+ * @param matvar MAT variable pointer
+ * @return RAWSXP, INTSXP, REALSXP, LGLSXP or NILSXP if the data is
+ * widened as usual.
+ */
+static SEXPTYPE
+narrow_type(matvar_t *matvar)
+{
+    if (matvar->isComplex)
+        return NILSXP;
+
+    if (matvar->isLogical) {
+#if defined(RMATIO_ALTLOGICAL)
+        if (MAT_C_UINT8 == matvar->class_type)
+            return LGLSXP;
+#endif
+        return NILSXP;
+    }
+
+    switch (matvar->class_type) {
+    case MAT_C_UINT8:
+        return RAWSXP;
+#if defined(RMATIO_ALTREP)
+    case MAT_C_INT8:
+    case MAT_C_INT16:
+    case MAT_C_UINT16:
+        return INTSXP;
+    case MAT_C_SINGLE:
+    case MAT_C_UINT32:
+        return REALSXP;
+#endif
+    default:
+        return NILSXP;
+    }
+}
+
+#if defined(RMATIO_ALTREP)
+
+/** @brief The ALTREP classes of narrow vectors and the MAT class of
+ * the data they view */
+static struct {
+    R_altrep_class_t altrep_class;
+    enum matio_classes class_type;
+} narrow_classes[6];
+
+static int n_narrow_classes = 0;
+
+/** @brief The data of a narrow vector
+ *
+ * The data1 of a narrow vector is a list with the data as a raw
+ * vector and the MAT class of the data, which is resolved once when
+ * the vector is created instead of on every element access.
+ * @ingroup rmatio
+ * @param x The narrow vector
+ * @return The raw vector with the data.
+ */
+static SEXP
+narrow_data(SEXP x)
+{
+    return VECTOR_ELT(R_altrep_data1(x), 0);
+}
+
+/** @brief MAT class of the data of a narrow vector
+ *
+ *
+ * @ingroup rmatio
+ * @param x The narrow vector
+ * @return The MAT class.
+ */
+static enum matio_classes
+narrow_class_type(SEXP x)
+{
+    return (enum matio_classes)INTEGER(VECTOR_ELT(R_altrep_data1(x), 1))[0];
+}
+
+/** @brief The ALTREP class of a narrow vector of a MAT variable
+ *
+ * The uint8 class is only used for logical data, since other uint8
+ * data is read as a raw vector.
+ * @ingroup rmatio
+ * @param matvar MAT variable pointer
+ * @return The ALTREP class or NULL.
+ */
+static R_altrep_class_t *
+narrow_altrep_class(matvar_t *matvar)
+{
+    for (int k = 0; k < n_narrow_classes; k++) {
+        if (narrow_classes[k].class_type == matvar->class_type)
+            return &narrow_classes[k].altrep_class;
+    }
+
+    return NULL;
+}
+
+static R_xlen_t
+narrow_length(SEXP x)
+{
+    return XLENGTH(narrow_data(x)) / Mat_SizeOfClass(narrow_class_type(x));
+}
+
+/** @brief Pointer to the data of a converted narrow vector
+ *
+ *
+ * @ingroup rmatio
+ * @param data2 The converted vector
+ * @return Pointer to the data.
+ */
+static void*
+narrow_converted_ptr(SEXP data2)
+{
+    switch (TYPEOF(data2)) {
+    case REALSXP:
+        return REAL(data2);
+    case LGLSXP:
+        return LOGICAL(data2);
+    default:
+        return INTEGER(data2);
+    }
+}
+
+/** @brief Convert elements of a narrow vector
+ *
+ *
+ * @ingroup rmatio
+ * @param x The narrow vector
+ * @param start Index of the first element to convert
+ * @param n Number of elements to convert
+ * @param buf Buffer of 'n' doubles or ints, depending on the type
+ * of 'x', to store the elements in
+ */
+static void
+narrow_convert(SEXP x, R_xlen_t start, R_xlen_t n, void *buf)
+{
+    const Rbyte *data = RAW(narrow_data(x));
+
+    switch (narrow_class_type(x)) {
+    case MAT_C_SINGLE:
+        for (R_xlen_t j=0;j<n;j++)
+            ((double*)buf)[j] = ((const float*)data)[start + j];
+        break;
+    case MAT_C_UINT32:
+        for (R_xlen_t j=0;j<n;j++)
+            ((double*)buf)[j] = ((const mat_uint32_t*)data)[start + j];
+        break;
+    case MAT_C_INT16:
+        for (R_xlen_t j=0;j<n;j++)
+            ((int*)buf)[j] = ((const mat_int16_t*)data)[start + j];
+        break;
+    case MAT_C_INT8:
+        for (R_xlen_t j=0;j<n;j++)
+            ((int*)buf)[j] = ((const mat_int8_t*)data)[start + j];
+        break;
+    case MAT_C_UINT16:
+        for (R_xlen_t j=0;j<n;j++)
+            ((int*)buf)[j] = ((const mat_uint16_t*)data)[start + j];
+        break;
+    case MAT_C_UINT8:
+        /* Logical */
+        for (R_xlen_t j=0;j<n;j++)
+            ((int*)buf)[j] = 0 != ((const mat_uint8_t*)data)[start + j];
+        break;
+    default:
+        break;
+    }
+}
+
+/** @brief Pointer to the data of a narrow vector
+ *
+ * Converts the complete vector the first time it is requested.
+ * @ingroup rmatio
+ * @param x The narrow vector
+ * @param writeable Unused
+ * @return Pointer to the data.
+ */
+static void*
+narrow_dataptr(SEXP x, Rboolean writeable)
+{
+    SEXP data2 = R_altrep_data2(x);
+
+    (void)writeable;
+
+    if (Rf_isNull(data2)) {
+        PROTECT(data2 = Rf_allocVector(TYPEOF(x), narrow_length(x)));
+        narrow_convert(x, 0, XLENGTH(data2), narrow_converted_ptr(data2));
+        R_set_altrep_data2(x, data2);
+        UNPROTECT(1);
+    }
+
+    return narrow_converted_ptr(data2);
+}
+
+static const void*
+narrow_dataptr_or_null(SEXP x)
+{
+    SEXP data2 = R_altrep_data2(x);
+
+    if (Rf_isNull(data2))
+        return NULL;
+    return narrow_converted_ptr(data2);
+}
+
+/** @brief Convert a region of a narrow vector
+ *
+ *
+ * @ingroup rmatio
+ * @param x The narrow vector
+ * @param i Index of the first element
+ * @param n Number of elements
+ * @param buf Buffer to store the elements in
+ * @return The number of elements converted.
+ */
+static R_xlen_t
+narrow_region(SEXP x, R_xlen_t i, R_xlen_t n, void *buf)
+{
+    SEXP data2 = R_altrep_data2(x);
+    R_xlen_t len = narrow_length(x);
+
+    if (i >= len)
+        return 0;
+    if (n > len - i)
+        n = len - i;
+
+    if (Rf_isNull(data2))
+        narrow_convert(x, i, n, buf);
+    else if (REALSXP == TYPEOF(data2))
+        memcpy(buf, REAL(data2) + i, n * sizeof(double));
+    else
+        memcpy(buf, (int*)narrow_converted_ptr(data2) + i, n * sizeof(int));
+
+    return n;
+}
+
+static R_xlen_t
+narrow_real_region(SEXP x, R_xlen_t i, R_xlen_t n, double *buf)
+{
+    return narrow_region(x, i, n, buf);
+}
+
+static R_xlen_t
+narrow_integer_region(SEXP x, R_xlen_t i, R_xlen_t n, int *buf)
+{
+    return narrow_region(x, i, n, buf);
+}
+
+static double
+narrow_real_elt(SEXP x, R_xlen_t i)
+{
+    double value;
+    narrow_region(x, i, 1, &value);
+    return value;
+}
+
+static int
+narrow_integer_elt(SEXP x, R_xlen_t i)
+{
+    int value;
+    narrow_region(x, i, 1, &value);
+    return value;
+}
+
+/** @brief Print information about a narrow vector for .Internal(inspect)
+ *
+ *
+ * @ingroup rmatio
+ */
+static Rboolean
+narrow_inspect(SEXP x, int pre, int deep, int pvec,
+               void (*inspect_subtree)(SEXP, int, int, int))
+{
+    (void)pre;
+    (void)deep;
+    (void)pvec;
+    (void)inspect_subtree;
+    Rprintf(" rmatio narrow %s (%s)\n",
+            Rf_type2char(TYPEOF(x)),
+            Rf_isNull(R_altrep_data2(x)) ? "not converted" : "converted");
+    return TRUE;
+}
+
+/** @brief Register the ALTREP class of narrow vectors of a MAT class
+ *
+ *
+ * @ingroup rmatio
+ * @param altrep_class The ALTREP class
+ * @param class_type The MAT class of the data
+ */
+static void
+narrow_add_class(R_altrep_class_t altrep_class, enum matio_classes class_type)
+{
+    R_set_altrep_Length_method(altrep_class, narrow_length);
+    R_set_altrep_Inspect_method(altrep_class, narrow_inspect);
+    R_set_altvec_Dataptr_method(altrep_class, narrow_dataptr);
+    R_set_altvec_Dataptr_or_null_method(altrep_class, narrow_dataptr_or_null);
+
+    narrow_classes[n_narrow_classes].altrep_class = altrep_class;
+    narrow_classes[n_narrow_classes].class_type = class_type;
+    n_narrow_classes++;
+}
+
+/** @brief Create a narrow vector
+ *
+ *
+ * @ingroup rmatio
+ * @param altrep_class The ALTREP class of the vector
+ * @param data The data as a raw vector
+ * @param class_type The MAT class of the data
+ * @return The narrow vector, which is not protected.
+ */
+static SEXP
+narrow_new(R_altrep_class_t altrep_class, SEXP data,
+           enum matio_classes class_type)
+{
+    SEXP data1, x;
+
+    PROTECT(data1 = Rf_allocVector(VECSXP, 2));
+    SET_VECTOR_ELT(data1, 0, data);
+    SET_VECTOR_ELT(data1, 1, Rf_ScalarInteger(class_type));
+    x = R_new_altrep(altrep_class, data1, R_NilValue);
+    UNPROTECT(1);
+
+    return x;
+}
+
+/** @brief Initialize the ALTREP classes of narrow vectors
+ *
+ *
+ * @ingroup rmatio
+ * @param dll The DLL info of the package
+ */
+static void
+narrow_init(DllInfo *dll)
+{
+    static const struct {
+        const char *name;
+        enum matio_classes class_type;
+    } integers[] = {{"narrow_int8", MAT_C_INT8},
+                    {"narrow_int16", MAT_C_INT16},
+                    {"narrow_uint16", MAT_C_UINT16}},
+      reals[] = {{"narrow_single", MAT_C_SINGLE},
+                 {"narrow_uint32", MAT_C_UINT32}};
+    R_altrep_class_t altrep_class;
+
+    for (int k = 0; k < 3; k++) {
+        altrep_class = R_make_altinteger_class(integers[k].name, "rmatio", dll);
+        R_set_altinteger_Elt_method(altrep_class, narrow_integer_elt);
+        R_set_altinteger_Get_region_method(altrep_class, narrow_integer_region);
+        narrow_add_class(altrep_class, integers[k].class_type);
+    }
+
+    for (int k = 0; k < 2; k++) {
+        altrep_class = R_make_altreal_class(reals[k].name, "rmatio", dll);
+        R_set_altreal_Elt_method(altrep_class, narrow_real_elt);
+        R_set_altreal_Get_region_method(altrep_class, narrow_real_region);
+        narrow_add_class(altrep_class, reals[k].class_type);
+    }
+
+#if defined(RMATIO_ALTLOGICAL)
+    /* Logical data is stored as uint8 */
+    altrep_class = R_make_altlogical_class("narrow_logical", "rmatio", dll);
+    R_set_altlogical_Elt_method(altrep_class, narrow_integer_elt);
+    R_set_altlogical_Get_region_method(altrep_class, narrow_integer_region);
+    narrow_add_class(altrep_class, MAT_C_UINT8);
+#endif
+}
+
+#endif
+
+/** @brief Read data without widening
+ *
+ * Copies the data of the variable with one memcpy into a raw vector,
+ * which for other types than uint8 is the data of a narrow ALTREP
+ * vector, see narrow_type.
+ * @ingroup rmatio
+ * @param list The list to hold the read data
+ * @param index The position in the list where to store the read data
+ * @param matvar MAT variable pointer
+ * @return 0 on succes or 1 on failure.
+ */
+static int
+read_narrow(SEXP list,
+            int index,
+            matvar_t *matvar)
+{
+    SEXP data, m;
+    size_t len;
+    SEXPTYPE type = narrow_type(matvar);
+
+    if (NILSXP == type)
+        return 1;
+
+    len = matvar->dims[0];
+    for (int j=1;j<matvar->rank;j++)
+        len *= matvar->dims[j];
+    len *= Mat_SizeOfClass(matvar->class_type);
+
+    PROTECT(data = Rf_allocVector(RAWSXP, len));
+    if (len)
+        memcpy(RAW(data), matvar->data, len);
+
+    if (RAWSXP == type) {
+        PROTECT(m = data);
+    } else {
+#if defined(RMATIO_ALTREP)
+        R_altrep_class_t *altrep_class = narrow_altrep_class(matvar);
+        if (NULL == altrep_class) {
+            UNPROTECT(1);
+            return 1;
+        }
+        PROTECT(m = narrow_new(*altrep_class, data, matvar->class_type));
+#else
+        UNPROTECT(1);
+        return 1;
+#endif
+    }
+
+    if (set_dim(m, matvar)) {
+        UNPROTECT(2);
+        return 1;
+    }
+
+    SET_VECTOR_ELT(list, index, m);
+    UNPROTECT(2);
+
+    return 0;
+}
+
+/*
+ * -------------------------------------------------------------
+ *   Read-ahead of variables
+ * -------------------------------------------------------------
+ */
+
+/** Number of variables that can be read ahead of the conversion */
+#define READ_AHEAD_QUEUE 2
+
+/** @brief Variables read ahead of the conversion to R objects
+ *
+ * A background thread reads and inflates the next variables of the
+ * MAT file, while the main thread converts the current variable to R
+ * objects. The thread makes all the calls to matio that use the MAT
+ * file, and stops reading when READ_AHEAD_QUEUE variables are
+ * waiting to be converted. Without threads, the variables are read
+ * when they are requested.
+ *
+ * @ingroup rmatio
+ */
+struct read_ahead {
+    mat_t *mat;
+    matvar_t *queue[READ_AHEAD_QUEUE];
+    int head;      /* Index of the first variable in the queue */
+    int count;     /* Number of variables in the queue */
+    int done;      /* The last variable has been read */
+    int stop;      /* The thread is asked to stop reading */
+    mat_log_t log; /* Messages from matio on the thread */
+#if defined(RMATIO_READ_AHEAD)
+    int started;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+};
+
+#if defined(RMATIO_READ_AHEAD)
+
+/** @brief Read the variables of a MAT file on the read-ahead thread
+ *
+ *
+ * @ingroup rmatio
+ * @param arg The read-ahead
+ * @return NULL.
+ */
+static void*
+read_ahead_thread(void *arg)
+{
+    struct read_ahead *ra = (struct read_ahead*)arg;
+    matvar_t *matvar;
+    int done;
+
+    /* R must not be called from the thread. */
+    Mat_LogCapture(&ra->log);
+
+    do {
+        pthread_mutex_lock(&ra->lock);
+        while (!ra->stop && ra->count == READ_AHEAD_QUEUE)
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        done = ra->stop;
+        pthread_mutex_unlock(&ra->lock);
+        if (done)
+            break;
+
+        /* The main thread frees the variable, so give back the
+         * inflate stream to the pool of the MAT file here. */
+        matvar = Mat_VarReadNext(ra->mat);
+        Mat_VarReleaseStream(matvar);
+        if (matvar != NULL && ra->log.critical) {
+            Mat_VarFree(matvar);
+            matvar = NULL;
+        }
+
+        pthread_mutex_lock(&ra->lock);
+        if (matvar == NULL) {
+            ra->done = done = 1;
+        } else {
+            ra->queue[(ra->head + ra->count) % READ_AHEAD_QUEUE] = matvar;
+            ra->count++;
+        }
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+    } while (!done);
+
+    Mat_LogCapture(NULL);
+
+    return NULL;
+}
+
+#endif
+
+/** @brief Start reading the variables of a MAT file ahead
+ *
+ * Reads from the current position of the MAT file. Falls back to
+ * reading the variables in read_ahead_next if the thread can not be
+ * started.
+ *
+ * @ingroup rmatio
+ * @param ra The read-ahead to initialize
+ * @param mat MAT file pointer
+ */
+static void
+read_ahead_start(struct read_ahead *ra, mat_t *mat)
+{
+    memset(ra, 0, sizeof(*ra));
+    ra->mat = mat;
+
+#if defined(RMATIO_READ_AHEAD)
+    if (pthread_mutex_init(&ra->lock, NULL))
+        return;
+    if (pthread_cond_init(&ra->cond, NULL)) {
+        pthread_mutex_destroy(&ra->lock);
+        return;
+    }
+    if (pthread_create(&ra->thread, NULL, read_ahead_thread, ra)) {
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->lock);
+        return;
+    }
+    ra->started = 1;
+#endif
+}
+
+/** @brief Get the next variable read ahead
+ *
+ *
+ * @ingroup rmatio
+ * @param ra The read-ahead
+ * @return The next variable, to be freed by the caller, or NULL
+ * when all variables have been read or reading failed.
+ */
+static matvar_t*
+read_ahead_next(struct read_ahead *ra)
+{
+    matvar_t *matvar = NULL;
+
+#if defined(RMATIO_READ_AHEAD)
+    if (ra->started) {
+        pthread_mutex_lock(&ra->lock);
+        while (!ra->count && !ra->done)
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        if (ra->count) {
+            matvar = ra->queue[ra->head];
+            ra->head = (ra->head + 1) % READ_AHEAD_QUEUE;
+            ra->count--;
+            pthread_cond_broadcast(&ra->cond);
+        }
+        pthread_mutex_unlock(&ra->lock);
+        return matvar;
+    }
+#endif
+
+    if (!ra->done) {
+        matvar = Mat_VarReadNext(ra->mat);
+        if (matvar == NULL)
+            ra->done = 1;
+    }
+
+    return matvar;
+}
+
+/** @brief Stop reading ahead
+ *
+ * Waits for the thread to finish the variable it is reading, and
+ * frees the variables that have not been requested. The MAT file can
+ * be used again afterwards. Messages from matio on the thread are
+ * left in ra->log.
+ *
+ * @ingroup rmatio
+ * @param ra The read-ahead
+ */
+static void
+read_ahead_stop(struct read_ahead *ra)
+{
+#if defined(RMATIO_READ_AHEAD)
+    if (ra->started) {
+        pthread_mutex_lock(&ra->lock);
+        ra->stop = 1;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+        pthread_join(ra->thread, NULL);
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->lock);
+        ra->started = 0;
+    }
+#endif
+
+    while (ra->count) {
+        Mat_VarFree(ra->queue[ra->head]);
+        ra->head = (ra->head + 1) % READ_AHEAD_QUEUE;
+        ra->count--;
+    }
+}
+
+/*
+ * -------------------------------------------------------------
+ *   Functions to interface R
+ * -------------------------------------------------------------
+ */
+
+/** @brief Open a MAT file from a filename or a raw vector
+ *
+ * A raw vector holds the MAT file in memory, and is read without
+ * writing it to disk. It must be protected while the MAT file is
+ * open.
+ *
+ * @ingroup rmatio
+ * @param source The filename (STRSXP) or the MAT file (RAWSXP)
+ * @return A pointer to the MAT file, raises an error on failure.
+ */
+static mat_t *
+open_mat(const SEXP source)
+{
+    mat_t *mat = NULL;
+
+    if (Rf_isNull(source))
+        Rf_error("'filename' equals R_NilValue.");
+    if (RAWSXP == TYPEOF(source))
+        mat = Mat_OpenMem(RAW(source), XLENGTH(source));
+    else if (Rf_isString(source))
+        mat = Mat_Open(CHAR(STRING_ELT(source, 0)), MAT_ACC_RDONLY);
+    else
+        Rf_error("'filename' must be a string or a raw vector.");
+    if (!mat)
+        Rf_error("Unable to open file.");
+
+    return mat;
+}
+
+/** @brief Number of variables in MAT-file
+ *
+ *
+ * @ingroup rmatio
+ * @param mat MAT file pointer
+ * @return 0 on succes or 1 on failure.
+ */
+static int
+number_of_variables(mat_t *mat)
+{
+    int len=0;
+    matvar_t *matvar;
+
+    if (mat != NULL) {
+        if (!Mat_Rewind(mat)) {
+            while ((matvar = Mat_VarReadNextInfo(mat)) != NULL) {
+                len++;
                 Mat_VarFree(matvar);
                 matvar = NULL;
             }
@@ -3153,127 +5890,523 @@ number_of_variables(mat_t *mat)
     return len;
 }
 
-/** @brief Read matlab file
+/** @brief Read a MAT variable
  *
  *
  * @ingroup rmatio
- * @param filename The file to read
- * @return a named list (VECSXP).
+ * @param list The list to store the variable in
+ * @param i The index in the list
+ * @param matvar The MAT variable to read
+ * @param flags Flags controlling the conversion to R objects, see
+ * RMATIO_READ_INT64.
+ * @param err_msg Set to the error message on failure
+ * @return 0 on succes or 1 on failure.
  */
-SEXP read_mat(const SEXP filename)
+static int
+read_matvar(SEXP list, int i, matvar_t *matvar, int flags,
+            const char **err_msg)
 {
-    mat_t *mat = NULL;
-    matvar_t *matvar = NULL;
-    int i = 0, n = 0, err = 0;
-    SEXP list, names;
+    int err = 0;
 
-    const char err_reading_mat_file[] = "Error reading MAT file";
-    const char err_mat_c_empty[] = "Not implemented support to read matio class type MAT_C_EMPTY";
-    const char err_mat_c_object[] = "Not implemented support to read matio class type MAT_C_OBJECT";
-    const char *err_msg = NULL;
+    static const char err_reading_mat_file[] = "Error reading MAT file";
+    static const char err_mat_c_empty[] = "Not implemented support to read matio class type MAT_C_EMPTY";
+    static const char err_mat_c_object[] = "Not implemented support to read matio class type MAT_C_OBJECT";
 
-    if (Rf_isNull(filename))
-        Rf_error("'filename' equals R_NilValue.");
-    if (!Rf_isString(filename))
-        Rf_error("'filename' must be a string.");
+    switch (matvar->class_type) {
+    case MAT_C_EMPTY:
+        *err_msg = err_mat_c_empty;
+        return 1;
 
-    mat = Mat_Open(CHAR(STRING_ELT(filename, 0)), MAT_ACC_RDONLY);
-    if (!mat)
-        Rf_error("Unable to open file.");
+    case MAT_C_CELL:
+        err = read_mat_cell(list, i, matvar, flags);
+        break;
 
-    n = number_of_variables(mat);
-    PROTECT(list = Rf_allocVector(VECSXP, n));
-    PROTECT(names = Rf_allocVector(STRSXP, n));
+    case MAT_C_STRUCT:
+        err = read_mat_struct(list, i, matvar, flags);
+        break;
 
-    if (Mat_Rewind(mat)) {
+    case MAT_C_OBJECT:
+        *err_msg = err_mat_c_object;
+        return 1;
+
+    case MAT_C_CHAR:
+        err = read_mat_char(list, i, matvar);
+        break;
+
+    case MAT_C_SPARSE:
+        err = read_sparse(list, i, matvar);
+        break;
+
+    case MAT_C_DOUBLE:
+    case MAT_C_SINGLE:
+    case MAT_C_INT64:
+    case MAT_C_INT32:
+    case MAT_C_INT16:
+    case MAT_C_INT8:
+    case MAT_C_UINT64:
+    case MAT_C_UINT32:
+    case MAT_C_UINT16:
+    case MAT_C_UINT8:
+        if (matvar->isLogical)
+            err = read_logical(list, i, matvar, flags);
+        else if (matvar->isComplex)
+            err = read_mat_complex(list, i, matvar);
+        else
+            err = read_mat_data(list, i, matvar, flags);
+        break;
+
+    case MAT_C_FUNCTION:
+    case MAT_C_OPAQUE:
+        err = 0;
+        Rf_warning("Function class type read as NULL: %s",
+                   matvar->name == NULL ? "" : matvar->name);
+        break;
+
+    default:
         err = 1;
-        err_msg = err_reading_mat_file;
-        goto cleanup;
+        break;
     }
 
-    while ((matvar = Mat_VarReadNext(mat)) != NULL) {
-        if (matvar->name != NULL)
-            SET_STRING_ELT(names, i, Rf_mkChar(matvar->name));
+    if (err)
+        *err_msg = err_reading_mat_file;
 
-        switch (matvar->class_type) {
-        case MAT_C_EMPTY:
-            err = 1;
-            err_msg = err_mat_c_empty;
-            goto cleanup;
+    return err;
+}
 
-        case MAT_C_CELL:
-            err = read_mat_cell(list, i, matvar);
-            break;
+/** @brief Read a MAT variable, lazily if possible
+ *
+ *
+ * @ingroup rmatio
+ * @param list The list to store the variable in
+ * @param i The index in the list
+ * @param mat MAT file pointer
+ * @param matvar The MAT variable. If 'file' is not R_NilValue, only
+ * the variable information has been read. Set to NULL if the
+ * variable has been taken over by a lazy vector.
+ * @param file External pointer to the MAT file for lazy vectors, or
+ * R_NilValue if the data has been read.
+ * @param nlazy Incremented if a lazy vector is created
+ * @param flags Flags controlling the conversion to R objects, see
+ * RMATIO_READ_INT64.
+ * @param err_msg Set to the error message on failure
+ * @return 0 on succes or 1 on failure.
+ */
+static int
+read_matvar_lazy(SEXP list, int i, mat_t *mat, matvar_t **matvar,
+                 SEXP file, int *nlazy, int flags, const char **err_msg)
+{
+    if (!Rf_isNull(file)) {
+        if (lazy_candidate(mat, *matvar, flags)) {
+            if (read_lazy(list, i, *matvar, file)) {
+                *err_msg = "Error reading MAT file";
+                return 1;
+            }
+            *matvar = NULL;
+            (*nlazy)++;
+            return 0;
+        }
 
-        case MAT_C_STRUCT:
-            err = read_mat_struct(list, i, matvar);
-            break;
+        Mat_VarReadDataAll(mat, *matvar);
+    }
+
+    return read_matvar(list, i, *matvar, flags, err_msg);
+}
+
+/** @brief Read the named variables from a matlab file
+ *
+ * The variables are read in one pass through the file, in the order
+ * they are stored.
+ *
+ * @ingroup rmatio
+ * @param mat MAT file pointer
+ * @param variables The names of the variables to read
+ * @param file External pointer to the MAT file for lazy vectors, or
+ * R_NilValue to read all data.
+ * @param flags Flags controlling the conversion to R objects, see
+ * RMATIO_READ_INT64.
+ * @return a named list (VECSXP) in the order of the names.
+ */
+static SEXP
+read_mat_variables(mat_t *mat, const SEXP variables, SEXP file, int flags)
+{
+    matvar_t **matvars = NULL;
+    const char **names = NULL;
+    const char *err_msg = NULL, *missing = NULL;
+    int i, n, err = 0, nlazy = 0;
+    SEXP list;
 
-        case MAT_C_OBJECT:
+    n = LENGTH(variables);
+    PROTECT(list = Rf_allocVector(VECSXP, n));
+    Rf_setAttrib(list, R_NamesSymbol, variables);
+
+    names = (const char**)R_alloc(n, sizeof(const char*));
+    for (i = 0; i < n; i++)
+        names[i] = CHAR(STRING_ELT(variables, i));
+
+    if (Rf_isNull(file))
+        matvars = Mat_VarReadMany(mat, names, n);
+    else
+        matvars = Mat_VarReadManyInfo(mat, names, n);
+    if (matvars == NULL) {
+        if (Rf_isNull(file))
+            Mat_Close(mat);
+        Rf_error("Error reading MAT file");
+    }
+
+    for (i = 0; i < n && !err; i++) {
+        if (matvars[i] == NULL) {
             err = 1;
-            err_msg = err_mat_c_object;
-            goto cleanup;
+            missing = names[i];
+        } else {
+            err = read_matvar_lazy(list, i, mat, &matvars[i], file, &nlazy,
+                                   flags, &err_msg);
+        }
+    }
 
-        case MAT_C_CHAR:
-            err = read_mat_char(list, i, matvar);
-            break;
+    for (i = 0; i < n; i++)
+        Mat_VarFree(matvars[i]);
+    free(matvars);
+    if (Rf_isNull(file))
+        Mat_Close(mat);
+    else if (!nlazy)
+        lazy_file_finalizer(file);
+    UNPROTECT(1);
 
-        case MAT_C_SPARSE:
-            err = read_sparse(list, i, matvar);
-            break;
+    if (missing)
+        Rf_error("Unable to find variable '%s' in MAT file.", missing);
+    if (err)
+        Rf_error("%s", err_msg);
 
-        case MAT_C_DOUBLE:
-        case MAT_C_SINGLE:
-        case MAT_C_INT64:
-        case MAT_C_INT32:
-        case MAT_C_INT16:
-        case MAT_C_INT8:
-        case MAT_C_UINT64:
-        case MAT_C_UINT32:
-        case MAT_C_UINT16:
-        case MAT_C_UINT8:
-            if (matvar->isLogical)
-                err = read_logical(list, i, matvar);
-            else if (matvar->isComplex)
-                err = read_mat_complex(list, i, matvar);
-            else
-                err = read_mat_data(list, i, matvar);
-            break;
+    return list;
+}
 
-        case MAT_C_FUNCTION:
-        case MAT_C_OPAQUE:
-            err = 0;
-            Rf_warning("Function class type read as NULL: %s",
-                       matvar->name == NULL ? "" : matvar->name);
-            break;
+/** @brief State of reading all the variables of a matlab file
+ *
+ *
+ * @ingroup rmatio
+ */
+struct read_mat_state {
+    mat_t *mat;
+    SEXP list;           /* The list to store the variables in */
+    SEXP names;          /* The names of the variables */
+    SEXP file;           /* External pointer for lazy vectors */
+    int flags;           /* See RMATIO_READ_INT64 */
+    int nlazy;           /* Number of lazy vectors created */
+    int err;             /* Non-zero if reading failed */
+    const char *err_msg;
+    matvar_t *matvar;    /* The variable that is converted */
+    struct read_ahead ra;
+};
 
-        default:
-            err = 1;
+/** @brief Read all the variables of a matlab file
+ *
+ * Variables are read ahead on a thread, unless they are read
+ * lazily.
+ *
+ * @ingroup rmatio
+ * @param data The state of reading the file
+ * @return R_NilValue.
+ */
+static SEXP
+read_mat_all(void *data)
+{
+    struct read_mat_state *rm = (struct read_mat_state*)data;
+    int i = 0;
+
+    for (;;) {
+        if (Rf_isNull(rm->file))
+            rm->matvar = read_ahead_next(&rm->ra);
+        else
+            rm->matvar = Mat_VarReadNextInfo(rm->mat);
+        if (rm->matvar == NULL)
             break;
-        }
 
-        if (err) {
-            err_msg = err_reading_mat_file;
-            goto cleanup;
-        }
+        if (rm->matvar->name != NULL)
+            SET_STRING_ELT(rm->names, i, Rf_mkChar(rm->matvar->name));
 
-        Mat_VarFree(matvar);
-        matvar = NULL;
+        rm->err = read_matvar_lazy(rm->list, i, rm->mat, &rm->matvar,
+                                   rm->file, &rm->nlazy, rm->flags,
+                                   &rm->err_msg);
+        if (rm->err)
+            break;
+
+        Mat_VarFree(rm->matvar);
+        rm->matvar = NULL;
         i++;
     }
 
+    return R_NilValue;
+}
+
+/** @brief Clean up after reading all the variables of a matlab file
+ *
+ * Stops reading ahead, frees the current variable and closes the
+ * file, unless it is used by lazy vectors.
+ *
+ * @ingroup rmatio
+ * @param data The state of reading the file
+ */
+static void
+read_mat_cleanup(void *data)
+{
+    struct read_mat_state *rm = (struct read_mat_state*)data;
+
+    read_ahead_stop(&rm->ra);
+    if (rm->matvar) {
+        Mat_VarFree(rm->matvar);
+        rm->matvar = NULL;
+    }
+    if (Rf_isNull(rm->file))
+        Mat_Close(rm->mat);
+    else if (!rm->nlazy)
+        lazy_file_finalizer(rm->file);
+}
+
+/** @brief Read matlab file
+ *
+ *
+ * @ingroup rmatio
+ * @param filename The file to read, a filename or a raw vector
+ * @param variables The names of the variables to read, or R_NilValue
+ * to read all variables
+ * @param lazy Read uncompressed numeric variables lazily
+ * @param int64 Read int64 and uint64 data as 'integer64'
+ * @param preserve_types Read narrow numeric and logical data without
+ * widening it
+ * @param cellstr Read cell arrays of strings as character vectors
+ * @param data_frame Read structure arrays of scalars as data.frames
+ * @param stack_cells Read cell arrays of equal numeric arrays as one
+ * array
+ * @param temporary Remove the file when lazy vectors no longer use it
+ * @return a named list (VECSXP).
+ */
+SEXP read_mat(const SEXP filename, const SEXP variables, const SEXP lazy,
+              const SEXP int64, const SEXP preserve_types, const SEXP cellstr,
+              const SEXP data_frame, const SEXP stack_cells,
+              const SEXP temporary)
+{
+    mat_t *mat = NULL;
+    int n = 0, flags = 0;
+    SEXP list, names, file = R_NilValue;
+    struct read_mat_state rm;
+
+    if (!Rf_isNull(variables) && !Rf_isString(variables))
+        Rf_error("'variables' must be a character vector.");
+    if (!Rf_isLogical(lazy) || 1 != LENGTH(lazy) || NA_LOGICAL == LOGICAL(lazy)[0])
+        Rf_error("'lazy' must be TRUE or FALSE.");
+    if (!Rf_isLogical(int64) || 1 != LENGTH(int64) || NA_LOGICAL == LOGICAL(int64)[0])
+        Rf_error("'int64' must be TRUE or FALSE.");
+    if (LOGICAL(int64)[0])
+        flags |= RMATIO_READ_INT64;
+    if (!Rf_isLogical(preserve_types) || 1 != LENGTH(preserve_types)
+        || NA_LOGICAL == LOGICAL(preserve_types)[0])
+        Rf_error("'preserve_types' must be TRUE or FALSE.");
+    if (LOGICAL(preserve_types)[0])
+        flags |= RMATIO_READ_PRESERVE_TYPES;
+    if (!Rf_isLogical(cellstr) || 1 != LENGTH(cellstr)
+        || NA_LOGICAL == LOGICAL(cellstr)[0])
+        Rf_error("'cellstr' must be TRUE or FALSE.");
+    if (LOGICAL(cellstr)[0])
+        flags |= RMATIO_READ_CELLSTR;
+    if (!Rf_isLogical(data_frame) || 1 != LENGTH(data_frame)
+        || NA_LOGICAL == LOGICAL(data_frame)[0])
+        Rf_error("'data_frame' must be TRUE or FALSE.");
+    if (LOGICAL(data_frame)[0])
+        flags |= RMATIO_READ_DATA_FRAME;
+    if (!Rf_isLogical(stack_cells) || 1 != LENGTH(stack_cells)
+        || NA_LOGICAL == LOGICAL(stack_cells)[0])
+        Rf_error("'stack_cells' must be TRUE or FALSE.");
+    if (LOGICAL(stack_cells)[0])
+        flags |= RMATIO_READ_STACK_CELLS;
+    if (!Rf_isLogical(temporary) || 1 != LENGTH(temporary)
+        || NA_LOGICAL == LOGICAL(temporary)[0])
+        Rf_error("'temporary' must be TRUE or FALSE.");
+
+    mat = open_mat(filename);
+    Mat_SetReadArena(mat, 1);
+
+    /* Lazy vectors keep the file open until they are garbage
+     * collected, so it is closed by the finalizer. */
+    if (LOGICAL(lazy)[0])
+        file = lazy_file(mat, filename, temporary);
+    PROTECT(file);
+
+    if (!Rf_isNull(variables)) {
+        list = read_mat_variables(mat, variables, file, flags);
+        UNPROTECT(1);
+        return list;
+    }
+
+    n = number_of_variables(mat);
+    PROTECT(list = Rf_allocVector(VECSXP, n));
+    PROTECT(names = Rf_allocVector(STRSXP, n));
+
+    memset(&rm, 0, sizeof(rm));
+    rm.mat = mat;
+    rm.list = list;
+    rm.names = names;
+    rm.file = file;
+    rm.flags = flags;
+
+    if (Mat_Rewind(mat)) {
+        rm.err = 1;
+        rm.err_msg = "Error reading MAT file";
+        read_mat_cleanup(&rm);
+    } else {
+        /* The cleanup stops the read-ahead thread and closes the
+         * file also if the conversion to R objects fails. */
+        if (Rf_isNull(file))
+            read_ahead_start(&rm.ra, mat);
+        R_ExecWithCleanup(read_mat_all, &rm, read_mat_cleanup, &rm);
+    }
+
     Rf_setAttrib(list, R_NamesSymbol, names);
+    if (!rm.ra.log.critical && rm.ra.log.warning[0] != '\0')
+        Rf_warning("%s", rm.ra.log.warning);
+    UNPROTECT(3);
+    if (rm.ra.log.critical)
+        Rf_error("%s", rm.ra.log.message);
+    if (rm.err)
+        Rf_error("%s", rm.err_msg);
+
+    return list;
+}
+
+/** @brief Index the variables in a matlab file
+ *
+ * Reads the name and file position of each variable, without reading
+ * the data or the fields and cells of the variables.
+ *
+ * The MAT file is left open in the returned index, so the variables
+ * can be read with read_mat_variable without opening and parsing the
+ * file again. It is closed when the index is garbage collected.
+ *
+ * @ingroup rmatio
+ * @param filename The file to index, a filename or a raw vector
+ * @param temporary Remove the file when the index no longer uses it
+ * @return a list with the names (STRSXP) and the file positions
+ * (REALSXP) of the variables, and the open MAT file (EXTPTRSXP).
+ */
+SEXP read_mat_index(const SEXP filename, const SEXP temporary)
+{
+    mat_t *mat = NULL;
+    matvar_t *matvar = NULL;
+    int i = 0, n = 0;
+    SEXP index, names, fpos, file, index_names;
+
+    if (!Rf_isLogical(temporary) || 1 != LENGTH(temporary)
+        || NA_LOGICAL == LOGICAL(temporary)[0])
+        Rf_error("'temporary' must be TRUE or FALSE.");
+
+    mat = open_mat(filename);
+    Mat_SetReadFields(mat, 0);
+    PROTECT(file = lazy_file(mat, filename, temporary));
+
+    n = number_of_variables(mat);
+    PROTECT(index = Rf_allocVector(VECSXP, 3));
+    PROTECT(names = Rf_allocVector(STRSXP, n));
+    PROTECT(fpos = Rf_allocVector(REALSXP, n));
+    SET_VECTOR_ELT(index, 0, names);
+    SET_VECTOR_ELT(index, 1, fpos);
+    SET_VECTOR_ELT(index, 2, file);
+    PROTECT(index_names = Rf_allocVector(STRSXP, 3));
+    SET_STRING_ELT(index_names, 0, Rf_mkChar("name"));
+    SET_STRING_ELT(index_names, 1, Rf_mkChar("fpos"));
+    SET_STRING_ELT(index_names, 2, Rf_mkChar("file"));
+    Rf_setAttrib(index, R_NamesSymbol, index_names);
+
+    if (!Mat_Rewind(mat)) {
+        while (i < n && (matvar = Mat_VarReadNextInfo(mat)) != NULL) {
+            if (matvar->name != NULL)
+                SET_STRING_ELT(names, i, Rf_mkChar(matvar->name));
+            REAL(fpos)[i] = Mat_VarGetFilePos(matvar);
+            Mat_VarFree(matvar);
+            i++;
+        }
+    }
+
+    Mat_SetReadFields(mat, 1);
+    Mat_SetReadArena(mat, 1);
+    UNPROTECT(5);
+
+    if (i != n) {
+        lazy_file_finalizer(file);
+        Rf_error("Error reading MAT file");
+    }
+
+    return index;
+}
+
+/** @brief Read the variable at a position in a matlab file
+ *
+ *
+ * @ingroup rmatio
+ * @param file The open MAT file, from read_mat_index
+ * @param fpos The position of the variable, from read_mat_index
+ * @param int64 Read int64 and uint64 data as 'integer64'
+ * @param preserve_types Read narrow numeric and logical data without
+ * widening it
+ * @param cellstr Read cell arrays of strings as character vectors
+ * @param data_frame Read structure arrays of scalars as data.frames
+ * @param stack_cells Read cell arrays of equal numeric arrays as one
+ * array
+ * @return the variable.
+ */
+SEXP read_mat_variable(const SEXP file, const SEXP fpos, const SEXP int64,
+                       const SEXP preserve_types, const SEXP cellstr,
+                       const SEXP data_frame, const SEXP stack_cells)
+{
+    mat_t *mat = NULL;
+    matvar_t *matvar = NULL;
+    const char *err_msg = NULL;
+    int err, flags = 0;
+    SEXP list;
+
+    if (EXTPTRSXP != TYPEOF(file))
+        Rf_error("'file' must be an external pointer.");
+    mat = (mat_t*)R_ExternalPtrAddr(file);
+    if (!mat)
+        Rf_error("The MAT file is closed.");
+    if (!Rf_isReal(fpos) || 1 != LENGTH(fpos))
+        Rf_error("'fpos' must be a number.");
+    if (!Rf_isLogical(int64) || 1 != LENGTH(int64) || NA_LOGICAL == LOGICAL(int64)[0])
+        Rf_error("'int64' must be TRUE or FALSE.");
+    if (LOGICAL(int64)[0])
+        flags |= RMATIO_READ_INT64;
+    if (!Rf_isLogical(preserve_types) || 1 != LENGTH(preserve_types)
+        || NA_LOGICAL == LOGICAL(preserve_types)[0])
+        Rf_error("'preserve_types' must be TRUE or FALSE.");
+    if (LOGICAL(preserve_types)[0])
+        flags |= RMATIO_READ_PRESERVE_TYPES;
+    if (!Rf_isLogical(cellstr) || 1 != LENGTH(cellstr)
+        || NA_LOGICAL == LOGICAL(cellstr)[0])
+        Rf_error("'cellstr' must be TRUE or FALSE.");
+    if (LOGICAL(cellstr)[0])
+        flags |= RMATIO_READ_CELLSTR;
+    if (!Rf_isLogical(data_frame) || 1 != LENGTH(data_frame)
+        || NA_LOGICAL == LOGICAL(data_frame)[0])
+        Rf_error("'data_frame' must be TRUE or FALSE.");
+    if (LOGICAL(data_frame)[0])
+        flags |= RMATIO_READ_DATA_FRAME;
+    if (!Rf_isLogical(stack_cells) || 1 != LENGTH(stack_cells)
+        || NA_LOGICAL == LOGICAL(stack_cells)[0])
+        Rf_error("'stack_cells' must be TRUE or FALSE.");
+    if (LOGICAL(stack_cells)[0])
+        flags |= RMATIO_READ_STACK_CELLS;
+
+    matvar = Mat_VarReadAt(mat, (long)REAL(fpos)[0]);
+    if (!matvar)
+        Rf_error("Error reading MAT file");
+
+    PROTECT(list = Rf_allocVector(VECSXP, 1));
+    err = read_matvar(list, 0, matvar, flags, &err_msg);
+    Mat_VarFree(matvar);
+    UNPROTECT(1);
 
-cleanup:
-    if (matvar)
-        Mat_VarFree(matvar);
-    if (mat)
-        Mat_Close(mat);
-    UNPROTECT(2);
     if (err)
         Rf_error("%s", err_msg);
 
-    return list;
+    return VECTOR_ELT(list, 0);
 }
 
 /** @brief Write matlab file
@@ -3281,26 +6414,34 @@ cleanup:
  *
  * @ingroup rmatio
  * @param list List of variables to write
- * @param filename Name of MAT file to create
+ * @param filename Name of MAT file to create, or R_NilValue to
+ * create the MAT file in memory
  * @param version MAT file version to create
  * @param compression Write the file with compression or not
- * @return R_NilValue.
+ * @param pack Store double and integer arrays in the smallest
+ * integer type that holds their values
+ * @param threads Number of threads to deflate a large variable with
+ * @param data_frame Write data.frames as structure arrays
+ * @return R_NilValue, or the MAT file as a raw vector if filename
+ * is R_NilValue.
  */
 SEXP
 write_mat(const SEXP list,
           const SEXP filename,
           const SEXP compression,
           const SEXP version,
-          const SEXP header)
+          const SEXP header,
+          const SEXP pack,
+          const SEXP threads,
+          const SEXP data_frame)
 {
     SEXP names;    /* names in list */
+    SEXP result = R_NilValue;
     mat_t *mat;
     int use_compression = MAT_COMPRESSION_NONE;
 
     if (Rf_isNull(list))
         Rf_error("'list' equals R_NilValue.");
-    if (Rf_isNull(filename))
-        Rf_error("'filename' equals R_NilValue.");
     if (Rf_isNull(compression))
         Rf_error("'compression' equals R_NilValue.");
     if (Rf_isNull(version))
@@ -3309,16 +6450,34 @@ write_mat(const SEXP list,
         Rf_error("'header' equals R_NilValue.");
     if (!Rf_isNewList(list))
         Rf_error("'list' must be a list.");
-    if (!Rf_isString(filename))
+    if (!Rf_isNull(filename) && !Rf_isString(filename))
         Rf_error("'filename' must be a string.");
-
-    mat = Mat_CreateVer(CHAR(STRING_ELT(filename, 0)),
-                        CHAR(STRING_ELT(header, 0)),
-                        INTEGER(version)[0]);
+    if (!Rf_isLogical(pack) || 1 != LENGTH(pack) || NA_LOGICAL == LOGICAL(pack)[0])
+        Rf_error("'pack' must be TRUE or FALSE.");
+    if (!Rf_isInteger(threads) || 1 != LENGTH(threads)
+        || NA_INTEGER == INTEGER(threads)[0] || INTEGER(threads)[0] < 1)
+        Rf_error("'threads' must be a positive integer.");
+    if (!Rf_isLogical(data_frame) || 1 != LENGTH(data_frame)
+        || NA_LOGICAL == LOGICAL(data_frame)[0])
+        Rf_error("'data_frame' must be TRUE or FALSE.");
+
+    if (Rf_isNull(filename)) {
+        mat = Mat_CreateMem(CHAR(STRING_ELT(header, 0)),
+                            INTEGER(version)[0]);
+    } else {
+        mat = Mat_CreateVer(CHAR(STRING_ELT(filename, 0)),
+                            CHAR(STRING_ELT(header, 0)),
+                            INTEGER(version)[0]);
+    }
     if (!mat)
         Rf_error("Unable to open file.");
+    Mat_SetWriteDataFunc(mat, write_deferred_data);
+    Mat_SetDataRegionFunc(mat, write_data_region);
+    Mat_SetDeflateThreads(mat, INTEGER(threads)[0]);
 
-    if (INTEGER(compression)[0])
+    if (2 == INTEGER(compression)[0])
+        use_compression = MAT_COMPRESSION_AUTO;
+    else if (INTEGER(compression)[0])
         use_compression = MAT_COMPRESSION_ZLIB;
 
     PROTECT(names = Rf_getAttrib(list, R_NamesSymbol));
@@ -3332,23 +6491,45 @@ write_mat(const SEXP list,
                        0,
                        0,
                        0,
-                       use_compression)) {
+                       use_compression,
+                       LOGICAL(pack)[0],
+                       LOGICAL(data_frame)[0])) {
             Mat_Close(mat);
+            if (MAT_FT_MAT4 == INTEGER(version)[0]) {
+                Rf_error("Unable to write '%s' to a MAT4 file, only "
+                         "2-dimensional double, integer, logical, "
+                         "character and sparse matrices are supported.",
+                         CHAR(STRING_ELT(names, i)));
+            }
             Rf_error("Unable to write list");
         }
     }
 
+    /* Copy a MAT file created in memory to a raw vector */
+    if (Rf_isNull(filename)) {
+        size_t size = Mat_MemSize(mat);
+
+        PROTECT(result = Rf_allocVector(RAWSXP, size));
+        if (Mat_MemCopy(mat, RAW(result), size) != size) {
+            Mat_Close(mat);
+            Rf_error("Unable to copy the MAT file from memory.");
+        }
+        UNPROTECT(1);
+    }
+
     Mat_Close(mat);
 
     UNPROTECT(1);
 
-    return R_NilValue;
+    return result;
 }
 
 static const R_CallMethodDef callMethods[] =
 {
-    {"read_mat", (DL_FUNC)&read_mat, 1},
-    {"write_mat", (DL_FUNC)&write_mat, 5},
+    {"read_mat", (DL_FUNC)&read_mat, 9},
+    {"read_mat_index", (DL_FUNC)&read_mat_index, 2},
+    {"read_mat_variable", (DL_FUNC)&read_mat_variable, 7},
+    {"write_mat", (DL_FUNC)&write_mat, 8},
     {NULL, NULL, 0}
 };
 
@@ -3364,4 +6545,8 @@ R_init_rmatio(DllInfo *info)
     R_registerRoutines(info, NULL, callMethods, NULL, NULL);
     R_useDynamicSymbols(info, FALSE);
     R_forceSymbols(info, TRUE);
+#if defined(RMATIO_ALTREP)
+    lazy_init(info);
+    narrow_init(info);
+#endif
 }